@@ -0,0 +1,172 @@
+#pragma once
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <iostream>
+#include <istream>
+#include <map>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "utils.hpp"
+
+namespace fs = std::filesystem;
+
+// Commands batch runs on the worlds of its jobs
+enum class batch_command { copy, compact, verify };
+
+const std::map<std::string, batch_command> batch_command_names{
+    {"copy", batch_command::copy},
+    {"compact", batch_command::compact},
+    {"verify", batch_command::verify},
+};
+
+struct batch_job {
+  batch_command command;
+  fs::path input;
+  // Only copy has one
+  fs::path output{};
+  // Line of the jobs file, to tell which job messages are about
+  size_t line = 0;
+  // Bytes of the files of the input, the biggest worlds are started first
+  uint64_t size = 0;
+  // Device of the input, see batch_scheduler
+  dev_t device = 0;
+};
+
+namespace batch_detail {
+uint64_t directory_size(const fs::path &dir) {
+  uint64_t size = 0;
+  std::error_code ec;
+  for (const auto &entry : fs::directory_iterator(dir, ec)) {
+    const auto file_size = entry.file_size(ec);
+    if (!ec) {
+      size += file_size;
+    }
+  }
+  return size;
+}
+}  // namespace batch_detail
+
+// Parses the jobs of batch, one per line as COMMAND INPUT [OUTPUT] with the
+// fields separated by whitespace, only copy takes an output. Empty lines and
+// the ones starting with # are skipped. Inputs have to exist, their size and
+// device are filled in.
+[[nodiscard]] bool parse_batch_jobs(std::istream &in,
+                                    std::vector<batch_job> &jobs) {
+  std::string line;
+  for (size_t number = 1; std::getline(in, line); number++) {
+    std::istringstream fields(line);
+    std::string command, input, output, extra;
+    if (!(fields >> command) || command[0] == '#') {
+      continue;
+    }
+    const auto name = batch_command_names.find(command);
+    if (name == batch_command_names.end()) {
+      std::cerr << "Line " << number << ": unknown command " << command
+                << ", expected copy, compact or verify" << std::endl;
+      return false;
+    }
+    batch_job job{name->second, {}, {}, number};
+    const bool has_output = job.command == batch_command::copy;
+    if (!(fields >> input) || (has_output && !(fields >> output)) ||
+        fields >> extra) {
+      std::cerr << "Line " << number << ": expected " << command
+                << (has_output ? " INPUT OUTPUT" : " INPUT") << std::endl;
+      return false;
+    }
+    job.input = input;
+    job.output = output;
+    struct stat info;
+    if (stat(job.input.c_str(), &info) != 0 || !S_ISDIR(info.st_mode)) {
+      std::cerr << "Line " << number << ": input " << job.input
+                << " is not a directory" << std::endl;
+      return false;
+    }
+    job.device = info.st_dev;
+    job.size = batch_detail::directory_size(job.input);
+    jobs.push_back(std::move(job));
+  }
+  return true;
+}
+
+// Hands out the jobs of batch to its workers, biggest first so the small
+// ones fill the gaps at the end. When per_device is set, jobs whose input
+// is on a device that already has that many running are passed over for
+// the next ones, so a worker that frees up takes work from another device
+// instead of waiting.
+class batch_scheduler {
+ public:
+  UTILS_NOT_COPYABLE(batch_scheduler)
+  UTILS_NOT_MOVEABLE(batch_scheduler)
+  batch_scheduler(const std::vector<batch_job> &jobs, const size_t per_device)
+      : jobs(jobs), per_device(per_device), pending(jobs.size()) {
+    std::iota(pending.begin(), pending.end(), size_t{0});
+    std::stable_sort(pending.begin(), pending.end(),
+                     [&](const size_t a, const size_t b) {
+                       return jobs[a].size > jobs[b].size;
+                     });
+  }
+
+  // Waits until one can start, empty once every job was handed out
+  std::optional<size_t> next() {
+    std::unique_lock lock(mutex);
+    while (!pending.empty()) {
+      const auto it = std::find_if(
+          pending.begin(), pending.end(), [&](const size_t job) {
+            return per_device == 0 || running[jobs[job].device] < per_device;
+          });
+      if (it != pending.end()) {
+        const auto job = *it;
+        pending.erase(it);
+        running[jobs[job].device]++;
+        return job;
+      }
+      changed.wait(lock);
+    }
+    return {};
+  }
+
+  void finished(const size_t job) {
+    std::unique_lock lock(mutex);
+    running[jobs[job].device]--;
+    changed.notify_all();
+  }
+
+ private:
+  const std::vector<batch_job> &jobs;
+  const size_t per_device;
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::vector<size_t> pending;
+  std::map<dev_t, size_t> running{};
+};
+
+// Runs func(i) for every job on up to workers threads, see batch_scheduler
+template <typename Func>
+void run_batch(const std::vector<batch_job> &jobs, const size_t workers,
+               const size_t per_device, Func &&func) {
+  batch_scheduler scheduler(jobs, per_device);
+  auto worker = [&]() {
+    while (const auto job = scheduler.next()) {
+      func(*job);
+      scheduler.finished(*job);
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < std::min(workers, jobs.size()); i++) {
+    threads.emplace_back(worker);
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
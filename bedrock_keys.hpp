@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+
+// Layout of the keys Bedrock stores in its world DB, see
+// https://minecraft.wiki/w/Bedrock_Edition_level_format#Chunk_key_format
+
+namespace bedrock_keys {
+// Chunk records are keyed by x, z, an optional dimension (all int32 little
+// endian), a tag byte and, for sub chunks, the sub chunk index
+constexpr size_t overworld_chunk_key_size = 4 + 4 + 1;
+constexpr size_t dimension_chunk_key_size = 4 + 4 + 4 + 1;
+
+// Tags go from Data3D (43) to AabbVolumes (65), plus the legacy version tag
+// 'v'. Bytes outside of that range mean the key is something else, like a
+// player or village key that happens to have the same size.
+constexpr bool is_record_tag(const unsigned char tag) {
+  return (tag >= 43 && tag <= 65) || tag == 'v';
+}
+
+// Tag byte of a chunk record, keys with any other layout have none
+std::optional<unsigned char> record_tag(const std::string_view key) {
+  size_t tag_offset;
+  switch (key.size()) {
+    case overworld_chunk_key_size:
+    case overworld_chunk_key_size + 1:
+      tag_offset = overworld_chunk_key_size - 1;
+      break;
+    case dimension_chunk_key_size:
+    case dimension_chunk_key_size + 1:
+      tag_offset = dimension_chunk_key_size - 1;
+      break;
+    default:
+      return {};
+  }
+  const auto tag = static_cast<unsigned char>(key[tag_offset]);
+  if (!is_record_tag(tag)) {
+    return {};
+  }
+  return tag;
+}
+
+// Fields of a chunk record key
+struct chunk_key {
+  int32_t x;
+  int32_t z;
+  // 0 for the overworld, whose keys don't store it
+  int32_t dimension;
+  unsigned char tag;
+  std::optional<int8_t> sub_chunk;
+};
+
+int32_t read_int32(const std::string_view bytes) {
+  uint32_t value = 0;
+  for (size_t i = 0; i < 4; i++) {
+    value |= uint32_t{static_cast<unsigned char>(bytes[i])} << (i * 8);
+  }
+  return static_cast<int32_t>(value);
+}
+
+std::string int32_bytes(const int32_t value) {
+  std::string bytes(4, '\0');
+  for (size_t i = 0; i < 4; i++) {
+    bytes[i] = static_cast<char>(static_cast<uint32_t>(value) >> (i * 8));
+  }
+  return bytes;
+}
+
+std::optional<chunk_key> parse_chunk_key(const std::string_view key) {
+  const auto tag = record_tag(key);
+  if (!tag) {
+    return {};
+  }
+  const bool has_dimension = key.size() >= dimension_chunk_key_size;
+  const auto tag_offset = has_dimension ? dimension_chunk_key_size - 1
+                                        : overworld_chunk_key_size - 1;
+  chunk_key chunk{read_int32(key.substr(0, 4)), read_int32(key.substr(4, 4)),
+                  has_dimension ? read_int32(key.substr(8, 4)) : 0, *tag,
+                  {}};
+  if (key.size() > tag_offset + 1) {
+    chunk.sub_chunk = static_cast<int8_t>(key[tag_offset + 1]);
+  }
+  return chunk;
+}
+
+// Keys of every record of a chunk start with these 8 bytes
+std::string chunk_prefix(const int32_t x, const int32_t z) {
+  return int32_bytes(x) + int32_bytes(z);
+}
+
+// What follows chunk_prefix in the keys of a dimension, before the tag
+std::string dimension_bytes(const int32_t dimension) {
+  return dimension == 0 ? std::string() : int32_bytes(dimension);
+}
+
+// Smallest and largest record tags. In the keys of other dimensions the byte
+// after the chunk prefix is part of the dimension instead.
+constexpr unsigned char first_record_tag = 43;
+constexpr unsigned char last_record_tag = 'v';
+}  // namespace bedrock_keys
@@ -0,0 +1,452 @@
+// Generates synthetic worlds and times the main binary on them. Every
+// command runs as a child process so its peak RSS can be read from wait4.
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "args/args.hxx"
+#include "db_options.hpp"
+#include "leveldb/zlib_compressor.h"
+#include "manifest.hpp"
+#include "table/format.h"
+#include "tables.hpp"
+#include "utils.hpp"
+#include "world_gen.hpp"
+
+namespace fs = std::filesystem;
+
+struct run_result {
+  bool ok;
+  double seconds;
+  // In KiB, as reported by getrusage
+  long max_rss;
+};
+
+run_result run_command(const std::vector<std::string> &argv) {
+  std::vector<char *> c_argv;
+  for (const auto &arg : argv) {
+    c_argv.push_back(const_cast<char *>(arg.c_str()));
+  }
+  c_argv.push_back(nullptr);
+  const auto start = std::chrono::steady_clock::now();
+  const auto pid = fork();
+  if (pid < 0) {
+    return {false, 0, 0};
+  }
+  if (pid == 0) {
+    // The commands' own progress output isn't part of the report
+    freopen("/dev/null", "w", stdout);
+    execv(c_argv[0], c_argv.data());
+    _exit(127);
+  }
+  int wstatus;
+  rusage usage;
+  if (wait4(pid, &wstatus, 0, &usage) < 0) {
+    return {false, 0, 0};
+  }
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return {WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0, elapsed.count(),
+          usage.ru_maxrss};
+}
+
+// Compressor names as taken by --compression, none writes uncompressed blocks
+std::optional<output_compression> parse_bench_compression(
+    const std::string &spec) {
+  if (spec == "none") {
+    return output_compression{};
+  }
+  return parse_output_compression(spec);
+}
+
+int generate_world(const fs::path &out, const output_compression &compression,
+                   const uint64_t chunks, const uint64_t seed,
+                   world_gen::world_stats &stats) {
+  std::error_code ec;
+  fs::remove_all(out, ec);
+  auto opts = bedrock_default_db_options(
+      compression.make_compressors(/*only_output=*/true));
+  opts.modify([](auto &opts) {
+    opts.create_if_missing = true;
+    opts.error_if_exists = true;
+  });
+  auto [db, status] = open_db(std::move(opts), out);
+  if (!status.ok()) {
+    std::cerr << "Failed to create " << out << ": " << status.ToString()
+              << std::endl;
+    return 1;
+  }
+  status = world_gen::generator(seed).write(*db, chunks, stats);
+  if (status.ok()) {
+    // Leaves every key in compressed tables rather than in the log
+    db->CompactRange(nullptr, nullptr);
+  }
+  if (!status.ok()) {
+    std::cerr << "Failed to write " << out << ": " << status.ToString()
+              << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+void print_header() {
+  std::cout << std::left << std::setw(12) << "command" << std::setw(12)
+            << "input" << std::setw(12) << "output" << std::right
+            << std::setw(10) << "seconds" << std::setw(14) << "keys/s"
+            << std::setw(10) << "MB/s" << std::setw(12) << "peak RSS"
+            << std::endl;
+}
+
+// Prints a row of the results, returns whether the command succeeded
+bool print_result(const std::string &command, const std::string &input,
+                  const std::string &output, const run_result &result,
+                  const world_gen::world_stats &stats) {
+  std::cout << std::left << std::setw(12) << command << std::setw(12)
+            << input << std::setw(12) << output << std::right << std::fixed
+            << std::setprecision(3) << std::setw(10) << result.seconds;
+  if (!result.ok) {
+    std::cout << "  FAILED" << std::endl;
+    return false;
+  }
+  std::cout << std::setprecision(0) << std::setw(14)
+            << stats.keys / result.seconds << std::setprecision(1)
+            << std::setw(10) << stats.bytes / result.seconds / 1e6
+            << std::setw(9) << result.max_rss / 1024 << "MiB" << std::endl;
+  return true;
+}
+
+// Dump's escaping alone, on the keys and values of a world
+void bench_bytes_repr(const fs::path &world,
+                      const world_gen::world_stats &stats) {
+  auto [db, status] = open_db(bedrock_default_db_options(make_compressors()),
+                              world);
+  if (!status.ok()) {
+    std::cerr << "Failed to open " << world << ": " << status.ToString()
+              << std::endl;
+    return;
+  }
+  std::vector<std::string> pairs;
+  auto iter = std::unique_ptr<ldb::Iterator>(db->NewIterator({}));
+  for (iter->SeekToFirst(); iter->Valid(); iter->Next()) {
+    pairs.push_back(iter->key().ToString());
+    pairs.push_back(iter->value().ToString());
+  }
+  std::string output;
+  const auto start = std::chrono::steady_clock::now();
+  for (const auto &data : pairs) {
+    output.clear();
+    python_bytes_repr(output, data);
+  }
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  run_result result{true, elapsed.count(), 0};
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  result.max_rss = usage.ru_maxrss;
+  print_result("bytes-repr", "-", "-", result, stats);
+}
+
+// Decoded data blocks of the tables of a world, until there are limit bytes
+// of them
+ldb::Status read_data_blocks(const fs::path &world, const uint64_t limit,
+                             std::vector<std::string> &blocks) {
+  auto opts = bedrock_input_db_options(make_compressors());
+  db_manifest manifest;
+  auto status = read_manifest(opts->env, world, manifest);
+  if (!status.ok()) {
+    return status;
+  }
+  const table_options table_opts(*opts);
+  auto ropts = ldb::ReadOptions();
+  ropts.verify_checksums = true;
+  block_sampler sampler(1);
+  uint64_t total = 0;
+  for (const auto &[_, file] : manifest.files) {
+    status = for_each_sampled_block(
+        table_opts, world, file, sampler,
+        [&](ldb::RandomAccessFile &data, const ldb::BlockHandle &handle) {
+          if (total >= limit) {
+            return ldb::Status::OK();
+          }
+          ldb::BlockContents contents;
+          auto status =
+              ldb::ReadBlock(&data, *table_opts, ropts, handle, &contents);
+          if (!status.ok()) {
+            return status;
+          }
+          std::unique_ptr<const char[]> owned(
+              contents.heap_allocated ? contents.data.data() : nullptr);
+          blocks.emplace_back(contents.data.data(), contents.data.size());
+          total += contents.data.size();
+          return status;
+        });
+    if (!status.ok() || total >= limit) {
+      return status;
+    }
+  }
+  return status;
+}
+
+// Compresses the blocks with zlib and libdeflate, when built with it, and
+// decompresses what zlib compressed with each, the same as reading a world
+// Bedrock wrote
+int bench_deflate(const std::vector<std::string> &blocks) {
+  std::vector<std::pair<std::string, std::unique_ptr<ldb::Compressor>>> impls;
+  impls.emplace_back("zlib", std::make_unique<ldb::ZlibCompressorRaw>());
+  impls.emplace_back("zlib", std::make_unique<ldb::ZlibCompressor>());
+#ifdef BEDROCK_UNZ_LIBDEFLATE
+  impls.emplace_back("libdeflate",
+                     std::make_unique<libdeflate_zlib_compressor<true>>());
+  impls.emplace_back("libdeflate",
+                     std::make_unique<libdeflate_zlib_compressor<false>>());
+#endif
+  uint64_t raw_bytes = 0;
+  for (const auto &block : blocks) {
+    raw_bytes += block.size();
+  }
+  using clock = std::chrono::steady_clock;
+  const auto seconds_since = [](const clock::time_point start) {
+    return std::chrono::duration<double>(clock::now() - start).count();
+  };
+
+  std::cout << std::left << std::setw(12) << "format" << std::setw(12)
+            << "impl" << std::right << std::setw(10) << "ratio"
+            << std::setw(16) << "compress MB/s" << std::setw(18)
+            << "decompress MB/s" << std::endl;
+  // zlib's blocks by compression ID
+  std::map<int, std::vector<std::string>> zlib_blocks;
+  for (const auto &[name, compressor] : impls) {
+    const auto id = compressor->uniqueCompressionID;
+    std::vector<std::string> compressed(blocks.size());
+    uint64_t compressed_bytes = 0;
+    auto start = clock::now();
+    for (size_t i = 0; i < blocks.size(); i++) {
+      compressor->compressImpl(blocks[i].data(), blocks[i].size(),
+                               compressed[i]);
+      compressed_bytes += compressed[i].size();
+    }
+    const auto compress_seconds = seconds_since(start);
+    if (zlib_blocks.find(id) == zlib_blocks.end()) {
+      zlib_blocks[id] = std::move(compressed);
+    }
+
+    const auto &input = zlib_blocks[id];
+    std::string output;
+    double decompress_seconds = 0;
+    for (size_t i = 0; i < blocks.size(); i++) {
+      output.clear();
+      start = clock::now();
+      const bool ok =
+          compressor->decompress(input[i].data(), input[i].size(), output);
+      decompress_seconds += seconds_since(start);
+      if (!ok || output != blocks[i]) {
+        std::cerr << name << " failed to decompress block " << i
+                  << std::endl;
+        return 1;
+      }
+    }
+    std::cout << std::left << std::setw(12)
+              << compressor_name(static_cast<hackdb::compression_id_t>(id))
+              << std::setw(12) << name << std::right << std::fixed
+              << std::setprecision(3) << std::setw(10)
+              << static_cast<double>(compressed_bytes) / raw_bytes
+              << std::setprecision(1) << std::setw(16)
+              << raw_bytes / compress_seconds / 1e6 << std::setw(18)
+              << raw_bytes / decompress_seconds / 1e6 << std::endl;
+  }
+  return 0;
+}
+
+struct bench_config {
+  fs::path main_path;
+  fs::path work_dir;
+  uint64_t chunks;
+  uint64_t seed;
+  std::vector<std::string> inputs;
+  std::vector<std::string> outputs;
+};
+
+int run_benchmarks(const bench_config &config) {
+  std::vector<std::pair<std::string, output_compression>> inputs, outputs;
+  for (auto [names, parsed] : {std::pair{&config.inputs, &inputs},
+                               std::pair{&config.outputs, &outputs}}) {
+    for (const auto &name : *names) {
+      const auto compression = parse_bench_compression(name);
+      if (!compression) {
+        return 1;
+      }
+      parsed->emplace_back(name, *compression);
+    }
+  }
+  fs::create_directories(config.work_dir);
+  const auto main_path = config.main_path.string();
+  print_header();
+  // Any command failing fails the run, including on arguments main no longer
+  // parses
+  bool all_ok = true;
+  for (const auto &[input_name, input_compression] : inputs) {
+    const auto world = config.work_dir / ("in-" + input_name);
+    world_gen::world_stats stats;
+    if (generate_world(world, input_compression, config.chunks, config.seed,
+                       stats) != 0) {
+      return 1;
+    }
+    all_ok &= print_result(
+        "list-algos", input_name, "-",
+        run_command({main_path, "-i", world, "list-algos"}), stats);
+    all_ok &= print_result(
+        "dump", input_name, "-",
+        run_command({main_path, "-i", world, "dump", "-o", "/dev/null"}),
+        stats);
+    for (const auto &[output_name, output_compression] : outputs) {
+      const auto out = config.work_dir / ("out-" + output_name);
+      std::vector<std::string> copy_args = {main_path, "-i", world, "copy",
+                                            "-o"};
+      if (output_compression.enabled()) {
+        // The default compressor through a bare -c right before the output,
+        // the run fails if -c ever takes the output as its value again
+        copy_args.push_back(output_name == "zlib-raw"
+                                ? "-c"
+                                : "--compression=" + output_name);
+      }
+      copy_args.push_back(out);
+      all_ok &= print_result("copy", input_name, output_name,
+                             run_command(copy_args), stats);
+      // Reads every block of the copy to check its compressors, then empties
+      // it
+      all_ok &= print_result(
+          "clear", output_name, "none",
+          run_command({main_path, "-i", out, "clear", "--safe"}), stats);
+      std::error_code ec;
+      fs::remove_all(out, ec);
+    }
+    if (&input_name == &inputs.front().first) {
+      bench_bytes_repr(world, stats);
+    }
+  }
+  return all_ok ? 0 : 1;
+}
+
+std::vector<std::string> split_list(const std::string &list) {
+  std::vector<std::string> items;
+  std::stringstream stream(list);
+  std::string item;
+  while (std::getline(stream, item, ',')) {
+    if (!item.empty()) {
+      items.push_back(item);
+    }
+  }
+  return items;
+}
+
+int main(int argc, const char **argv) {
+  args::ArgumentParser parser("Benchmarks for bedrock-unz");
+  args::HelpFlag help(parser, "help", "Display this help menu", {'h', "help"});
+  args::ValueFlag<uint64_t> chunks(parser, "chunks", "Chunks in each world",
+                                   {"chunks"}, 4096);
+  args::ValueFlag<uint64_t> seed(parser, "seed", "Seed of the generator",
+                                 {"seed"}, 1);
+  int code = 0;
+  args::Group commands(parser, "commands");
+  args::Command generate(
+      commands, "generate", "Write a synthetic world",
+      [&](args::Subparser &subp) {
+        auto out = args::Positional<fs::path>(
+            subp, "out", "Output DB directory", args::Options::Required);
+        auto compress = args::ValueFlag<std::string>(
+            subp, "compress", "Block compression, none or NAME[:LEVEL]",
+            {'c', "compress"}, "zlib-raw");
+        subp.Parse();
+        const auto compression = parse_bench_compression(*compress);
+        if (!compression) {
+          code = 1;
+          return;
+        }
+        world_gen::world_stats stats;
+        code = generate_world(*out, *compression, *chunks, *seed, stats);
+        if (code == 0) {
+          std::cout << "Wrote " << stats.keys << " keys, " << stats.bytes
+                    << " bytes" << std::endl;
+        }
+      });
+  args::Command run(
+      commands, "run", "Time every command for each compressor pair",
+      [&](args::Subparser &subp) {
+        auto main_path = args::Positional<fs::path>(
+            subp, "main", "Path to the main binary", args::Options::Required);
+        auto work_dir = args::ValueFlag<fs::path>(
+            subp, "dir", "Where worlds are written", {"work-dir"},
+            fs::temp_directory_path() / "bedrock-unz-bench");
+        auto inputs = args::ValueFlag<std::string>(
+            subp, "list", "Comma separated input compressors", {"inputs"},
+            "zlib-raw,zstd");
+        auto outputs = args::ValueFlag<std::string>(
+            subp, "list", "Comma separated output compressors", {"outputs"},
+            "none,zlib-raw,zstd");
+        subp.Parse();
+        code = run_benchmarks({*main_path, *work_dir, *chunks, *seed,
+                               split_list(*inputs), split_list(*outputs)});
+      });
+  args::Command deflate(
+      commands, "deflate",
+      "Time zlib and libdeflate on the data blocks of a world",
+      [&](args::Subparser &subp) {
+        auto world = args::ValueFlag<fs::path>(
+            subp, "dir",
+            "World whose blocks are used, by default one of --chunks chunks "
+            "is generated",
+            {"world"});
+        auto work_dir = args::ValueFlag<fs::path>(
+            subp, "dir", "Where the world is generated", {"work-dir"},
+            fs::temp_directory_path() / "bedrock-unz-bench");
+        auto max_mb = args::ValueFlag<uint64_t>(
+            subp, "MB", "Most decoded MB of blocks used", {"max-mb"}, 256);
+        subp.Parse();
+        auto path = world ? *world : *work_dir / "deflate";
+        if (!world) {
+          fs::create_directories(*work_dir);
+          world_gen::world_stats stats;
+          code = generate_world(path, *parse_output_compression("zlib-raw"),
+                                *chunks, *seed, stats);
+          if (code != 0) {
+            return;
+          }
+        }
+        std::vector<std::string> blocks;
+        const auto status =
+            read_data_blocks(path, *max_mb * 1000000, blocks);
+        if (!status.ok()) {
+          std::cerr << "Failed to read blocks of " << path << ": "
+                    << status.ToString() << std::endl;
+          code = 1;
+          return;
+        }
+        if (blocks.empty()) {
+          std::cerr << path << " has no data blocks" << std::endl;
+          code = 1;
+          return;
+        }
+        code = bench_deflate(blocks);
+      });
+  try {
+    parser.ParseCLI(argc, argv);
+  } catch (const args::Help &) {
+    std::cout << parser;
+    return 0;
+  } catch (const args::Error &e) {
+    std::cerr << e.what() << std::endl << parser;
+    return 1;
+  }
+  return code;
+}
@@ -0,0 +1,222 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <iterator>
+#include <random>
+#include <string>
+
+#include "leveldb/db.h"
+#include "leveldb/write_batch.h"
+
+namespace ldb = leveldb;
+
+// Writes a world with the key layout Bedrock uses, chunk records keyed by
+// x, z, dimension (outside the overworld), tag and sub chunk index. Values
+// aren't valid NBT or sub chunks, they only have sizes and redundancy close
+// to the real ones so compressors behave the same way on them.
+namespace world_gen {
+using namespace std::string_literals;
+
+struct world_stats {
+  uint64_t keys = 0;
+  uint64_t bytes = 0;
+};
+
+// Record tags from https://minecraft.wiki/w/Bedrock_Edition_level_format
+enum tag : char {
+  data_3d = 43,
+  version = 44,
+  sub_chunk_prefix = 47,
+  block_entity = 49,
+  entity = 50,
+  finalized_state = 54,
+  biome_state = 59,
+};
+
+class generator {
+ public:
+  explicit generator(const uint64_t seed) : rng(seed) {}
+
+  // Chunks are laid out in a square around the origin, one in eight goes to
+  // the nether instead
+  ldb::Status write(ldb::DB &db, const uint64_t chunks, world_stats &stats) {
+    auto wopts = ldb::WriteOptions();
+    ldb::WriteBatch batch;
+    const auto side = static_cast<int32_t>(std::ceil(std::sqrt(chunks)));
+    uint64_t written = 0;
+    for (int32_t x = -side / 2; written < chunks; x++) {
+      for (int32_t z = -side / 2; z < side / 2 + 1 && written < chunks; z++) {
+        const int32_t dimension = chance(8) ? 1 : 0;
+        add_chunk(batch, x, z, dimension, stats);
+        written++;
+        if (batch.ApproximateSize() >= batch_size) {
+          auto status = db.Write(wopts, &batch);
+          if (!status.ok()) {
+            return status;
+          }
+          batch.Clear();
+        }
+      }
+    }
+    add_globals(batch, chunks, stats);
+    return db.Write(wopts, &batch);
+  }
+
+ private:
+  static constexpr size_t batch_size = 4 << 20;
+
+  bool chance(const int one_in) {
+    return std::uniform_int_distribution<int>(0, one_in - 1)(rng) == 0;
+  }
+  int uniform(const int min, const int max) {
+    return std::uniform_int_distribution<int>(min, max)(rng);
+  }
+
+  static void append_int32(std::string &out, const int32_t value) {
+    for (int i = 0; i < 4; i++) {
+      out += static_cast<char>((static_cast<uint32_t>(value) >> (i * 8)));
+    }
+  }
+
+  static std::string chunk_key(const int32_t x, const int32_t z,
+                               const int32_t dimension, const tag record) {
+    std::string key;
+    append_int32(key, x);
+    append_int32(key, z);
+    if (dimension != 0) {
+      append_int32(key, dimension);
+    }
+    key += record;
+    return key;
+  }
+
+  void put(ldb::WriteBatch &batch, const std::string &key,
+           const std::string &value, world_stats &stats) {
+    batch.Put(key, value);
+    stats.keys++;
+    stats.bytes += key.size() + value.size();
+  }
+
+  // NBT strings are what makes most values compressible
+  void append_block_name(std::string &out) {
+    static const char *const names[] = {
+        "minecraft:stone",     "minecraft:dirt",      "minecraft:grass",
+        "minecraft:air",       "minecraft:water",     "minecraft:deepslate",
+        "minecraft:coal_ore",  "minecraft:iron_ore",  "minecraft:gravel",
+        "minecraft:bedrock",   "minecraft:oak_log",   "minecraft:sand"};
+    const std::string name = names[uniform(0, std::size(names) - 1)];
+    out += "\x0a\x00\x00\x08\x04\x00name"s;
+    out += static_cast<char>(name.size());
+    out += '\0';
+    out += name;
+    out += "\x0a\x06\x00states\x00\x03\x07\x00version\x01\x12\x13\x01\x00"s;
+  }
+
+  // Packed block indices use few bits per block and mostly repeat the same
+  // few palette entries
+  std::string sub_chunk(const int8_t y) {
+    const int bits = uniform(1, 5);
+    const int palette_size = uniform(2, 1 << bits);
+    std::string value{9, 1, static_cast<char>(y), static_cast<char>(bits << 1)};
+    const int blocks_per_word = 32 / bits;
+    const int words = (4096 + blocks_per_word - 1) / blocks_per_word;
+    uint32_t run_value = 0;
+    for (int i = 0; i < words; i++) {
+      uint32_t word = 0;
+      for (int j = 0; j < blocks_per_word; j++) {
+        if (chance(6)) {
+          run_value = uniform(0, palette_size - 1);
+        }
+        word |= run_value << (j * bits);
+      }
+      append_int32(value, static_cast<int32_t>(word));
+    }
+    append_int32(value, palette_size);
+    for (int i = 0; i < palette_size; i++) {
+      append_block_name(value);
+    }
+    return value;
+  }
+
+  std::string data_3d_value() {
+    std::string value;
+    // Height map, 256 int16 around sea level
+    for (int i = 0; i < 256; i++) {
+      const auto height = static_cast<uint16_t>(64 + uniform(-4, 12));
+      value += static_cast<char>(height & 0xff);
+      value += static_cast<char>(height >> 8);
+    }
+    // One biome palette per sub chunk, mostly a single biome
+    for (int i = 0; i < 24; i++) {
+      value += static_cast<char>(chance(4) ? 3 : 1);
+      append_int32(value, uniform(0, 40));
+    }
+    return value;
+  }
+
+  std::string nbt_blob(const size_t min, const size_t max) {
+    static const char *const fields[] = {"id", "x", "y", "z", "Items",
+                                         "CustomName", "isMovable", "Count",
+                                         "Damage", "Slot", "Name"};
+    std::string value;
+    const auto size = uniform(min, max);
+    while (value.size() < static_cast<size_t>(size)) {
+      value += static_cast<char>(uniform(1, 10));
+      const std::string field = fields[uniform(0, std::size(fields) - 1)];
+      value += static_cast<char>(field.size());
+      value += '\0';
+      value += field;
+      append_int32(value, uniform(-1000, 1000));
+    }
+    return value;
+  }
+
+  void add_chunk(ldb::WriteBatch &batch, const int32_t x, const int32_t z,
+                 const int32_t dimension, world_stats &stats) {
+    put(batch, chunk_key(x, z, dimension, version), "\x28", stats);
+    put(batch, chunk_key(x, z, dimension, finalized_state),
+        "\x02\x00\x00\x00"s, stats);
+    put(batch, chunk_key(x, z, dimension, data_3d), data_3d_value(), stats);
+    const int lowest = dimension == 0 ? -4 : 0;
+    const int sub_chunks = uniform(6, dimension == 0 ? 16 : 8);
+    for (int i = 0; i < sub_chunks; i++) {
+      const auto y = static_cast<int8_t>(lowest + i);
+      put(batch,
+          chunk_key(x, z, dimension, sub_chunk_prefix) + static_cast<char>(y),
+          sub_chunk(y), stats);
+    }
+    if (chance(3)) {
+      put(batch, chunk_key(x, z, dimension, block_entity), nbt_blob(80, 4000),
+          stats);
+    }
+    if (chance(4)) {
+      put(batch, chunk_key(x, z, dimension, entity), nbt_blob(200, 1500),
+          stats);
+    }
+    if (chance(2)) {
+      put(batch, chunk_key(x, z, dimension, biome_state), nbt_blob(16, 64),
+          stats);
+    }
+  }
+
+  void add_globals(ldb::WriteBatch &batch, const uint64_t chunks,
+                   world_stats &stats) {
+    put(batch, "~local_player", nbt_blob(2000, 6000), stats);
+    put(batch, "portals", nbt_blob(100, 400), stats);
+    put(batch, "mobevents", nbt_blob(50, 100), stats);
+    put(batch, "scoreboard", nbt_blob(50, 200), stats);
+    put(batch, "BiomeData", nbt_blob(500, 2000), stats);
+    put(batch, "Overworld", nbt_blob(100, 300), stats);
+    // Newer worlds keep entities in their own keys instead of chunk records
+    for (uint64_t i = 0; i < chunks / 4; i++) {
+      std::string key = "actorprefix";
+      append_int32(key, static_cast<int32_t>(i));
+      append_int32(key, 1);
+      put(batch, key, nbt_blob(300, 1200), stats);
+    }
+  }
+
+  std::mt19937_64 rng;
+};
+}  // namespace world_gen
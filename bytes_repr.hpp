@@ -0,0 +1,259 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define BYTES_REPR_X86 1
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define BYTES_REPR_NEON 1
+#include <arm_neon.h>
+#endif
+
+// Kernels behind python_bytes_repr. Every kernel writes the escaped form of
+// its input starting at out and returns where it stopped, out must have room
+// for 4 bytes per input byte. Bytes are either plain (copied as is), escaped
+// with a backslash (quote, backslash, \t, \n and \r) or written as \xNN.
+namespace bytes_repr {
+
+// Escaped form of every byte, padded to 4 chars so that copying it doesn't
+// depend on its size
+struct escape_table {
+  std::array<std::array<char, 4>, 256> chars{};
+  std::array<uint8_t, 256> sizes{};
+
+  explicit escape_table(const char quote) {
+    constexpr auto hexdigits = "0123456789abcdef";
+    for (int c = 0; c < 256; c++) {
+      if (c == quote || c == '\\') {
+        set(c, {'\\', static_cast<char>(c)}, 2);
+      } else if (c == '\t') {
+        set(c, {'\\', 't'}, 2);
+      } else if (c == '\n') {
+        set(c, {'\\', 'n'}, 2);
+      } else if (c == '\r') {
+        set(c, {'\\', 'r'}, 2);
+      } else if (c < ' ' || c >= 0x7f) {
+        set(c, {'\\', 'x', hexdigits[c >> 4], hexdigits[c & 0xf]}, 4);
+      } else {
+        set(c, {static_cast<char>(c)}, 1);
+      }
+    }
+  }
+
+ private:
+  void set(const int c, const std::array<char, 4> &escaped,
+           const uint8_t size) {
+    chars[c] = escaped;
+    sizes[c] = size;
+  }
+};
+
+const escape_table &get_escape_table(const char quote) {
+  static const escape_table double_quoted('"');
+  static const escape_table single_quoted('\'');
+  return quote == '"' ? double_quoted : single_quoted;
+}
+
+// One byte at a time without branching on the byte
+inline char *repr_scalar(char *out, const unsigned char *in, const size_t size,
+                         const escape_table &table) {
+  for (size_t i = 0; i < size; i++) {
+    std::memcpy(out, table.chars[in[i]].data(), 4);
+    out += table.sizes[in[i]];
+  }
+  return out;
+}
+
+char *repr_generic(char *out, const unsigned char *in, const size_t size,
+                   const escape_table &table, const char) {
+  return repr_scalar(out, in, size, table);
+}
+
+#ifdef BYTES_REPR_X86
+// 0-15 to '0'-'9', 'a'-'f'
+inline __m128i hex_digits_sse2(const __m128i nibbles) {
+  const auto digits = _mm_add_epi8(nibbles, _mm_set1_epi8('0'));
+  const auto letters = _mm_and_si128(_mm_cmpgt_epi8(nibbles, _mm_set1_epi8(9)),
+                                     _mm_set1_epi8('a' - '0' - 10));
+  return _mm_add_epi8(digits, letters);
+}
+
+// Writes 16 bytes as \xNN
+inline char *repr_hex_sse2(char *out, const __m128i bytes) {
+  const auto low_nibble = _mm_set1_epi8(0x0f);
+  const auto high = hex_digits_sse2(
+      _mm_and_si128(_mm_srli_epi16(bytes, 4), low_nibble));
+  const auto low = hex_digits_sse2(_mm_and_si128(bytes, low_nibble));
+  // '\\' then 'x' in memory
+  const auto prefix = _mm_set1_epi16(('x' << 8) | '\\');
+  const auto first_pairs = _mm_unpacklo_epi8(high, low);
+  const auto second_pairs = _mm_unpackhi_epi8(high, low);
+  auto *dst = reinterpret_cast<__m128i *>(out);
+  _mm_storeu_si128(dst + 0, _mm_unpacklo_epi16(prefix, first_pairs));
+  _mm_storeu_si128(dst + 1, _mm_unpackhi_epi16(prefix, first_pairs));
+  _mm_storeu_si128(dst + 2, _mm_unpacklo_epi16(prefix, second_pairs));
+  _mm_storeu_si128(dst + 3, _mm_unpackhi_epi16(prefix, second_pairs));
+  return out + 64;
+}
+
+struct sse2_classes {
+  __m128i plain;
+  __m128i hex;
+};
+
+// Masks of the bytes that are copied as is and of the ones written as \xNN
+inline sse2_classes classify_sse2(const __m128i bytes, const char quote) {
+  // Signed compare, bytes from 0x80 are negative and fail it too
+  const auto printable =
+      _mm_andnot_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(0x7f)),
+                       _mm_cmpgt_epi8(bytes, _mm_set1_epi8(0x1f)));
+  const auto quoted =
+      _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(quote)),
+                   _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\\')));
+  const auto whitespace =
+      _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('\t')),
+                                _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\n'))),
+                   _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\r')));
+  return {_mm_andnot_si128(quoted, printable),
+          _mm_andnot_si128(_mm_or_si128(printable, whitespace),
+                           _mm_set1_epi8(-1))};
+}
+
+// Blocks that are all plain or all hex are written at once, mixed blocks
+// copy their leading plain run at once and go byte by byte after it
+char *repr_sse2(char *out, const unsigned char *in, const size_t size,
+                const escape_table &table, const char quote) {
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    const auto bytes =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+    const auto classes = classify_sse2(bytes, quote);
+    const unsigned plain = _mm_movemask_epi8(classes.plain);
+    if (plain == 0xffff) {
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(out), bytes);
+      out += 16;
+      continue;
+    }
+    if (_mm_movemask_epi8(classes.hex) == 0xffff) {
+      out = repr_hex_sse2(out, bytes);
+      continue;
+    }
+    const auto run = __builtin_ctz(~plain);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out), bytes);
+    out = repr_scalar(out + run, in + i + run, 16 - run, table);
+  }
+  return repr_scalar(out, in + i, size - i, table);
+}
+
+// Same as repr_sse2 with 32 byte blocks
+__attribute__((target("avx2"))) char *repr_avx2(char *out,
+                                                const unsigned char *in,
+                                                const size_t size,
+                                                const escape_table &table,
+                                                const char quote) {
+  size_t i = 0;
+  for (; i + 32 <= size; i += 32) {
+    const auto bytes =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + i));
+    const auto printable = _mm256_andnot_si256(
+        _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(0x7f)),
+        _mm256_cmpgt_epi8(bytes, _mm256_set1_epi8(0x1f)));
+    const auto quoted =
+        _mm256_or_si256(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(quote)),
+                        _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\\')));
+    const auto whitespace = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\t')),
+                        _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\n'))),
+        _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\r')));
+    const unsigned plain =
+        _mm256_movemask_epi8(_mm256_andnot_si256(quoted, printable));
+    if (plain == 0xffffffff) {
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(out), bytes);
+      out += 32;
+      continue;
+    }
+    const unsigned not_hex =
+        _mm256_movemask_epi8(_mm256_or_si256(printable, whitespace));
+    if (not_hex == 0) {
+      out = repr_hex_sse2(out, _mm256_castsi256_si128(bytes));
+      out = repr_hex_sse2(out, _mm256_extracti128_si256(bytes, 1));
+      continue;
+    }
+    const auto run = __builtin_ctz(~plain);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out), bytes);
+    out = repr_scalar(out + run, in + i + run, 32 - run, table);
+  }
+  return repr_sse2(out, in + i, size - i, table, quote);
+}
+#endif
+
+#ifdef BYTES_REPR_NEON
+// Same as repr_sse2, vst4q interleaves the \x prefix with the digits
+char *repr_neon(char *out, const unsigned char *in, const size_t size,
+                const escape_table &table, const char quote) {
+  static const uint8_t hexdigits[16] = {'0', '1', '2', '3', '4', '5',
+                                        '6', '7', '8', '9', 'a', 'b',
+                                        'c', 'd', 'e', 'f'};
+  const auto digits = vld1q_u8(hexdigits);
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    const auto bytes = vld1q_u8(in + i);
+    const auto printable = vandq_u8(vcgtq_u8(bytes, vdupq_n_u8(0x1f)),
+                                    vcltq_u8(bytes, vdupq_n_u8(0x7f)));
+    const auto quoted = vorrq_u8(vceqq_u8(bytes, vdupq_n_u8(quote)),
+                                 vceqq_u8(bytes, vdupq_n_u8('\\')));
+    const auto whitespace =
+        vorrq_u8(vorrq_u8(vceqq_u8(bytes, vdupq_n_u8('\t')),
+                          vceqq_u8(bytes, vdupq_n_u8('\n'))),
+                 vceqq_u8(bytes, vdupq_n_u8('\r')));
+    const auto plain = vbicq_u8(printable, quoted);
+    if (vminvq_u8(plain) == 0xff) {
+      vst1q_u8(reinterpret_cast<uint8_t *>(out), bytes);
+      out += 16;
+      continue;
+    }
+    if (vmaxvq_u8(vorrq_u8(printable, whitespace)) == 0) {
+      uint8x16x4_t hex;
+      hex.val[0] = vdupq_n_u8('\\');
+      hex.val[1] = vdupq_n_u8('x');
+      hex.val[2] = vqtbl1q_u8(digits, vshrq_n_u8(bytes, 4));
+      hex.val[3] = vqtbl1q_u8(digits, vandq_u8(bytes, vdupq_n_u8(0x0f)));
+      vst4q_u8(reinterpret_cast<uint8_t *>(out), hex);
+      out += 64;
+      continue;
+    }
+    // 4 bits per byte of the mask
+    const uint64_t plain_bits = vget_lane_u64(
+        vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(plain), 4)), 0);
+    const auto run = __builtin_ctzll(~plain_bits) / 4;
+    vst1q_u8(reinterpret_cast<uint8_t *>(out), bytes);
+    out = repr_scalar(out + run, in + i + run, 16 - run, table);
+  }
+  return repr_scalar(out, in + i, size - i, table);
+}
+#endif
+
+using kernel_t = char *(*)(char *, const unsigned char *, size_t,
+                           const escape_table &, char);
+
+// Picked once, the widest kernel the CPU running this supports
+kernel_t get_kernel() {
+  static const kernel_t kernel = []() -> kernel_t {
+#if defined(BYTES_REPR_X86)
+    if (__builtin_cpu_supports("avx2")) {
+      return repr_avx2;
+    }
+    return repr_sse2;
+#elif defined(BYTES_REPR_NEON)
+    return repr_neon;
+#else
+    return repr_generic;
+#endif
+  }();
+  return kernel;
+}
+}  // namespace bytes_repr
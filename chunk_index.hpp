@@ -0,0 +1,404 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <map>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "bedrock_keys.hpp"
+#include "db/dbformat.h"
+#include "key_filter.hpp"
+#include "leveldb/env.h"
+#include "leveldb/slice.h"
+#include "leveldb/status.h"
+#include "manifest.hpp"
+#include "ranges.hpp"
+#include "util/coding.h"
+#include "utils.hpp"
+
+namespace ldb = leveldb;
+
+// What an index knows about a chunk, from the keys of its records
+struct chunk_index_entry {
+  int32_t dimension;
+  int32_t x;
+  int32_t z;
+  // Bit tag - first_record_tag for every record tag present, see tag_bit
+  uint32_t tags;
+  // Bit index + 32 for every sub chunk index present
+  uint64_t sub_chunks;
+  // Size of the values of every record of the chunk
+  uint64_t value_bytes;
+
+  auto position() const { return std::make_tuple(dimension, x, z); }
+};
+
+// A table of the DB when the index was built, used to tell which chunks
+// have to be indexed again
+struct chunk_index_table {
+  uint64_t number;
+  std::string smallest;
+  std::string largest;
+};
+
+namespace chunk_index_detail {
+// Kept in the DB directory by default, leveldb ignores files it didn't name
+constexpr auto index_file_name = "bedrock-unz-index";
+
+// Header is the magic, the entry count, the table count and a reserved word,
+// entries follow it sorted by (dimension, x, z), then the tables
+constexpr char magic[8] = {'B', 'U', 'N', 'Z', 'I', 'D', 'X', '1'};
+constexpr size_t header_size = 8 + 8 + 8 + 8;
+constexpr size_t entry_size = 4 + 4 + 4 + 4 + 8 + 8;
+
+// Bits of chunk_index_entry::tags, 'v' gets the one after AabbVolumes (65)
+constexpr uint32_t tag_bit(const unsigned char tag) {
+  return tag == 'v' ? 1u << 23 : 1u << (tag - bedrock_keys::first_record_tag);
+}
+
+constexpr int sub_chunk_bias = 32;
+
+void put_entry(std::string &out, const chunk_index_entry &entry) {
+  ldb::PutFixed32(&out, static_cast<uint32_t>(entry.dimension));
+  ldb::PutFixed32(&out, static_cast<uint32_t>(entry.x));
+  ldb::PutFixed32(&out, static_cast<uint32_t>(entry.z));
+  ldb::PutFixed32(&out, entry.tags);
+  ldb::PutFixed64(&out, entry.sub_chunks);
+  ldb::PutFixed64(&out, entry.value_bytes);
+}
+
+chunk_index_entry decode_entry(const char *data) {
+  return {static_cast<int32_t>(ldb::DecodeFixed32(data)),
+          static_cast<int32_t>(ldb::DecodeFixed32(data + 4)),
+          static_cast<int32_t>(ldb::DecodeFixed32(data + 8)),
+          ldb::DecodeFixed32(data + 12), ldb::DecodeFixed64(data + 16),
+          ldb::DecodeFixed64(data + 24)};
+}
+
+// Every key of a chunk's records starts with its 8 byte chunk_prefix, so
+// the chunks with records in [smallest, largest] are the ones whose prefix
+// is in this range
+key_range chunk_span(const std::string &smallest, const std::string &largest) {
+  auto end = key_filter_detail::prefix_successor(largest.substr(0, 8));
+  return {smallest.substr(0, 8),
+          end.empty() ? std::nullopt : std::optional(std::move(end))};
+}
+}  // namespace chunk_index_detail
+
+std::string chunk_index_file(const std::string &dbname) {
+  return dbname + "/" + chunk_index_detail::index_file_name;
+}
+
+// Tables of manifest in the form the index keeps them
+std::vector<chunk_index_table> chunk_index_tables(
+    const db_manifest &manifest) {
+  std::vector<chunk_index_table> tables;
+  for (const auto &[number, file] : manifest.files) {
+    tables.push_back({number, ldb::ExtractUserKey(file.smallest).ToString(),
+                      ldb::ExtractUserKey(file.largest).ToString()});
+  }
+  return tables;
+}
+
+// Key ranges with every chunk that has records in a table that is only in
+// one of old and current, sorted and not overlapping. Chunks outside of
+// them have the same records they had when old was taken, tables are never
+// modified once written.
+std::vector<key_range> changed_chunk_ranges(
+    const std::vector<chunk_index_table> &old,
+    const std::vector<chunk_index_table> &current) {
+  const auto by_number = [](const auto &a, const auto &b) {
+    return a.number < b.number;
+  };
+  std::vector<chunk_index_table> changed;
+  std::set_symmetric_difference(old.begin(), old.end(), current.begin(),
+                                current.end(), std::back_inserter(changed),
+                                by_number);
+  std::vector<key_range> spans;
+  for (const auto &table : changed) {
+    spans.push_back(
+        chunk_index_detail::chunk_span(table.smallest, table.largest));
+  }
+  std::sort(spans.begin(), spans.end(), [](const auto &a, const auto &b) {
+    return ldb::Slice(a.begin).compare(b.begin) < 0;
+  });
+  std::vector<key_range> merged;
+  for (auto &span : spans) {
+    auto *last = merged.empty() ? nullptr : &merged.back();
+    if (!last || (last->end && last->end->compare(span.begin) < 0)) {
+      merged.push_back(std::move(span));
+    } else if (last->end && (!span.end || last->end->compare(*span.end) < 0)) {
+      last->end = std::move(span.end);
+    }
+  }
+  return merged;
+}
+
+// Entries of the chunks whose records are all outside of ranges, which are
+// sorted and don't overlap
+std::vector<chunk_index_entry> entries_outside(
+    const std::vector<chunk_index_entry> &entries,
+    const std::vector<key_range> &ranges) {
+  std::vector<chunk_index_entry> kept;
+  for (const auto &entry : entries) {
+    const auto prefix = bedrock_keys::chunk_prefix(entry.x, entry.z);
+    const auto after = std::upper_bound(
+        ranges.begin(), ranges.end(), prefix,
+        [](const std::string &prefix, const key_range &range) {
+          return prefix.compare(range.begin) < 0;
+        });
+    if (after == ranges.begin() || !std::prev(after)->contains(prefix)) {
+      kept.push_back(entry);
+    }
+  }
+  return kept;
+}
+
+// Collects the entries of the chunks whose records it's given
+class chunk_index_builder {
+ public:
+  void add(const ldb::Slice &key, const size_t value_size) {
+    using namespace chunk_index_detail;
+    const auto chunk =
+        bedrock_keys::parse_chunk_key({key.data(), key.size()});
+    if (!chunk) {
+      return;
+    }
+    auto &entry = entries[{chunk->dimension, chunk->x, chunk->z}];
+    entry.tags |= tag_bit(chunk->tag);
+    if (chunk->sub_chunk && *chunk->sub_chunk >= -sub_chunk_bias &&
+        *chunk->sub_chunk < 64 - sub_chunk_bias) {
+      entry.sub_chunks |= uint64_t{1} << (*chunk->sub_chunk + sub_chunk_bias);
+    }
+    entry.value_bytes += value_size;
+  }
+
+  // Sorted by position, kept are entries of chunks that weren't added again
+  std::vector<chunk_index_entry> finish(
+      const std::vector<chunk_index_entry> &kept = {}) const {
+    std::vector<chunk_index_entry> result;
+    result.reserve(kept.size() + entries.size());
+    auto it = entries.begin();
+    const auto flush_until = [&](const auto &position) {
+      for (; it != entries.end() && it->first < position; it++) {
+        result.push_back(make_entry(*it));
+      }
+    };
+    for (const auto &entry : kept) {
+      flush_until(entry.position());
+      if (it == entries.end() || it->first != entry.position()) {
+        result.push_back(entry);
+      }
+    }
+    for (; it != entries.end(); it++) {
+      result.push_back(make_entry(*it));
+    }
+    return result;
+  }
+
+ private:
+  struct fields {
+    uint32_t tags = 0;
+    uint64_t sub_chunks = 0;
+    uint64_t value_bytes = 0;
+  };
+  using position_t = std::tuple<int32_t, int32_t, int32_t>;
+
+  static chunk_index_entry make_entry(
+      const std::pair<const position_t, fields> &item) {
+    const auto &[position, fields] = item;
+    return {std::get<0>(position), std::get<1>(position),
+            std::get<2>(position), fields.tags, fields.sub_chunks,
+            fields.value_bytes};
+  }
+
+  std::map<position_t, fields> entries{};
+};
+
+// Writes the index through a rename so readers see the old or the new one,
+// never a partial file
+ldb::Status write_chunk_index(ldb::Env *env, const std::string &fname,
+                              const std::vector<chunk_index_entry> &entries,
+                              const std::vector<chunk_index_table> &tables) {
+  using namespace chunk_index_detail;
+  std::string content(magic, sizeof(magic));
+  ldb::PutFixed64(&content, entries.size());
+  ldb::PutFixed64(&content, tables.size());
+  ldb::PutFixed64(&content, 0);
+  content.reserve(header_size + entries.size() * entry_size);
+  for (const auto &entry : entries) {
+    put_entry(content, entry);
+  }
+  for (const auto &table : tables) {
+    ldb::PutVarint64(&content, table.number);
+    ldb::PutLengthPrefixedSlice(&content, table.smallest);
+    ldb::PutLengthPrefixedSlice(&content, table.largest);
+  }
+  const auto tmp_name = fname + ".tmp";
+  auto status = ldb::WriteStringToFileSync(env, content, tmp_name);
+  if (status.ok()) {
+    status = env->RenameFile(tmp_name, fname);
+  }
+  if (!status.ok()) {
+    env->DeleteFile(tmp_name);
+  }
+  return status;
+}
+
+// A memory mapped index, entries are decoded as they are looked at so
+// opening one costs the same no matter its size
+class chunk_index_view {
+ public:
+  UTILS_NOT_COPYABLE(chunk_index_view)
+  UTILS_NOT_MOVEABLE(chunk_index_view)
+  // found is false when there's no file at fname
+  chunk_index_view(const std::string &fname, bool &found) : fname(fname) {
+    found = false;
+    const int fd = open(fname.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      if (errno != ENOENT) {
+        status = ldb::Status::IOError(fname, std::strerror(errno));
+      }
+      return;
+    }
+    found = true;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      status = ldb::Status::IOError(fname, std::strerror(errno));
+    } else if (st.st_size > 0) {
+      void *mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      if (mapped == MAP_FAILED) {
+        status = ldb::Status::IOError(fname, std::strerror(errno));
+      } else {
+        base = static_cast<const char *>(mapped);
+        size = st.st_size;
+      }
+    }
+    close(fd);
+    if (status.ok()) {
+      status = check_header();
+    }
+  }
+
+  ~chunk_index_view() {
+    if (base) {
+      munmap(const_cast<char *>(base), size);
+    }
+  }
+
+  size_t entry_count() const { return count; }
+
+  chunk_index_entry entry(const size_t i) const {
+    using namespace chunk_index_detail;
+    return decode_entry(base + header_size + i * entry_size);
+  }
+
+  // Visits the entries of dimension with x0 <= x <= x1 in order, whole
+  // columns of chunks are found by binary search
+  template <typename Visit>
+  void find(const int32_t dimension, const chunk_box &box,
+            Visit &&visit) const {
+    size_t i = lower_bound({dimension, box.x0, box.z0});
+    for (; i < count; i++) {
+      const auto found = entry(i);
+      if (found.dimension != dimension || found.x > box.x1) {
+        break;
+      }
+      if (found.z < box.z0) {
+        i = lower_bound({dimension, found.x, box.z0}) - 1;
+        continue;
+      }
+      if (found.z > box.z1) {
+        if (found.x == box.x1) {
+          break;
+        }
+        i = lower_bound({dimension, found.x + 1, box.z0}) - 1;
+        continue;
+      }
+      visit(found);
+    }
+  }
+
+  std::vector<chunk_index_entry> entries() const {
+    std::vector<chunk_index_entry> result;
+    result.reserve(count);
+    for (size_t i = 0; i < count; i++) {
+      result.push_back(entry(i));
+    }
+    return result;
+  }
+
+  ldb::Status tables(std::vector<chunk_index_table> &result) const {
+    using namespace chunk_index_detail;
+    result.clear();
+    ldb::Slice input(base + header_size + count * entry_size,
+                     size - header_size - count * entry_size);
+    for (uint64_t i = 0; i < table_count; i++) {
+      chunk_index_table table{};
+      ldb::Slice smallest, largest;
+      if (!ldb::GetVarint64(&input, &table.number) ||
+          !ldb::GetLengthPrefixedSlice(&input, &smallest) ||
+          !ldb::GetLengthPrefixedSlice(&input, &largest)) {
+        return corrupt();
+      }
+      table.smallest = smallest.ToString();
+      table.largest = largest.ToString();
+      result.push_back(std::move(table));
+    }
+    return input.empty() ? ldb::Status::OK() : corrupt();
+  }
+
+  ldb::Status status{};
+
+ private:
+  ldb::Status corrupt() const {
+    return ldb::Status::Corruption("bad chunk index", fname);
+  }
+
+  ldb::Status check_header() {
+    using namespace chunk_index_detail;
+    if (size < header_size || std::memcmp(base, magic, sizeof(magic)) != 0) {
+      return corrupt();
+    }
+    count = ldb::DecodeFixed64(base + 8);
+    table_count = ldb::DecodeFixed64(base + 16);
+    if (count > (size - header_size) / entry_size) {
+      return corrupt();
+    }
+    return ldb::Status::OK();
+  }
+
+  // First entry not before position
+  size_t lower_bound(
+      const std::tuple<int32_t, int32_t, int32_t> &position) const {
+    size_t low = 0, high = count;
+    while (low < high) {
+      const size_t mid = low + (high - low) / 2;
+      const auto found = entry(mid);
+      if (found.position() < position) {
+        low = mid + 1;
+      } else {
+        high = mid;
+      }
+    }
+    return low;
+  }
+
+  const std::string fname;
+  const char *base = nullptr;
+  size_t size = 0;
+  size_t count = 0;
+  uint64_t table_count = 0;
+};
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <charconv>
+#include <cstddef>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "bedrock_keys.hpp"
+#include "db_options.hpp"
+#include "key_filter.hpp"
+#include "leveldb/compressor.h"
+#include "leveldb/slice.h"
+#include "tables.hpp"
+
+namespace ldb = leveldb;
+
+// Compression for the chunk records with a tag, or for the keys starting
+// with prefix when there's no tag
+struct compression_rule {
+  std::optional<unsigned char> tag{};
+  std::string prefix{};
+  output_compression compression{};
+
+  bool matches(const ldb::Slice &key) const {
+    if (tag) {
+      return bedrock_keys::record_tag({key.data(), key.size()}) == tag;
+    }
+    return key.starts_with(prefix);
+  }
+};
+
+// Compression of the data blocks of written tables by their keys. The first
+// rule that matches a key decides, keys that no rule matches get the
+// compression of the rest of the DB.
+class compression_policy {
+ public:
+  compression_policy() = default;
+  explicit compression_policy(std::vector<compression_rule> rules)
+      : rules(std::move(rules)) {}
+
+  bool empty() const { return rules.empty(); }
+
+  // 0 for keys no rule matches, i + 1 for the ones rule i matches
+  size_t classify(const ldb::Slice &key) const {
+    for (size_t i = 0; i < rules.size(); i++) {
+      if (rules[i].matches(key)) {
+        return i + 1;
+      }
+    }
+    return 0;
+  }
+
+  // The result refers to this policy and can't outlive it. Without rules it's
+  // disabled, tables are written the usual way.
+  block_policy make_block_policy(const output_compression &fallback) const {
+    block_policy policy{};
+    if (empty()) {
+      return policy;
+    }
+    policy.classify = [this](const ldb::Slice &key) { return classify(key); };
+    policy.compressors.push_back(make_compressor(fallback));
+    for (const auto &rule : rules) {
+      policy.compressors.push_back(make_compressor(rule.compression));
+    }
+    return policy;
+  }
+
+ private:
+  // Null for no compression
+  static std::unique_ptr<ldb::Compressor> make_compressor(
+      const output_compression &compression) {
+    auto compressors = compression.make_compressors(true);
+    return compressors.empty() ? nullptr : std::move(compressors.front());
+  }
+
+  std::vector<compression_rule> rules{};
+};
+
+// Parses KEYS=COMPRESSION where KEYS is a chunk record tag or prefix:BYTES
+// with the same escapes as key prefixes, and COMPRESSION is none or
+// NAME[:LEVEL]
+std::optional<compression_rule> parse_compression_rule(
+    const std::string &spec) {
+  // Compression specs have no =, prefixes can
+  const auto separator = spec.rfind('=');
+  if (separator == std::string::npos) {
+    std::cerr << "Invalid compression rule " << spec
+              << ", expected TAG=COMPRESSION or prefix:BYTES=COMPRESSION"
+              << std::endl;
+    return {};
+  }
+  const auto keys = spec.substr(0, separator);
+  const auto compression_spec = spec.substr(separator + 1);
+  compression_rule rule{};
+
+  static const std::string prefix_keys = "prefix:";
+  if (keys.compare(0, prefix_keys.size(), prefix_keys) == 0) {
+    auto prefix = parse_key_prefix(keys.substr(prefix_keys.size()));
+    if (!prefix) {
+      return {};
+    }
+    rule.prefix = std::move(*prefix);
+  } else {
+    unsigned tag;
+    const auto [end, ec] =
+        std::from_chars(keys.data(), keys.data() + keys.size(), tag);
+    if (ec != std::errc() || end != keys.data() + keys.size() ||
+        tag > 0xff || !bedrock_keys::is_record_tag(tag)) {
+      std::cerr << "Invalid compression rule " << spec << ", " << keys
+                << " is not a chunk record tag" << std::endl;
+      return {};
+    }
+    rule.tag = static_cast<unsigned char>(tag);
+  }
+
+  if (compression_spec == "none") {
+    return rule;
+  }
+  auto compression = parse_output_compression(compression_spec);
+  if (!compression) {
+    return {};
+  }
+  rule.compression = *compression;
+  return rule;
+}
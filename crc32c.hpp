@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "util/crc32c.h"
+
+#if defined(__x86_64__)
+#define CRC32C_X86 1
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#define CRC32C_ARM 1
+#include <arm_acle.h>
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+
+// CRC32C with the instructions of the CPU running this, same results as
+// leveldb::crc32c::Extend which is used where they are missing
+namespace crc32c {
+using kernel_t = uint32_t (*)(uint32_t, const char *, size_t);
+
+#ifdef CRC32C_X86
+__attribute__((target("sse4.2"))) uint32_t extend_sse42(uint32_t crc,
+                                                        const char *data,
+                                                        size_t size) {
+  uint64_t state = ~crc;
+  for (; size >= 8; data += 8, size -= 8) {
+    uint64_t word;
+    std::memcpy(&word, data, sizeof(word));
+    state = _mm_crc32_u64(state, word);
+  }
+  auto narrow = static_cast<uint32_t>(state);
+  for (; size > 0; data++, size--) {
+    narrow = _mm_crc32_u8(narrow, static_cast<uint8_t>(*data));
+  }
+  return ~narrow;
+}
+#endif
+
+#ifdef CRC32C_ARM
+__attribute__((target("+crc"))) uint32_t extend_armv8(uint32_t crc,
+                                                      const char *data,
+                                                      size_t size) {
+  crc = ~crc;
+  for (; size >= 8; data += 8, size -= 8) {
+    uint64_t word;
+    std::memcpy(&word, data, sizeof(word));
+    crc = __crc32cd(crc, word);
+  }
+  for (; size > 0; data++, size--) {
+    crc = __crc32cb(crc, static_cast<uint8_t>(*data));
+  }
+  return ~crc;
+}
+#endif
+
+uint32_t extend_generic(const uint32_t crc, const char *data,
+                        const size_t size) {
+  return leveldb::crc32c::Extend(crc, data, size);
+}
+
+// Picked once
+kernel_t get_kernel() {
+  static const kernel_t kernel = []() -> kernel_t {
+#if defined(CRC32C_X86)
+    if (__builtin_cpu_supports("sse4.2")) {
+      return extend_sse42;
+    }
+#elif defined(CRC32C_ARM)
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+      return extend_armv8;
+    }
+#endif
+    return extend_generic;
+  }();
+  return kernel;
+}
+
+inline uint32_t value(const char *data, const size_t size) {
+  return get_kernel()(0, data, size);
+}
+}  // namespace crc32c
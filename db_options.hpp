@@ -0,0 +1,366 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <charconv>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "hackdb.h"
+#include "leveldb/cache.h"
+#include "leveldb/db.h"
+#include "leveldb/env.h"
+#include "leveldb/filter_policy.h"
+#include "leveldb/zlib_compressor.h"
+#include "memory_budget.hpp"
+#include "mmap_env.hpp"
+#include "readahead_env.hpp"
+#include "utils.hpp"
+#include "zstd_compressor.hpp"
+
+#ifdef BEDROCK_UNZ_LIBDEFLATE
+#include "libdeflate_compressor.hpp"
+#endif
+
+namespace fs = std::filesystem;
+namespace ldb = leveldb;
+
+class compression_type {
+ public:
+  using make_func = std::function<ldb::Compressor *(std::optional<int>)>;
+  auto make_compressor(const std::optional<int> level = {}) const noexcept {
+    auto compressor = make_compressor_(level);
+    assert(!compressor || compressor->uniqueCompressionID == compression_id);
+    return std::unique_ptr<ldb::Compressor>(compressor);
+  }
+  compression_type(const std::string name, const std::string option_name,
+                   const std::pair<int, int> levels,
+                   make_func &&make_compressor_)
+      : make_compressor_(make_compressor_),
+        compression_id(get_compression_id()),
+        name(name),
+        option_name(option_name),
+        levels(levels) {}
+  compression_type()
+      : make_compressor_([](auto) { return nullptr; }),
+        compression_id(0),
+        name("no compression"),
+        option_name(),
+        levels() {};
+
+ private:
+  const make_func make_compressor_;
+  hackdb::compression_id_t get_compression_id() const noexcept {
+    std::unique_ptr<ldb::Compressor> compressor(make_compressor_({}));
+    assert(compressor);
+    auto id = compressor->uniqueCompressionID;
+    return id;
+  }
+
+ public:
+  const hackdb::compression_id_t compression_id;
+  const std::string name;
+  // As in --compression=NAME[:LEVEL]
+  const std::string option_name;
+  // Valid levels, inclusive
+  const std::pair<int, int> levels;
+};
+
+// What reads and writes zlib and zlib raw blocks, set with --deflate.
+// libdeflate is only there when built with BEDROCK_UNZ_LIBDEFLATE, and is
+// the default then.
+enum class deflate_impl { zlib, libdeflate };
+
+#ifdef BEDROCK_UNZ_LIBDEFLATE
+constexpr bool libdeflate_available = true;
+deflate_impl deflate_implementation = deflate_impl::libdeflate;
+#else
+constexpr bool libdeflate_available = false;
+deflate_impl deflate_implementation = deflate_impl::zlib;
+#endif
+
+template <typename ZlibCompressor, bool raw>
+ldb::Compressor *make_deflate_compressor(const std::optional<int> level) {
+#ifdef BEDROCK_UNZ_LIBDEFLATE
+  if (deflate_implementation == deflate_impl::libdeflate) {
+    return new libdeflate_zlib_compressor<raw>(level.value_or(-1));
+  }
+#endif
+  return new ZlibCompressor(level.value_or(-1));
+}
+
+// Loaded with --zstd-dict, zstd compressors use it to compress blocks and
+// to read blocks that were compressed with it
+std::shared_ptr<const zstd_dictionary> zstd_dict{};
+
+const auto &get_compressors() {
+  static std::vector<compression_type> compressors = {
+      // First compressor is the default one
+      {"zlib raw", "zlib-raw", {-1, 9},
+       make_deflate_compressor<ldb::ZlibCompressorRaw, true>},
+      {"zlib", "zlib", {-1, 9},
+       make_deflate_compressor<ldb::ZlibCompressor, false>},
+      {"zstd", "zstd", {ZSTD_minCLevel(), ZSTD_maxCLevel()},
+       [](auto level) {
+         return new zstd_compressor(
+             level.value_or(zstd_compressor::default_level), zstd_dict);
+       }},
+      {}};
+  return compressors;
+}
+
+// Name of the known compressor with id, <unknown> if there's none
+std::string compressor_name(const hackdb::compression_id_t id) {
+  const auto &compressors = get_compressors();
+  const auto it = std::find_if(
+      compressors.begin(), compressors.end(),
+      [&](const auto &compressor) { return compressor.compression_id == id; });
+  return it != compressors.end() ? it->name : "<unknown>";
+}
+
+auto make_compressors(bool only_default = false) {
+  std::vector<std::unique_ptr<ldb::Compressor>> compressors = {};
+  for (auto &compressor : get_compressors()) {
+    if (compressor.compression_id == 0) continue;
+    if (only_default) {
+      compressors.push_back(compressor.make_compressor());
+      break;
+    }
+    compressors.push_back(compressor.make_compressor());
+  }
+  return compressors;
+}
+
+// Compression used for the blocks written to a DB
+struct output_compression {
+  // No compression when null
+  const compression_type *type = nullptr;
+  std::optional<int> level{};
+
+  bool enabled() const { return type != nullptr; }
+
+  // As given to --compression, none when disabled
+  std::string spec() const {
+    if (!enabled()) {
+      return "none";
+    }
+    return level ? type->option_name + ":" + std::to_string(*level)
+                 : type->option_name;
+  }
+
+  // The compressor for written blocks first, followed by the rest of the
+  // known ones unless only_output is set
+  std::vector<std::unique_ptr<ldb::Compressor>> make_compressors(
+      const bool only_output) const {
+    std::vector<std::unique_ptr<ldb::Compressor>> compressors = {};
+    if (!enabled()) {
+      return compressors;
+    }
+    compressors.push_back(type->make_compressor(level));
+    if (only_output) {
+      return compressors;
+    }
+    for (auto &compressor : get_compressors()) {
+      if (compressor.compression_id == 0 ||
+          compressor.compression_id == type->compression_id) {
+        continue;
+      }
+      compressors.push_back(compressor.make_compressor());
+    }
+    return compressors;
+  }
+};
+
+// Parses NAME[:LEVEL], an empty spec selects the default compressor
+std::optional<output_compression> parse_output_compression(
+    const std::string &spec) {
+  const auto separator = spec.find(':');
+  const auto name = spec.substr(0, separator);
+  const auto &compressors = get_compressors();
+  const auto it = std::find_if(
+      compressors.begin(), compressors.end(), [&](const auto &compressor) {
+        return compressor.compression_id != 0 &&
+               (name.empty() || compressor.option_name == name);
+      });
+  if (it == compressors.end()) {
+    std::cerr << "Unknown compressor " << name << std::endl;
+    return {};
+  }
+  output_compression compression{&*it, {}};
+  if (separator == std::string::npos) {
+    return compression;
+  }
+  int level;
+  const auto level_str = spec.substr(separator + 1);
+  const auto [end, ec] = std::from_chars(
+      level_str.data(), level_str.data() + level_str.size(), level);
+  if (ec != std::errc() || end != level_str.data() + level_str.size() ||
+      level < it->levels.first || level > it->levels.second) {
+    std::cerr << "Invalid level for " << it->option_name << ", expected a "
+              << "number from " << it->levels.first << " to "
+              << it->levels.second << std::endl;
+    return {};
+  }
+  compression.level = level;
+  return compression;
+}
+
+[[nodiscard]] bool load_zstd_dictionary(const fs::path &path) {
+  std::string content;
+  auto status = ldb::ReadFileToString(ldb::Env::Default(), path, &content);
+  if (!status.ok()) {
+    std::cerr << "Failed to read zstd dictionary: " << status.ToString()
+              << std::endl;
+    return false;
+  }
+  auto dictionary = std::make_shared<const zstd_dictionary>(std::move(content));
+  if (!dictionary->valid()) {
+    std::cerr << "Invalid zstd dictionary " << path << std::endl;
+    return false;
+  }
+  zstd_dict = std::move(dictionary);
+  return true;
+}
+
+class db_opts {
+ public:
+  UTILS_DEFAULT_MOVE(db_opts)
+  UTILS_NOT_COPYABLE(db_opts)
+  db_opts(std::vector<std::unique_ptr<ldb::Compressor>> &&compressors,
+          std::unique_ptr<const ldb::FilterPolicy> &&filter_policy,
+          std::shared_ptr<ldb::Cache> cache, const uint64_t cache_bytes,
+          ldb::Options &&opts)
+      : compressors(std::move(compressors)),
+        filter_policy(std::move(filter_policy)),
+        cache(std::move(cache)),
+        cache_bytes(cache_bytes) {
+    assert(opts.block_cache == nullptr);
+    assert(opts.filter_policy == nullptr);
+    opts.block_cache = this->cache.get();
+    opts.filter_policy = this->filter_policy.get();
+    for (size_t i = 0; i < std::size(opts.compressors); i++) {
+      assert(opts.compressors[i] == nullptr);
+    }
+    assert(std::size(this->compressors) <= std::size(opts.compressors));
+    for (size_t i = 0; i < this->compressors.size(); i++) {
+      opts.compressors[i] = this->compressors[i].get();
+    }
+    this->opts = std::move(opts);
+    fit_budget();
+  }
+
+  void modify(std::function<void(ldb::Options &)> &&func) {
+    func(opts);
+    assert(opts.block_cache == cache.get());
+    assert(opts.filter_policy == filter_policy.get());
+    for (size_t i = 0; i < std::size(opts.compressors); i++) {
+      assert(opts.compressors[i] ==
+             (compressors.size() > i ? compressors[i].get() : nullptr));
+    }
+    fit_budget();
+  }
+
+  const ldb::Options *operator->() const { return &opts; }
+  const ldb::Options &operator*() const { return opts; }
+  const auto &get_compressors() const { return compressors; }
+  const auto &get_filter_policy() const { return filter_policy; }
+  const auto &get_cache() const { return cache; }
+
+ private:
+  // Caps the memtable and the open tables at their share of memory, and
+  // accounts for what the DB can hold with these options
+  void fit_budget() {
+    opts.write_buffer_size = memory.write_buffer(opts.write_buffer_size);
+    opts.max_open_files = memory.open_files(opts.max_open_files);
+    reservation = memory_reservation(
+        cache_bytes + 2 * static_cast<uint64_t>(opts.write_buffer_size) +
+        static_cast<uint64_t>(opts.max_open_files) *
+            memory_budget::open_table_bytes);
+  }
+
+  std::vector<std::unique_ptr<ldb::Compressor>> compressors;
+  std::unique_ptr<const ldb::FilterPolicy> filter_policy;
+  // Shared with the other DBs when it's shared_block_cache
+  std::shared_ptr<ldb::Cache> cache;
+  // Capacity of cache, 0 when it's shared
+  uint64_t cache_bytes;
+  ldb::Options opts;
+  memory_reservation reservation{};
+};
+
+using db_unique_ptr_t =
+    std::unique_ptr<leveldb::DB, unique_deleter_arena<db_opts>>;
+
+auto open_db(db_opts &&opts, const std::string &name) {
+  ldb::DB *db;
+  auto status = ldb::DB::Open(*opts, name, &db);
+  if (!status.ok()) {
+    db = nullptr;
+  }
+  auto arena = unique_deleter_arena(std::move(opts));
+  return std::pair{db_unique_ptr_t(db, std::move(arena)), status};
+}
+
+const db_opts &get_db_opts(const db_unique_ptr_t &db) {
+  return std::get<0>(*db.get_deleter().arena);
+}
+
+// taken from
+// https://github.com/Amulet-Team/leveldb-mcpe/blob/c446a37734d5480d4ddbc371595e7af5123c4925/mcpe_sample_setup.cpp
+// https://github.com/Amulet-Team/Amulet-LevelDB/blob/47c490e8a0a79916b97aa6ad8b93e3c43b743b8c/src/leveldb/_leveldb.pyx#L191-L199
+// Uncompressed size of the blocks Bedrock writes
+constexpr size_t bedrock_block_size = 163840;
+
+// Block cache of every DB opened from now on when set, instead of one for
+// each of them, batch sets it
+std::shared_ptr<ldb::Cache> shared_block_cache{};
+
+// Files each DB that isn't mapped keeps open, batch lowers it to share its
+// limit among the DBs it has open at once
+int db_max_open_files = 1000;
+
+db_opts bedrock_default_db_options(
+    std::vector<std::unique_ptr<ldb::Compressor>> &&compressors) {
+  const auto cache_bytes = memory.block_cache(8 * 1024 * 1024);
+  auto options = ldb::Options();
+  options.write_buffer_size = 4 * 1024 * 1024;
+  options.block_size = bedrock_block_size;
+  options.max_open_files = db_max_open_files;
+  return db_opts(
+      std::move(compressors),
+      std::unique_ptr<const ldb::FilterPolicy>(ldb::NewBloomFilterPolicy(10)),
+      shared_block_cache
+          ? shared_block_cache
+          : std::shared_ptr<ldb::Cache>(ldb::NewLRUCache(cache_bytes)),
+      shared_block_cache ? 0 : cache_bytes, std::move(options));
+}
+
+// Tables can stay open without using descriptors when they are mapped, this
+// is enough for every table of the biggest worlds
+constexpr int mapped_max_open_files = 1 << 16;
+
+// For DBs that are only read from, tables are read through mmap_read_env
+db_opts bedrock_input_db_options(
+    std::vector<std::unique_ptr<ldb::Compressor>> &&compressors) {
+  auto opts = bedrock_default_db_options(std::move(compressors));
+  opts.modify([](auto &opts) {
+    opts.env = get_mmap_read_env();
+    opts.max_open_files = mapped_max_open_files;
+  });
+  return opts;
+}
+
+// For DBs that are scanned from start to end and written, like by compact,
+// tables are read through readahead_env
+db_opts bedrock_scan_db_options(
+    std::vector<std::unique_ptr<ldb::Compressor>> &&compressors) {
+  auto opts = bedrock_default_db_options(std::move(compressors));
+  opts.modify([](auto &opts) { opts.env = get_readahead_env(); });
+  return opts;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "leveldb/decompress_allocator.h"
+#include "metrics.hpp"
+#include "utils.hpp"
+
+namespace ldb = leveldb;
+
+namespace decompress_pool_detail {
+// Identifies pools so a thread doesn't hand out buffers of a pool that is
+// gone, addresses can be reused
+std::atomic<uint64_t> next_pool_id{1};
+
+// Buffers released by this thread, valid for the pool with pool_id
+struct thread_arena {
+  uint64_t pool_id = 0;
+  std::vector<std::string> buffers{};
+};
+thread_local thread_arena arena{};
+}  // namespace decompress_pool_detail
+
+// Keeps the strings ReadBlock decompresses into so that their capacity is
+// reused for the next block, instead of growing a new string for every one.
+// Unlike the base DecompressAllocator, which shares a stack behind a mutex,
+// every thread reuses only the buffers it released. Reuses and allocations
+// are counted in progress.
+class pooled_decompress_allocator : public ldb::DecompressAllocator {
+ public:
+  UTILS_NOT_COPYABLE(pooled_decompress_allocator)
+  UTILS_NOT_MOVEABLE(pooled_decompress_allocator)
+  // New buffers reserve block_size, which fits most blocks without growing
+  explicit pooled_decompress_allocator(const size_t block_size,
+                                       const size_t buffers_per_thread = 4)
+      : block_size(block_size), buffers_per_thread(buffers_per_thread) {}
+
+  std::string get() override {
+    auto &buffers = thread_buffers();
+    if (!buffers.empty()) {
+      auto buffer = std::move(buffers.back());
+      buffers.pop_back();
+      progress.buffers_reused.fetch_add(1, std::memory_order_relaxed);
+      return buffer;
+    }
+    progress.buffers_allocated.fetch_add(1, std::memory_order_relaxed);
+    std::string buffer;
+    buffer.reserve(block_size);
+    return buffer;
+  }
+
+  void release(std::string &&buffer) override {
+    auto &buffers = thread_buffers();
+    if (buffers.size() < buffers_per_thread) {
+      buffer.clear();
+      buffers.push_back(std::move(buffer));
+    }
+  }
+
+  // Only frees the buffers of the calling thread, the others are freed when
+  // their thread exits or uses another pool
+  void prune() override { thread_buffers().clear(); }
+
+ private:
+  std::vector<std::string> &thread_buffers() {
+    auto &arena = decompress_pool_detail::arena;
+    if (arena.pool_id != id) {
+      arena.buffers.clear();
+      arena.pool_id = id;
+    }
+    return arena.buffers;
+  }
+
+  const uint64_t id = decompress_pool_detail::next_pool_id.fetch_add(1);
+  const size_t block_size;
+  const size_t buffers_per_thread;
+};
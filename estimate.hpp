@@ -0,0 +1,123 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "db_options.hpp"
+#include "leveldb/compressor.h"
+#include "leveldb/env.h"
+#include "leveldb/options.h"
+#include "manifest.hpp"
+#include "table/format.h"
+#include "tables.hpp"
+
+namespace ldb = leveldb;
+
+// What writing the sampled blocks with one of the candidate compressions
+// would take, times are of a single thread
+struct compression_estimate {
+  uint64_t stored_bytes = 0;
+  double compress_seconds = 0;
+  double decompress_seconds = 0;
+};
+
+// Data blocks sampled from tables and their estimates, one per candidate
+struct block_estimates {
+  uint64_t blocks = 0;
+  // Sizes as stored now, trailers included, and after decoding
+  uint64_t current_bytes = 0;
+  uint64_t raw_bytes = 0;
+  std::vector<compression_estimate> candidates{};
+
+  void merge(const block_estimates &other) {
+    blocks += other.blocks;
+    current_bytes += other.current_bytes;
+    raw_bytes += other.raw_bytes;
+    candidates.resize(std::max(candidates.size(), other.candidates.size()));
+    for (size_t i = 0; i < other.candidates.size(); i++) {
+      candidates[i].stored_bytes += other.candidates[i].stored_bytes;
+      candidates[i].compress_seconds += other.candidates[i].compress_seconds;
+      candidates[i].decompress_seconds +=
+          other.candidates[i].decompress_seconds;
+    }
+  }
+};
+
+namespace estimate_detail {
+using clock = std::chrono::steady_clock;
+
+double seconds(const clock::duration duration) {
+  return std::chrono::duration<double>(duration).count();
+}
+
+// TableBuilder keeps blocks raw unless compressing them saves 1/8 of them
+uint64_t stored_size(const size_t raw, const size_t compressed) {
+  return (compressed < raw - raw / 8 ? compressed : raw) +
+         ldb::kBlockTrailerSize;
+}
+}  // namespace estimate_detail
+
+// Decodes the data blocks of a table that sampler picks, then compresses and
+// decompresses each of them with every candidate and adds the sizes and
+// times to estimates. The compressors are made here, so tables can be
+// estimated concurrently.
+ldb::Status estimate_table(const table_options &opts,
+                           const std::string &dbname, const table_file &file,
+                           block_sampler &sampler,
+                           const std::vector<output_compression> &candidates,
+                           block_estimates &estimates) {
+  using namespace estimate_detail;
+  std::vector<std::unique_ptr<ldb::Compressor>> compressors;
+  for (const auto &candidate : candidates) {
+    auto made = candidate.make_compressors(true);
+    compressors.push_back(made.empty() ? nullptr : std::move(made.front()));
+  }
+  estimates.candidates.resize(candidates.size());
+  auto ropts = ldb::ReadOptions();
+  ropts.fill_cache = false;
+  ropts.verify_checksums = true;
+  std::string compressed, decompressed;
+  return for_each_sampled_block(
+      opts, dbname, file, sampler,
+      [&](ldb::RandomAccessFile &data, const ldb::BlockHandle &handle) {
+        ldb::BlockContents contents;
+        auto status = ldb::ReadBlock(&data, *opts, ropts, handle, &contents);
+        if (!status.ok()) {
+          return status;
+        }
+        // Owned the same way Block owns it
+        std::unique_ptr<const char[]> owned(
+            contents.heap_allocated ? contents.data.data() : nullptr);
+        const auto raw = contents.data;
+        estimates.blocks++;
+        estimates.current_bytes += handle.size() + ldb::kBlockTrailerSize;
+        estimates.raw_bytes += raw.size();
+        for (size_t i = 0; i < compressors.size(); i++) {
+          auto &estimate = estimates.candidates[i];
+          if (!compressors[i]) {
+            estimate.stored_bytes += stored_size(raw.size(), raw.size());
+            continue;
+          }
+          // Compressors append to what they are given
+          compressed.clear();
+          decompressed.clear();
+          const auto start = clock::now();
+          compressors[i]->compress(raw.data(), raw.size(), compressed);
+          const auto compressed_at = clock::now();
+          const bool decoded = compressors[i]->decompress(
+              compressed.data(), compressed.size(), decompressed);
+          estimate.decompress_seconds += seconds(clock::now() - compressed_at);
+          estimate.compress_seconds += seconds(compressed_at - start);
+          if (!decoded || ldb::Slice(decompressed) != raw) {
+            return ldb::Status::Corruption(
+                "block changed after compressing and decompressing it");
+          }
+          estimate.stored_bytes += stored_size(raw.size(), compressed.size());
+        }
+        return status;
+      });
+}
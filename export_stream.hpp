@@ -0,0 +1,405 @@
+#pragma once
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "leveldb/slice.h"
+#include "leveldb/status.h"
+#include "output_writer.hpp"
+#include "util/coding.h"
+#include "utils.hpp"
+#include "zstd.h"
+#include "zstd_compressor.hpp"
+
+namespace ldb = leveldb;
+
+// Streams written by export and read by import are zstd frames that a plain
+// zstd -d turns into the records in key order: varint32 key size, key,
+// varint32 value size and value. Around them are skippable frames that zstd
+// ignores, a header with export_detail::magic first and an index of the
+// frames last. The index ends with its frame count, the size of its own
+// frame and the magic, so it can be found from the end of a file.
+
+// A frame of records, offset is from the start of the stream
+struct export_frame {
+  uint64_t offset;
+  uint32_t size;
+  uint32_t records;
+  std::string first_key;
+};
+
+namespace export_detail {
+constexpr char magic[8] = {'B', 'U', 'N', 'Z', 'E', 'X', 'P', '1'};
+// The first of the magic numbers zstd reserves for skippable frames
+constexpr uint32_t skippable_magic = 0x184D2A50;
+constexpr size_t skippable_header_size = 8;
+constexpr size_t header_size = skippable_header_size + sizeof(magic);
+constexpr size_t trailer_size = 4 + 4 + sizeof(magic);
+// Records are grouped in frames of about this many bytes before compression
+constexpr size_t frame_size = 1 << 20;
+
+std::string skippable_frame(const std::string &content) {
+  std::string frame;
+  ldb::PutFixed32(&frame, skippable_magic);
+  ldb::PutFixed32(&frame, content.size());
+  frame += content;
+  return frame;
+}
+
+// Reads size bytes at offset, or at the current position without one
+ldb::Status read_full(const int fd, char *data, const size_t size,
+                      const std::optional<uint64_t> offset) {
+  size_t done = 0;
+  while (done < size) {
+    const auto r = offset ? pread(fd, data + done, size - done, *offset + done)
+                          : read(fd, data + done, size - done);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r < 0) {
+      return ldb::Status::IOError("export stream", std::strerror(errno));
+    }
+    if (r == 0) {
+      return ldb::Status::Corruption("export stream is truncated");
+    }
+    done += r;
+  }
+  return ldb::Status::OK();
+}
+}  // namespace export_detail
+
+// Records of a key range compressed into frames, the offsets of the frames
+// are from the start of data until the part is written
+class export_part {
+ public:
+  UTILS_DEFAULT_MOVE(export_part)
+  UTILS_NOT_COPYABLE(export_part)
+  explicit export_part(const int level = ZSTD_CLEVEL_DEFAULT) : level(level) {}
+
+  std::string data{};
+  std::vector<export_frame> frames{};
+  // Set when compression failed
+  std::string error{};
+
+  [[nodiscard]] bool add(const ldb::Slice &key, const ldb::Slice &value) {
+    if (records == 0) {
+      first_key.assign(key.data(), key.size());
+    }
+    ldb::PutVarint32(&pending, key.size());
+    pending.append(key.data(), key.size());
+    ldb::PutVarint32(&pending, value.size());
+    pending.append(value.data(), value.size());
+    records++;
+    return pending.size() < export_detail::frame_size || compress_pending();
+  }
+
+  [[nodiscard]] bool finish() { return compress_pending(); }
+
+ private:
+  bool compress_pending() {
+    if (records == 0) {
+      return true;
+    }
+    auto *ctx = zstd_detail::thread_cctx();
+    ZSTD_CCtx_reset(ctx, ZSTD_reset_session_and_parameters);
+    ZSTD_CCtx_setParameter(ctx, ZSTD_c_compressionLevel, level);
+    ZSTD_CCtx_setParameter(ctx, ZSTD_c_checksumFlag, 1);
+    const auto offset = data.size();
+    data.resize(offset + ZSTD_compressBound(pending.size()));
+    const auto size = ZSTD_compress2(ctx, data.data() + offset,
+                                     data.size() - offset, pending.data(),
+                                     pending.size());
+    if (ZSTD_isError(size)) {
+      data.resize(offset);
+      error = ZSTD_getErrorName(size);
+      return false;
+    }
+    data.resize(offset + size);
+    frames.push_back({offset, static_cast<uint32_t>(size), records,
+                      std::move(first_key)});
+    pending.clear();
+    first_key.clear();
+    records = 0;
+    return true;
+  }
+
+  int level;
+  std::string pending{};
+  std::string first_key{};
+  uint32_t records = 0;
+};
+
+// Writes a stream from parts made by several threads, in the order of their
+// numbers. Part i can only be started once part i - window was written, so at
+// most window parts are held in memory.
+class export_writer {
+ public:
+  UTILS_NOT_COPYABLE(export_writer)
+  UTILS_NOT_MOVEABLE(export_writer)
+  export_writer(output_writer &output, const size_t parts, const size_t window)
+      : output(output),
+        parts(parts),
+        window(std::max<size_t>(window, 1)),
+        writer([this]() { write(); }) {}
+
+  // Waits until part can be started, false if the stream was cancelled
+  [[nodiscard]] bool wait_turn(const size_t part) {
+    std::unique_lock lock(mutex);
+    written_cv.wait(lock,
+                    [&]() { return cancelled || part < written + window; });
+    return !cancelled;
+  }
+
+  void submit(const size_t part, export_part &&result) {
+    std::unique_lock lock(mutex);
+    parts[part] = std::move(result);
+    ready_cv.notify_all();
+  }
+
+  // Parts submitted after this are dropped
+  void cancel() {
+    std::unique_lock lock(mutex);
+    cancelled = true;
+    ready_cv.notify_all();
+    written_cv.notify_all();
+  }
+
+  // Once every part was submitted, writes the index and flushes the output
+  [[nodiscard]] bool finish() {
+    writer.join();
+    if (cancelled) {
+      return false;
+    }
+    std::string index;
+    for (const auto &frame : frames) {
+      ldb::PutFixed64(&index, frame.offset);
+      ldb::PutFixed32(&index, frame.size);
+      ldb::PutFixed32(&index, frame.records);
+      ldb::PutVarint32(&index, frame.first_key.size());
+      index += frame.first_key;
+    }
+    using namespace export_detail;
+    ldb::PutFixed32(&index, frames.size());
+    // The size of the frame includes the rest of the trailer
+    ldb::PutFixed32(&index,
+                    skippable_header_size + index.size() + 4 + sizeof(magic));
+    index.append(magic, sizeof(magic));
+    output.append(skippable_frame(index));
+    return output.finish();
+  }
+
+  ~export_writer() {
+    if (writer.joinable()) {
+      cancel();
+      writer.join();
+    }
+  }
+
+  // Written to the stream, once it's finished
+  uint64_t records() const { return written_records; }
+
+ private:
+  void write() {
+    output.append(export_detail::skippable_frame(
+        std::string(export_detail::magic, sizeof(export_detail::magic))));
+    uint64_t position = export_detail::header_size;
+    for (size_t i = 0; i < parts.size(); i++) {
+      export_part part;
+      {
+        std::unique_lock lock(mutex);
+        ready_cv.wait(lock, [&]() { return cancelled || parts[i]; });
+        if (cancelled) {
+          return;
+        }
+        part = std::move(*parts[i]);
+        parts[i].reset();
+      }
+      output.append(part.data);
+      for (auto &frame : part.frames) {
+        frame.offset += position;
+        written_records += frame.records;
+        frames.push_back(std::move(frame));
+      }
+      position += part.data.size();
+      std::unique_lock lock(mutex);
+      if (output.error != 0) {
+        cancelled = true;
+        ready_cv.notify_all();
+      }
+      written = i + 1;
+      written_cv.notify_all();
+    }
+  }
+
+  output_writer &output;
+  std::vector<std::optional<export_part>> parts;
+  const size_t window;
+  std::vector<export_frame> frames{};
+  uint64_t written_records = 0;
+  std::mutex mutex{};
+  std::condition_variable ready_cv{};
+  std::condition_variable written_cv{};
+  size_t written = 0;
+  bool cancelled = false;
+  std::thread writer;
+};
+
+// Checks that fd starts with the header of an export stream. Without offset
+// the header is read from the current position, like from a pipe.
+ldb::Status read_export_header(const int fd,
+                               const std::optional<uint64_t> offset) {
+  using namespace export_detail;
+  char header[header_size];
+  auto status = read_full(fd, header, sizeof(header), offset);
+  if (!status.ok()) {
+    return status;
+  }
+  if (ldb::DecodeFixed32(header) != skippable_magic ||
+      ldb::DecodeFixed32(header + 4) != sizeof(magic) ||
+      std::memcmp(header + skippable_header_size, magic, sizeof(magic)) != 0) {
+    return ldb::Status::Corruption("not an export stream");
+  }
+  return status;
+}
+
+// Reads the index at the end of a stream stored in a file of size bytes.
+// index_offset is where the frames end.
+ldb::Status read_export_index(const int fd, const uint64_t size,
+                              std::vector<export_frame> &frames,
+                              uint64_t &index_offset) {
+  using namespace export_detail;
+  if (size < header_size + skippable_header_size + trailer_size) {
+    return ldb::Status::Corruption("export stream has no index");
+  }
+  char trailer[trailer_size];
+  auto status = read_full(fd, trailer, sizeof(trailer), size - trailer_size);
+  if (!status.ok()) {
+    return status;
+  }
+  const auto count = ldb::DecodeFixed32(trailer);
+  const uint64_t index_size = ldb::DecodeFixed32(trailer + 4);
+  if (std::memcmp(trailer + 8, magic, sizeof(magic)) != 0 ||
+      index_size < skippable_header_size + trailer_size ||
+      index_size > size - header_size) {
+    return ldb::Status::Corruption("export stream has no index");
+  }
+  index_offset = size - index_size;
+  std::string index(index_size, '\0');
+  status = read_full(fd, index.data(), index.size(), index_offset);
+  if (!status.ok()) {
+    return status;
+  }
+  ldb::Slice input(index.data() + skippable_header_size,
+                   index.size() - skippable_header_size - trailer_size);
+  frames.clear();
+  uint64_t end = header_size;
+  for (uint32_t i = 0; i < count; i++) {
+    export_frame frame{};
+    ldb::Slice first_key;
+    const bool valid = input.size() >= 16;
+    if (valid) {
+      frame.offset = ldb::DecodeFixed64(input.data());
+      frame.size = ldb::DecodeFixed32(input.data() + 8);
+      frame.records = ldb::DecodeFixed32(input.data() + 12);
+      input.remove_prefix(16);
+    }
+    uint32_t key_size;
+    if (!valid || !ldb::GetVarint32(&input, &key_size) ||
+        input.size() < key_size || frame.offset != end ||
+        (!frames.empty() &&
+         ldb::Slice(frames.back().first_key).compare(
+             ldb::Slice(input.data(), key_size)) >= 0)) {
+      return ldb::Status::Corruption("invalid export stream index");
+    }
+    frame.first_key.assign(input.data(), key_size);
+    input.remove_prefix(key_size);
+    end = frame.offset + frame.size;
+    frames.push_back(std::move(frame));
+  }
+  if (!input.empty() || end != index_offset) {
+    return ldb::Status::Corruption("invalid export stream index");
+  }
+  return status;
+}
+
+// Decompresses the frames in [begin, end) of fd and calls visit(key, value)
+// for their records until it returns false. Without end the stream is read
+// from the current position until it ends, skipping the index.
+template <typename Visit>
+ldb::Status read_export_records(const int fd, const uint64_t begin,
+                                const std::optional<uint64_t> end,
+                                Visit &&visit) {
+  std::unique_ptr<ZSTD_DCtx, zstd_detail::dctx_deleter> ctx(
+      ZSTD_createDCtx());
+  std::string input(ZSTD_DStreamInSize(), '\0');
+  std::string output(ZSTD_DStreamOutSize(), '\0');
+  std::string decoded;
+  uint64_t position = begin;
+  size_t frame_left = 0;
+  while (!end || position < *end) {
+    const size_t want =
+        end ? std::min<uint64_t>(input.size(), *end - position) : input.size();
+    const auto r = end ? pread(fd, input.data(), want, position)
+                       : read(fd, input.data(), want);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r < 0) {
+      return ldb::Status::IOError("export stream", std::strerror(errno));
+    }
+    if (r == 0) {
+      if (end) {
+        return ldb::Status::Corruption("export stream is truncated");
+      }
+      break;
+    }
+    position += r;
+    ZSTD_inBuffer in{input.data(), static_cast<size_t>(r), 0};
+    while (in.pos < in.size) {
+      ZSTD_outBuffer out{output.data(), output.size(), 0};
+      frame_left = ZSTD_decompressStream(ctx.get(), &out, &in);
+      if (ZSTD_isError(frame_left)) {
+        return ldb::Status::Corruption("export stream",
+                                       ZSTD_getErrorName(frame_left));
+      }
+      decoded.append(output.data(), out.pos);
+    }
+
+    const char *p = decoded.data();
+    const char *const limit = decoded.data() + decoded.size();
+    while (p < limit) {
+      uint32_t key_size, value_size;
+      const char *key = ldb::GetVarint32Ptr(p, limit, &key_size);
+      if (key == nullptr || static_cast<size_t>(limit - key) < key_size) {
+        break;
+      }
+      const char *value =
+          ldb::GetVarint32Ptr(key + key_size, limit, &value_size);
+      if (value == nullptr ||
+          static_cast<size_t>(limit - value) < value_size) {
+        break;
+      }
+      if (!visit(ldb::Slice(key, key_size), ldb::Slice(value, value_size))) {
+        return ldb::Status::OK();
+      }
+      p = value + value_size;
+    }
+    decoded.erase(0, p - decoded.data());
+  }
+  if (frame_left != 0 || !decoded.empty()) {
+    return ldb::Status::Corruption("export stream ends in a record");
+  }
+  return ldb::Status::OK();
+}
@@ -1,9 +1,16 @@
 #pragma once
 
-#include <functional>
-#include <map>
-#include <set>
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <mutex>
 #include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include "leveldb/env.h"
 #include "leveldb/options.h"
@@ -14,44 +21,148 @@ namespace hackdb {
 namespace ldb = leveldb;
 
 using compression_id_t = unsigned char;
-struct logger_entry;
+static_assert(std::numeric_limits<compression_id_t>::min() == 0);
+static constexpr size_t compression_ids =
+    std::numeric_limits<compression_id_t>::max() + 1;
+using block_counts = std::array<uint64_t, compression_ids>;
 
-class block_logger_entries {
+class block_counter;
+
+namespace detail {
+// Counts of a single thread, only that thread writes to it so increments
+// don't need atomic read-modify-writes. Aligned so that threads don't share
+// cache lines.
+struct alignas(64) thread_slot {
+  std::array<std::atomic<uint64_t>, compression_ids> counts{};
+
+  void add(const compression_id_t id) {
+    auto &count = counts[id];
+    count.store(count.load(std::memory_order_relaxed) + 1,
+                std::memory_order_relaxed);
+  }
+};
+
+struct registry {
   std::shared_mutex mutex;
-  std::unordered_map<const ldb::Logger *, std::unordered_set<logger_entry *>>
-      map;
-  friend struct logger_entry;
-  friend void found_block_with_compressor(compression_id_t id,
-                                          const ldb::Options &dbOptions);
-} block_logger_map;
-
-struct logger_entry {
-  UTILS_NOT_COPYABLE(logger_entry)
-  UTILS_NOT_MOVEABLE(logger_entry)
-  logger_entry(const ldb::Logger *logger,
-               std::function<void(compression_id_t)> &&func)
-      : func(func), logger(logger) {
-    std::unique_lock lock(block_logger_map.mutex);
-    block_logger_map.map[logger].insert(this);
-  };
-
-  std::function<void(compression_id_t)> func;
-  const ldb::Logger *logger;
-  ~logger_entry() {
-    std::unique_lock lock(block_logger_map.mutex);
-    block_logger_map.map[logger].erase(this);
+  std::unordered_map<const ldb::Logger *, block_counter *> counters;
+  // Bumped every time a counter comes or goes, invalidates thread caches
+  std::atomic<uint64_t> generation{0};
+} counters_registry;
+
+// Last slot used by this thread, found_block_with_compressor only takes the
+// registry lock when the logger or the registered counters change
+struct slot_cache {
+  const ldb::Logger *logger = nullptr;
+  uint64_t generation = std::numeric_limits<uint64_t>::max();
+  thread_slot *slot = nullptr;
+};
+thread_local slot_cache cached_slot{};
+
+thread_slot *lookup_slot(const ldb::Logger *logger);
+}  // namespace detail
+
+// Counts the blocks read by DBs whose Options::info_log is logger, grouped by
+// the compressor ID stored in each block trailer. Only one counter can be
+// registered for a logger at a time, and it has to outlive every DB using
+// that logger since readers don't lock it.
+class block_counter {
+ public:
+  UTILS_NOT_COPYABLE(block_counter)
+  UTILS_NOT_MOVEABLE(block_counter)
+  explicit block_counter(const ldb::Logger *logger) : logger(logger) {
+    auto &registry = detail::counters_registry;
+    std::unique_lock lock(registry.mutex);
+    [[maybe_unused]] const bool inserted =
+        registry.counters.emplace(logger, this).second;
+    assert(inserted && "logger already has a block counter");
+    registry.generation.fetch_add(1, std::memory_order_release);
+  }
+
+  ~block_counter() {
+    auto &registry = detail::counters_registry;
+    std::unique_lock lock(registry.mutex);
+    registry.counters.erase(logger);
+    registry.generation.fetch_add(1, std::memory_order_release);
+  }
+
+  // Counts since the previous call, adding up the slots of every thread
+  block_counts take_counts() {
+    std::unique_lock lock(mutex);
+    auto counts = sum_slots();
+    for (size_t i = 0; i < compression_ids; i++) {
+      const auto total = counts[i];
+      counts[i] -= taken[i];
+      taken[i] = total;
+    }
+    return counts;
+  }
+
+  // Counts since the counter was made, doesn't change what take_counts
+  // returns
+  block_counts total_counts() {
+    std::unique_lock lock(mutex);
+    return sum_slots();
+  }
+
+  const ldb::Logger *const logger;
+
+ private:
+  block_counts sum_slots() const {
+    block_counts counts{};
+    for (const auto &slot : slots) {
+      for (size_t i = 0; i < compression_ids; i++) {
+        counts[i] += slot->counts[i].load(std::memory_order_relaxed);
+      }
+    }
+    return counts;
   }
+
+  friend detail::thread_slot *detail::lookup_slot(const ldb::Logger *);
+
+  detail::thread_slot *slot_for_this_thread() {
+    std::unique_lock lock(mutex);
+    auto &slot = thread_slots[std::this_thread::get_id()];
+    if (!slot) {
+      slots.push_back(std::make_unique<detail::thread_slot>());
+      slot = slots.back().get();
+    }
+    return slot;
+  }
+
+  std::mutex mutex;
+  std::vector<std::unique_ptr<detail::thread_slot>> slots{};
+  std::unordered_map<std::thread::id, detail::thread_slot *> thread_slots{};
+  block_counts taken{};
 };
 
+namespace detail {
+thread_slot *lookup_slot(const ldb::Logger *logger) {
+  auto &registry = counters_registry;
+  std::shared_lock lock(registry.mutex);
+  cached_slot.logger = logger;
+  cached_slot.generation = registry.generation.load(std::memory_order_relaxed);
+  auto it = registry.counters.find(logger);
+  cached_slot.slot = it == registry.counters.end()
+                         ? nullptr
+                         : it->second->slot_for_this_thread();
+  return cached_slot.slot;
+}
+}  // namespace detail
+
+// Called by ReadBlock for every block it reads, see
+// patches/leveldb-mcpe/00-hackdb.patch
 void found_block_with_compressor(compression_id_t id,
                                  const ldb::Options &dbOptions) {
-  std::shared_lock lock(block_logger_map.mutex);
-  auto logger = dbOptions.info_log;
-  if (!block_logger_map.map.count(logger)) {
-    return;
+  using namespace detail;
+  const auto generation =
+      counters_registry.generation.load(std::memory_order_acquire);
+  auto *slot = cached_slot.slot;
+  if (cached_slot.logger != dbOptions.info_log ||
+      cached_slot.generation != generation) {
+    slot = lookup_slot(dbOptions.info_log);
   }
-  for (auto &elem : block_logger_map.map[logger]) {
-    elem->func(id);
+  if (slot) {
+    slot->add(id);
   }
 }
 }  // namespace hackdb
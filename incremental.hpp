@@ -0,0 +1,259 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "db/dbformat.h"
+#include "leveldb/db.h"
+#include "leveldb/env.h"
+#include "leveldb/iterator.h"
+#include "manifest.hpp"
+#include "ranges.hpp"
+#include "util/coding.h"
+#include "util/hash.h"
+
+namespace ldb = leveldb;
+
+// Order dependent hash of the pairs in a key range, used to tell whether a
+// range whose tables were rewritten still has the same contents
+class range_hash {
+ public:
+  void add(const ldb::Slice &key, const ldb::Slice &value) {
+    mix((uint64_t{key.size()} << 32) | value.size());
+    mix((uint64_t{ldb::Hash(key.data(), key.size(), key_seed)} << 32) |
+        ldb::Hash(value.data(), value.size(), value_seed));
+  }
+
+  uint64_t get() const { return hash; }
+
+ private:
+  static constexpr uint32_t key_seed = 0x9e3779b9;
+  static constexpr uint32_t value_seed = 0x7f4a7c15;
+
+  // FNV-1a over 64 bit words, with a final shift so high bits reach the
+  // low ones
+  void mix(const uint64_t word) {
+    hash = (hash ^ word) * 0x100000001b3ull;
+    hash ^= hash >> 29;
+  }
+
+  uint64_t hash = 0xcbf29ce484222325ull;
+};
+
+// What the previous incremental copy saw of each key range of the input
+struct incremental_range {
+  key_range range;
+  // Input tables overlapping the range, sorted
+  std::vector<uint64_t> tables;
+  uint64_t hash;
+};
+
+struct incremental_state {
+  std::vector<incremental_range> ranges{};
+};
+
+namespace incremental_detail {
+// Kept in the output DB directory, leveldb ignores files it didn't name
+constexpr auto state_file_name = "bedrock-unz-incremental";
+constexpr auto state_magic = "bedrock-unz incremental 1";
+
+std::string state_file(const std::string &dbname) {
+  return dbname + "/" + state_file_name;
+}
+}  // namespace incremental_detail
+
+// Tables of manifest whose user keys overlap range
+std::vector<uint64_t> overlapping_tables(const db_manifest &manifest,
+                                         const key_range &range) {
+  std::vector<uint64_t> tables;
+  for (const auto &[number, file] : manifest.files) {
+    const auto smallest = ldb::ExtractUserKey(file.smallest);
+    const auto largest = ldb::ExtractUserKey(file.largest);
+    if (largest.compare(range.begin) >= 0 && range.before_end(smallest)) {
+      tables.push_back(number);
+    }
+  }
+  return tables;
+}
+
+// found is false when the output has no state, as after its first copy
+ldb::Status read_incremental_state(ldb::Env *env, const std::string &dbname,
+                                   incremental_state &state, bool &found) {
+  using namespace incremental_detail;
+  state = {};
+  found = false;
+  const auto fname = state_file(dbname);
+  if (!env->FileExists(fname)) {
+    return ldb::Status::OK();
+  }
+  std::string content;
+  auto status = ldb::ReadFileToString(env, fname, &content);
+  if (!status.ok()) {
+    return status;
+  }
+  const auto corrupt = [&]() {
+    return ldb::Status::Corruption("bad incremental state", fname);
+  };
+  ldb::Slice input(content);
+  ldb::Slice magic;
+  uint64_t count;
+  if (!ldb::GetLengthPrefixedSlice(&input, &magic) ||
+      magic != ldb::Slice(state_magic) || !ldb::GetVarint64(&input, &count)) {
+    return corrupt();
+  }
+  for (uint64_t i = 0; i < count; i++) {
+    incremental_range range{};
+    ldb::Slice begin, end;
+    uint32_t has_end, tables;
+    if (!ldb::GetLengthPrefixedSlice(&input, &begin) ||
+        !ldb::GetVarint32(&input, &has_end) ||
+        (has_end && !ldb::GetLengthPrefixedSlice(&input, &end)) ||
+        !ldb::GetVarint64(&input, &range.hash) ||
+        !ldb::GetVarint32(&input, &tables)) {
+      return corrupt();
+    }
+    range.range.begin = begin.ToString();
+    if (has_end) {
+      range.range.end = end.ToString();
+    }
+    range.tables.resize(tables);
+    for (auto &table : range.tables) {
+      if (!ldb::GetVarint64(&input, &table)) {
+        return corrupt();
+      }
+    }
+    state.ranges.push_back(std::move(range));
+  }
+  if (!input.empty()) {
+    return corrupt();
+  }
+  found = true;
+  return ldb::Status::OK();
+}
+
+// Replaces the state file through a rename so a failed run leaves the
+// previous one in place
+ldb::Status write_incremental_state(ldb::Env *env, const std::string &dbname,
+                                    const incremental_state &state) {
+  using namespace incremental_detail;
+  std::string content;
+  ldb::PutLengthPrefixedSlice(&content, state_magic);
+  ldb::PutVarint64(&content, state.ranges.size());
+  for (const auto &range : state.ranges) {
+    ldb::PutLengthPrefixedSlice(&content, range.range.begin);
+    ldb::PutVarint32(&content, range.range.end.has_value());
+    if (range.range.end) {
+      ldb::PutLengthPrefixedSlice(&content, *range.range.end);
+    }
+    ldb::PutVarint64(&content, range.hash);
+    ldb::PutVarint32(&content, range.tables.size());
+    for (const auto table : range.tables) {
+      ldb::PutVarint64(&content, table);
+    }
+  }
+  const auto fname = state_file(dbname);
+  const auto tmp_name = fname + ".tmp";
+  auto status = ldb::WriteStringToFileSync(env, content, tmp_name);
+  if (status.ok()) {
+    status = env->RenameFile(tmp_name, fname);
+  }
+  if (!status.ok()) {
+    env->DeleteFile(tmp_name);
+  }
+  return status;
+}
+
+// Hash of the pairs of input in range
+ldb::Status hash_range(ldb::DB &input, const ldb::ReadOptions &ropts,
+                       const key_range &range, uint64_t &result) {
+  auto iter = std::unique_ptr<ldb::Iterator>(input.NewIterator(ropts));
+  range_hash hash;
+  for (iter->Seek(range.begin); iter->Valid() && range.before_end(iter->key());
+       iter->Next()) {
+    hash.add(iter->key(), iter->value());
+  }
+  result = hash.get();
+  return iter->status();
+}
+
+// How the value of a key differs from the first DB to the second
+enum class key_change { same, added, removed, changed };
+
+// Walks range in both iterators in key order, calling
+// visit(change, key, a_value, b_value) for every key in any of them, a
+// missing value is empty. Stops early when visit returns false, then or when
+// an iterator fails the result is false.
+template <typename Visit>
+bool walk_pairs(ldb::Iterator &a, ldb::Iterator &b, const key_range &range,
+                Visit &&visit) {
+  a.Seek(range.begin);
+  b.Seek(range.begin);
+  while (true) {
+    const bool a_valid = a.Valid() && range.before_end(a.key());
+    const bool b_valid = b.Valid() && range.before_end(b.key());
+    if (!a_valid && !b_valid) {
+      break;
+    }
+    const int order = !a_valid   ? 1
+                      : !b_valid ? -1
+                                 : a.key().compare(b.key());
+    bool go_on;
+    if (order < 0) {
+      go_on = visit(key_change::removed, a.key(), a.value(), ldb::Slice());
+    } else if (order > 0) {
+      go_on = visit(key_change::added, b.key(), ldb::Slice(), b.value());
+    } else {
+      go_on = visit(
+          a.value() == b.value() ? key_change::same : key_change::changed,
+          a.key(), a.value(), b.value());
+    }
+    if (!go_on) {
+      return false;
+    }
+    if (order <= 0) {
+      a.Next();
+    }
+    if (order >= 0) {
+      b.Next();
+    }
+  }
+  return a.status().ok() && b.status().ok();
+}
+
+// Walks range in both DBs in key order and makes output match input, only
+// the pairs that differ are written to sink. result is the hash of the input
+// pairs.
+template <typename Sink>
+ldb::Status diff_range(ldb::DB &input, const ldb::ReadOptions &input_ropts,
+                       ldb::DB &output, const ldb::ReadOptions &output_ropts,
+                       Sink &sink, const key_range &range, uint64_t &result) {
+  auto in = std::unique_ptr<ldb::Iterator>(input.NewIterator(input_ropts));
+  auto out = std::unique_ptr<ldb::Iterator>(output.NewIterator(output_ropts));
+  range_hash hash;
+  bool written = true;
+  walk_pairs(*in, *out, range,
+             [&](const key_change change, const ldb::Slice &key,
+                 const ldb::Slice &in_value, const ldb::Slice &) {
+               if (change != key_change::added) {
+                 hash.add(key, in_value);
+               }
+               if (change == key_change::added) {
+                 written = sink.Delete(key);
+               } else if (change != key_change::same) {
+                 written = sink.Put(key, in_value);
+               }
+               return written;
+             });
+  if (!written) {
+    return sink.last_status;
+  }
+  for (const auto *iter : {in.get(), out.get()}) {
+    if (!iter->status().ok()) {
+      sink.abandon();
+      return iter->status();
+    }
+  }
+  result = hash.get();
+  return sink.finish();
+}
@@ -0,0 +1,323 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "bedrock_keys.hpp"
+#include "leveldb/iterator.h"
+#include "leveldb/slice.h"
+#include "ranges.hpp"
+
+namespace ldb = leveldb;
+
+// Chunks with x0 <= x <= x1 and z0 <= z <= z1
+struct chunk_box {
+  int32_t x0;
+  int32_t z0;
+  int32_t x1;
+  int32_t z1;
+
+  // Saturates instead of overflowing for the whole coordinate space
+  uint64_t chunks() const {
+    const uint64_t width = int64_t{x1} - x0 + 1;
+    const uint64_t depth = int64_t{z1} - z0 + 1;
+    if (width > std::numeric_limits<uint64_t>::max() / depth) {
+      return std::numeric_limits<uint64_t>::max();
+    }
+    return width * depth;
+  }
+};
+
+// What to do after a key that didn't match a key_filter
+struct filter_hint {
+  enum action_t {
+    // Keys right after it could match
+    next,
+    // No key before target can match
+    seek,
+    // No key after it can match
+    done,
+  } action;
+  std::string target{};
+};
+
+namespace key_filter_detail {
+// Boxes with more chunks than this are checked key by key instead of
+// seeking to every chunk in them
+constexpr uint64_t max_box_seeks = 1 << 20;
+
+// Smallest key greater than every key starting with prefix, empty if there
+// is none
+std::string prefix_successor(std::string prefix) {
+  while (!prefix.empty()) {
+    auto &last = reinterpret_cast<unsigned char &>(prefix.back());
+    if (last != 0xff) {
+      last++;
+      return prefix;
+    }
+    prefix.pop_back();
+  }
+  return prefix;
+}
+
+bool less(const std::string &a, const std::string &b) {
+  return ldb::Slice(a).compare(b) < 0;
+}
+}  // namespace key_filter_detail
+
+// Selects keys by the fields of Bedrock chunk keys and by prefix, every
+// criterion that is set has to match. Besides telling whether a key matches
+// it can tell how far an iterator can seek past one that doesn't, so only
+// the parts of the key space that can match are read.
+class key_filter {
+ public:
+  // Matches every key
+  key_filter() = default;
+
+  key_filter(const std::optional<int32_t> dimension,
+             const std::optional<chunk_box> box,
+             const std::optional<unsigned char> tag,
+             std::vector<std::string> prefixes)
+      : dimension(dimension),
+        box(box),
+        tag(tag),
+        prefixes(std::move(prefixes)) {
+    if (box && box->chunks() <= key_filter_detail::max_box_seeks) {
+      for (int64_t x = box->x0; x <= box->x1; x++) {
+        for (int64_t z = box->z0; z <= box->z1; z++) {
+          seek_prefixes.push_back(chunk_group_start(
+              bedrock_keys::chunk_prefix(static_cast<int32_t>(x),
+                                         static_cast<int32_t>(z))));
+        }
+      }
+    } else {
+      seek_prefixes = this->prefixes;
+    }
+    // Keys starting with a prefix also start with any prefix of it, keeping
+    // the shorter one is enough
+    std::sort(seek_prefixes.begin(), seek_prefixes.end(),
+              key_filter_detail::less);
+    std::vector<std::string> kept;
+    for (auto &prefix : seek_prefixes) {
+      if (kept.empty() || !ldb::Slice(prefix).starts_with(kept.back())) {
+        kept.push_back(std::move(prefix));
+      }
+    }
+    seek_prefixes = std::move(kept);
+  }
+
+  bool matches_everything() const {
+    return !dimension && !box && !tag && prefixes.empty();
+  }
+
+  bool matches(const ldb::Slice &key) const {
+    if (!prefixes.empty() &&
+        std::none_of(prefixes.begin(), prefixes.end(),
+                     [&](const auto &prefix) {
+                       return key.starts_with(prefix);
+                     })) {
+      return false;
+    }
+    if (!dimension && !box && !tag) {
+      return true;
+    }
+    const auto chunk = bedrock_keys::parse_chunk_key({key.data(), key.size()});
+    if (!chunk) {
+      return false;
+    }
+    return (!dimension || chunk->dimension == *dimension) &&
+           (!tag || chunk->tag == *tag) &&
+           (!box || (chunk->x >= box->x0 && chunk->x <= box->x1 &&
+                     chunk->z >= box->z0 && chunk->z <= box->z1));
+  }
+
+  // For a key that doesn't match
+  filter_hint hint(const ldb::Slice &key) const {
+    using key_filter_detail::prefix_successor;
+    if (!seek_prefixes.empty()) {
+      // First prefix after key, the one before it is the only one key can
+      // start with
+      const auto next = std::upper_bound(
+          seek_prefixes.begin(), seek_prefixes.end(), key,
+          [](const ldb::Slice &key, const std::string &prefix) {
+            return key.compare(prefix) < 0;
+          });
+      if (next == seek_prefixes.begin() ||
+          !key.starts_with(*std::prev(next))) {
+        if (next == seek_prefixes.end()) {
+          return {filter_hint::done};
+        }
+        return {filter_hint::seek, *next};
+      }
+    }
+    if (!dimension || key.size() < chunk_prefix_size) {
+      return {filter_hint::next};
+    }
+    // Every record of a chunk starts with the same 8 bytes, and the records
+    // of a dimension are next to each other among them
+    const std::string group(key.data(), chunk_prefix_size);
+    const auto start = chunk_group_start(group);
+    const auto end = chunk_group_end(group);
+    if (key.compare(start) < 0) {
+      return {filter_hint::seek, start};
+    }
+    if (key.compare(end) < 0) {
+      return {filter_hint::next};
+    }
+    auto after = prefix_successor(group);
+    if (after.empty()) {
+      return {filter_hint::done};
+    }
+    return {filter_hint::seek, std::move(after)};
+  }
+
+  const std::optional<int32_t> dimension{};
+  const std::optional<chunk_box> box{};
+  const std::optional<unsigned char> tag{};
+  // Keys have to start with one of these
+  const std::vector<std::string> prefixes{};
+
+ private:
+  static constexpr size_t chunk_prefix_size = 8;
+
+  // Smallest key among the records of the chunk with group as prefix that
+  // can match
+  std::string chunk_group_start(const std::string &group) const {
+    if (!dimension) {
+      return group;
+    }
+    auto start = group + bedrock_keys::dimension_bytes(*dimension);
+    if (tag) {
+      start += static_cast<char>(*tag);
+    } else if (*dimension == 0) {
+      start += static_cast<char>(bedrock_keys::first_record_tag);
+    }
+    return start;
+  }
+
+  // Past the largest one, only used with a dimension
+  std::string chunk_group_end(const std::string &group) const {
+    if (*dimension == 0 && !tag) {
+      return group + static_cast<char>(bedrock_keys::last_record_tag + 1);
+    }
+    return key_filter_detail::prefix_successor(chunk_group_start(group));
+  }
+
+  // Sorted, none of them is a prefix of another
+  std::vector<std::string> seek_prefixes{};
+};
+
+// Goes through the keys of range that match filter, seeking past the parts
+// of it that can't match
+class filtered_scan {
+ public:
+  // filter can be null to go through every key
+  filtered_scan(ldb::Iterator &iter, const key_range &range,
+                const key_filter *filter)
+      : iter(iter),
+        range(range),
+        filter(filter && !filter->matches_everything() ? filter : nullptr) {}
+
+  void seek_to_first() {
+    iter.Seek(range.begin);
+    skip();
+  }
+
+  bool valid() const {
+    return !done && iter.Valid() && range.before_end(iter.key());
+  }
+
+  void next() {
+    iter.Next();
+    skip();
+  }
+
+  ldb::Slice key() const { return iter.key(); }
+  ldb::Slice value() const { return iter.value(); }
+
+ private:
+  void skip() {
+    if (!filter) {
+      return;
+    }
+    while (valid() && !filter->matches(iter.key())) {
+      auto hint = filter->hint(iter.key());
+      switch (hint.action) {
+        case filter_hint::next:
+          iter.Next();
+          break;
+        case filter_hint::seek:
+          iter.Seek(hint.target);
+          break;
+        case filter_hint::done:
+          done = true;
+          break;
+      }
+    }
+  }
+
+  ldb::Iterator &iter;
+  const key_range &range;
+  const key_filter *const filter;
+  bool done = false;
+};
+
+// Parses X0,Z0,X1,Z1, corners can be given in any order
+std::optional<chunk_box> parse_chunk_box(const std::string &spec) {
+  int32_t coords[4];
+  const char *pos = spec.data();
+  const char *const end = spec.data() + spec.size();
+  bool valid = true;
+  for (size_t i = 0; i < 4 && valid; i++) {
+    const auto [parsed_end, ec] = std::from_chars(pos, end, coords[i]);
+    pos = parsed_end;
+    valid = ec == std::errc() && (i == 3 || (pos != end && *pos++ == ','));
+  }
+  if (!valid || pos != end) {
+    std::cerr << "Invalid chunk box " << spec
+              << ", expected X0,Z0,X1,Z1 in chunk coordinates" << std::endl;
+    return {};
+  }
+  return chunk_box{std::min(coords[0], coords[2]),
+                   std::min(coords[1], coords[3]),
+                   std::max(coords[0], coords[2]),
+                   std::max(coords[1], coords[3])};
+}
+
+// Parses a key prefix where bytes can be written as \xNN, like in dumps
+std::optional<std::string> parse_key_prefix(const std::string &spec) {
+  std::string prefix;
+  for (size_t i = 0; i < spec.size(); i++) {
+    if (spec[i] != '\\') {
+      prefix += spec[i];
+      continue;
+    }
+    if (i + 1 < spec.size() && spec[i + 1] == '\\') {
+      prefix += '\\';
+      i++;
+      continue;
+    }
+    unsigned char byte;
+    const bool valid =
+        i + 3 < spec.size() && spec[i + 1] == 'x' &&
+        std::from_chars(&spec[i + 2], &spec[i + 4], byte, 16).ptr ==
+            &spec[i + 4];
+    if (!valid) {
+      std::cerr << "Invalid escape in key prefix " << spec
+                << ", expected \\xNN or \\\\" << std::endl;
+      return {};
+    }
+    prefix += static_cast<char>(byte);
+    i += 3;
+  }
+  return prefix;
+}
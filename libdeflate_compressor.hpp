@@ -0,0 +1,136 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+
+#include "leveldb/compressor.h"
+#include "leveldb/zlib_compressor.h"
+#include "libdeflate.h"
+
+namespace ldb = leveldb;
+
+namespace libdeflate_detail {
+struct compressor_deleter {
+  void operator()(libdeflate_compressor *compressor) const {
+    libdeflate_free_compressor(compressor);
+  }
+};
+struct decompressor_deleter {
+  void operator()(libdeflate_decompressor *decompressor) const {
+    libdeflate_free_decompressor(decompressor);
+  }
+};
+
+// Same as zlib's Z_DEFAULT_COMPRESSION
+constexpr int default_level = 6;
+constexpr int max_level = 12;
+
+// leveldb calls compressors from several threads at once, each one gets its
+// own state, one per level for compressing
+libdeflate_compressor *thread_compressor(const int level) {
+  thread_local std::array<
+      std::unique_ptr<libdeflate_compressor, compressor_deleter>,
+      max_level + 1>
+      compressors{};
+  auto &compressor = compressors[level];
+  if (!compressor) {
+    compressor.reset(libdeflate_alloc_compressor(level));
+  }
+  return compressor.get();
+}
+libdeflate_decompressor *thread_decompressor() {
+  thread_local std::unique_ptr<libdeflate_decompressor, decompressor_deleter>
+      decompressor(libdeflate_alloc_decompressor());
+  return decompressor.get();
+}
+
+// Decompressed size of the last block, where the next output buffer starts
+thread_local size_t last_decompressed_size = 0;
+}  // namespace libdeflate_detail
+
+// Writes and reads the same blocks as ZlibCompressorRaw, or ZlibCompressor
+// when raw is false, in a single call to libdeflate instead of streaming
+// through zlib. Block trailers don't say how big blocks get once decompressed,
+// the output buffer starts at the size of the last one and doubles until the
+// block fits.
+template <bool raw>
+class libdeflate_zlib_compressor : public ldb::Compressor {
+ public:
+  static const int SERIALIZE_ID = raw ? ldb::ZlibCompressorRaw::SERIALIZE_ID
+                                      : ldb::ZlibCompressor::SERIALIZE_ID;
+
+  // Levels are the ones of zlib, -1 for its default
+  explicit libdeflate_zlib_compressor(const int level = -1)
+      : ldb::Compressor(SERIALIZE_ID),
+        level(level < 0 ? libdeflate_detail::default_level : level) {}
+
+  const int level;
+
+  void compressImpl(const char *input, size_t length,
+                    std::string &output) const override {
+    auto *compressor = libdeflate_detail::thread_compressor(level);
+    if (!compressor) {
+      // compressImpl has no way to report errors
+      fprintf(stderr, "libdeflate failed to allocate a compressor\n");
+      std::abort();
+    }
+    const auto offset = output.size();
+    output.resize(offset + (raw ? libdeflate_deflate_compress_bound(compressor,
+                                                                    length)
+                                : libdeflate_zlib_compress_bound(compressor,
+                                                                 length)));
+    const auto size =
+        raw ? libdeflate_deflate_compress(compressor, input, length,
+                                          output.data() + offset,
+                                          output.size() - offset)
+            : libdeflate_zlib_compress(compressor, input, length,
+                                       output.data() + offset,
+                                       output.size() - offset);
+    // Only possible with less space than the bound
+    if (size == 0) {
+      fprintf(stderr, "libdeflate compression failed\n");
+      std::abort();
+    }
+    output.resize(offset + size);
+  }
+
+  bool decompress(const char *input, size_t length,
+                  std::string &output) const override {
+    using namespace libdeflate_detail;
+    auto *decompressor = thread_decompressor();
+    if (!decompressor) {
+      return false;
+    }
+    const auto offset = output.size();
+    // Deflate can't do better than about 1032:1
+    const size_t max_size = length * 1032 + 1024;
+    size_t capacity =
+        std::min(max_size, std::max({last_decompressed_size, length * 2,
+                                     size_t{4096}}));
+    while (true) {
+      output.resize(offset + capacity);
+      size_t size;
+      const auto result =
+          raw ? libdeflate_deflate_decompress(decompressor, input, length,
+                                              output.data() + offset,
+                                              capacity, &size)
+              : libdeflate_zlib_decompress(decompressor, input, length,
+                                           output.data() + offset, capacity,
+                                           &size);
+      if (result == LIBDEFLATE_SUCCESS) {
+        output.resize(offset + size);
+        last_decompressed_size = size;
+        return true;
+      }
+      if (result != LIBDEFLATE_INSUFFICIENT_SPACE || capacity >= max_size) {
+        output.resize(offset);
+        return false;
+      }
+      capacity = std::min(max_size, capacity * 2);
+    }
+  }
+};
@@ -1,154 +1,45 @@
 #include <array>
 #include <atomic>
 #include <filesystem>
+#include <fstream>
 #include <functional>
+#include <iomanip>
 #include <limits>
 #include <memory>
+#include <random>
+#include <unordered_map>
 #include <variant>
 #include <vector>
 
 #include "args/args.hxx"
+#include "batch.hpp"
+#include "bedrock_keys.hpp"
+#include "chunk_index.hpp"
+#include "compression_policy.hpp"
+#include "db_options.hpp"
+#include "estimate.hpp"
 #include "hackdb.h"
-#include "leveldb/cache.h"
+#include "incremental.hpp"
+#include "key_filter.hpp"
 #include "leveldb/db.h"
 #include "leveldb/env.h"
-#include "leveldb/filter_policy.h"
 #include "leveldb/write_batch.h"
-#include "leveldb/zlib_compressor.h"
+#include "decompress_pool.hpp"
+#include "export_stream.hpp"
+#include "manifest.hpp"
+#include "metrics.hpp"
+#include "output_writer.hpp"
+#include "pipeline.hpp"
+#include "ranges.hpp"
+#include "readonly_db.hpp"
+#include "tables.hpp"
 #include "utils.hpp"
+#include "verify.hpp"
+#include "zdict.h"
 
 namespace fs = std::filesystem;
 namespace ldb = leveldb;
 
-class compression_type {
- public:
-  auto make_compressor() const noexcept {
-    auto compressor = make_compressor_();
-    assert(!compressor || compressor->uniqueCompressionID == compression_id);
-    return std::unique_ptr<ldb::Compressor>(compressor);
-  }
-  compression_type(const std::string name,
-                   std::function<ldb::Compressor *(void)> &&make_compressor_)
-      : make_compressor_(make_compressor_),
-        compression_id(get_compression_id()),
-        name(name) {}
-  compression_type()
-      : make_compressor_([]() { return nullptr; }),
-        compression_id(0),
-        name("no compression") {};
-
- private:
-  const std::function<ldb::Compressor *(void)> make_compressor_;
-  hackdb::compression_id_t get_compression_id() const noexcept {
-    std::unique_ptr<ldb::Compressor> compressor(make_compressor_());
-    assert(compressor);
-    auto id = compressor->uniqueCompressionID;
-    return id;
-  }
-
- public:
-  const hackdb::compression_id_t compression_id;
-  const std::string name;
-};
-
-const auto &get_compressors() {
-  static std::vector<compression_type> compressors = {
-      // First compressor is the default one
-      {"zlib raw", []() { return new ldb::ZlibCompressorRaw(); }},
-      {"zlib", []() { return new ldb::ZlibCompressor(); }},
-      {}};
-  return compressors;
-}
-
-auto make_compressors(bool only_default = false) {
-  std::vector<std::unique_ptr<ldb::Compressor>> compressors = {};
-  for (auto &compressor : get_compressors()) {
-    if (compressor.compression_id == 0) continue;
-    if (only_default) {
-      compressors.push_back(compressor.make_compressor());
-      break;
-    }
-    compressors.push_back(compressor.make_compressor());
-  }
-  return compressors;
-}
-
-class db_opts {
- public:
-  UTILS_DEFAULT_MOVE(db_opts)
-  UTILS_NOT_COPYABLE(db_opts)
-  db_opts(std::vector<std::unique_ptr<ldb::Compressor>> &&compressors,
-          std::unique_ptr<const ldb::FilterPolicy> &&filter_policy,
-          std::unique_ptr<ldb::Cache> &&cache, ldb::Options &&opts)
-      : compressors(std::move(compressors)),
-        filter_policy(std::move(filter_policy)),
-        cache(std::move(cache)) {
-    assert(opts.block_cache == nullptr);
-    assert(opts.filter_policy == nullptr);
-    opts.block_cache = this->cache.get();
-    opts.filter_policy = this->filter_policy.get();
-    for (size_t i = 0; i < std::size(opts.compressors); i++) {
-      assert(opts.compressors[i] == nullptr);
-    }
-    assert(std::size(this->compressors) <= std::size(opts.compressors));
-    for (size_t i = 0; i < this->compressors.size(); i++) {
-      opts.compressors[i] = this->compressors[i].get();
-    }
-    this->opts = std::move(opts);
-  }
-
-  void modify(std::function<void(ldb::Options &)> &&func) {
-    func(opts);
-    assert(opts.block_cache == cache.get());
-    assert(opts.filter_policy == filter_policy.get());
-    for (size_t i = 0; i < std::size(opts.compressors); i++) {
-      assert(opts.compressors[i] ==
-             (compressors.size() > i ? compressors[i].get() : nullptr));
-    }
-  }
-
-  const ldb::Options *operator->() const { return &opts; }
-  const ldb::Options &operator*() const { return opts; }
-  const auto &get_compressors() const { return compressors; }
-  const auto &get_filter_policy() const { return filter_policy; }
-  const auto &get_cache() const { return cache; }
-
- private:
-  std::vector<std::unique_ptr<ldb::Compressor>> compressors;
-  std::unique_ptr<const ldb::FilterPolicy> filter_policy;
-  std::unique_ptr<ldb::Cache> cache;
-  ldb::Options opts;
-};
-
-using db_unique_ptr_t =
-    std::unique_ptr<leveldb::DB, unique_deleter_arena<db_opts>>;
-
-auto open_db(db_opts &&opts, const std::string &name) {
-  ldb::DB *db;
-  auto status = ldb::DB::Open(*opts, name, &db);
-  if (!status.ok()) {
-    db = nullptr;
-  }
-  auto arena = unique_deleter_arena(std::move(opts));
-  return std::pair{db_unique_ptr_t(db, std::move(arena)), status};
-}
-
-// taken from
-// https://github.com/Amulet-Team/leveldb-mcpe/blob/c446a37734d5480d4ddbc371595e7af5123c4925/mcpe_sample_setup.cpp
-// https://github.com/Amulet-Team/Amulet-LevelDB/blob/47c490e8a0a79916b97aa6ad8b93e3c43b743b8c/src/leveldb/_leveldb.pyx#L191-L199
-db_opts bedrock_default_db_options(
-    std::vector<std::unique_ptr<ldb::Compressor>> &&compressors) {
-  auto options = ldb::Options();
-  options.write_buffer_size = 4 * 1024 * 1024;
-  options.block_size = 163840;
-  options.max_open_files = 1000;
-  return db_opts(
-      std::move(compressors),
-      std::unique_ptr<const ldb::FilterPolicy>(ldb::NewBloomFilterPolicy(10)),
-      std::unique_ptr<ldb::Cache>(ldb::NewLRUCache(8 * 1024 * 1024)),
-      std::move(options));
-}
-
 bool buffer_empty(ldb::WriteBatch &batch) {
   static size_t empty_size = []() {
     ldb::WriteBatch empty_batch{};
@@ -163,10 +54,63 @@ bool buffer_empty(ldb::WriteBatch &batch) {
 
 constexpr size_t one_meg = 1000 * 1000;
 
+// Picks the size of write batches so that each DB::Write takes about
+// target_latency at the throughput measured so far. Batches shrink when
+// writes stall on L0 or memtable flushes and grow back once they stop.
+// Shared by every writer of a DB.
+class batch_sizer {
+ public:
+  UTILS_NOT_COPYABLE(batch_sizer)
+  UTILS_NOT_MOVEABLE(batch_sizer)
+  batch_sizer(const size_t initial, const size_t min, const size_t max,
+              const std::chrono::milliseconds target_latency)
+      : min(min),
+        max(max),
+        target_latency(target_latency),
+        current(std::clamp(initial, min, max)) {}
+
+  size_t batch_size() const { return current.load(std::memory_order_relaxed); }
+
+  void record(const size_t bytes, const std::chrono::nanoseconds latency) {
+    std::unique_lock lock(mutex);
+    const auto seconds = std::max(
+        std::chrono::duration<double>(latency).count(), 1e-6);
+    // Moving average so a single slow write doesn't collapse the batches
+    bytes_per_second = bytes_per_second == 0
+                           ? bytes / seconds
+                           : 0.75 * bytes_per_second + 0.25 * bytes / seconds;
+    const auto target =
+        bytes_per_second *
+        std::chrono::duration<double>(target_latency).count();
+    current.store(std::clamp(static_cast<size_t>(target), min, max),
+                  std::memory_order_relaxed);
+  }
+
+  // Times a write of batch
+  ldb::Status write(ldb::DB &db, const ldb::WriteOptions &wopts,
+                    ldb::WriteBatch &batch) {
+    const auto bytes = batch.ApproximateSize();
+    const auto start = std::chrono::steady_clock::now();
+    auto status = db.Write(wopts, &batch);
+    record(bytes, std::chrono::steady_clock::now() - start);
+    return status;
+  }
+
+ private:
+  const size_t min;
+  const size_t max;
+  const std::chrono::milliseconds target_latency;
+  std::atomic<size_t> current;
+  std::mutex mutex;
+  double bytes_per_second = 0;
+};
+
 struct db_buffered_write {
   ldb::DB &db;
   ldb::WriteOptions wopts;
   size_t max_size = one_meg;
+  // Replaces max_size after every write if set
+  batch_sizer *sizer = nullptr;
   ldb::Status last_status{};
   ldb::WriteBatch buffer{};
 
@@ -195,25 +139,343 @@ struct db_buffered_write {
 
   void flush() {
     assert(last_status.ok());
-    last_status = db.Write(wopts, &buffer);
+    if (sizer) {
+      last_status = sizer->write(db, wopts, buffer);
+      max_size = sizer->batch_size();
+    } else {
+      last_status = db.Write(wopts, &buffer);
+    }
     buffer.Clear();
   }
 
+  // Drops whatever wasn't written yet
+  void abandon() { buffer.Clear(); }
+
   ~db_buffered_write() { assert(buffer_empty(buffer)); }
 };
 
-leveldb::Status clone_db(ldb::DB &input, ldb::DB &output,
-                         const ldb::WriteOptions &wopts,
-                         const ldb::ReadOptions &ropts) {
-  db_buffered_write buffer{output, wopts, 10 * one_meg};
+// Same as db_buffered_write but filled batches are written by another thread
+// while the next one is filled. Batches are handed over by pointer, the ones
+// already written are cleared and reused so their capacity isn't grown again.
+class db_queued_write {
+ public:
+  UTILS_NOT_COPYABLE(db_queued_write)
+  UTILS_NOT_MOVEABLE(db_queued_write)
+  // sizer, if set, picks the size of the batches instead of max_size
+  db_queued_write(ldb::DB &db, const ldb::WriteOptions &wopts,
+                  const size_t max_size, const size_t depth,
+                  batch_sizer *sizer = nullptr)
+      : db(db),
+        wopts(wopts),
+        max_size(max_size),
+        sizer(sizer),
+        queue(depth),
+        writer([this]() { write(); }) {}
+
+  ldb::Status last_status{};
+
+  [[nodiscard]] bool Put(const ldb::Slice &key, const ldb::Slice &value) {
+    buffer->Put(key, value);
+    return maybe_push();
+  }
+
+  [[nodiscard]] bool Delete(const ldb::Slice &key) {
+    buffer->Delete(key);
+    return maybe_push();
+  }
+
+  ldb::Status finish() {
+    if (!buffer_empty(*buffer)) {
+      push();
+    }
+    stop();
+    return last_status.ok() ? get_error() : last_status;
+  }
+
+  void abandon() {
+    buffer->Clear();
+    stop();
+  }
+
+  ~db_queued_write() {
+    assert(buffer_empty(*buffer));
+    stop();
+  }
+
+ private:
+  bool maybe_push() {
+    if (buffer->ApproximateSize() <
+        (sizer ? sizer->batch_size() : max_size)) {
+      return true;
+    }
+    return push();
+  }
+
+  bool push() {
+    if (!queue.push(std::exchange(buffer, next_buffer()))) {
+      last_status = ldb::Status::IOError("DB writer stopped");
+    } else {
+      last_status = get_error();
+    }
+    return last_status.ok();
+  }
+
+  // A written batch if there is one, a new one otherwise
+  std::unique_ptr<ldb::WriteBatch> next_buffer() {
+    std::unique_lock lock(mutex);
+    if (spare.empty()) {
+      return std::make_unique<ldb::WriteBatch>();
+    }
+    auto batch = std::move(spare.back());
+    spare.pop_back();
+    return batch;
+  }
+
+  ldb::Status get_error() {
+    std::unique_lock lock(mutex);
+    return error;
+  }
+
+  void stop() {
+    queue.close();
+    if (writer.joinable()) {
+      writer.join();
+    }
+  }
+
+  void write() {
+    while (auto batch = queue.pop()) {
+      if (!get_error().ok()) {
+        continue;
+      }
+      auto status = sizer ? sizer->write(db, wopts, **batch)
+                          : db.Write(wopts, batch->get());
+      (*batch)->Clear();
+      std::unique_lock lock(mutex);
+      error = status;
+      spare.push_back(std::move(*batch));
+    }
+  }
+
+  ldb::DB &db;
+  const ldb::WriteOptions wopts;
+  const size_t max_size;
+  batch_sizer *const sizer;
+  std::unique_ptr<ldb::WriteBatch> buffer =
+      std::make_unique<ldb::WriteBatch>();
+  std::mutex mutex;
+  ldb::Status error{};
+  // Written batches, guarded by mutex
+  std::vector<std::unique_ptr<ldb::WriteBatch>> spare{};
+  bounded_queue<std::unique_ptr<ldb::WriteBatch>> queue;
+  std::thread writer;
+};
+
+// Reads the keys in range on another thread, handing them to sink in
+// chunks. Reading and decompressing blocks overlaps with encoding them.
+template <typename Sink>
+leveldb::Status queued_clone_range(ldb::DB &input, Sink &sink,
+                                   const ldb::ReadOptions &ropts,
+                                   const key_range &range,
+                                   const std::atomic<bool> &cancelled,
+                                   const size_t depth,
+                                   const key_filter *filter) {
+  bounded_queue<kv_chunk> chunks(depth);
+  ldb::Status read_status{};
+  std::thread reader([&]() {
+    auto input_iter =
+        std::unique_ptr<ldb::Iterator>(input.NewIterator(ropts));
+    range_progress read_progress(input, range);
+    filtered_scan scan(*input_iter, range, filter);
+    kv_chunk chunk{};
+    for (scan.seek_to_first(); scan.valid(); scan.next()) {
+      read_progress.read(scan.key(), scan.value());
+      chunk.add(scan.key(), scan.value());
+      if (chunk.bytes() >= one_meg) {
+        if (!chunks.push(std::move(chunk))) {
+          break;
+        }
+        chunk = {};
+      }
+      if (cancelled.load(std::memory_order_relaxed)) {
+        break;
+      }
+    }
+    if (!chunk.empty()) {
+      (void)chunks.push(std::move(chunk));
+    }
+    read_progress.finish();
+    read_status = input_iter->status();
+    chunks.close();
+  });
+
+  bool written = true;
+  while (auto chunk = chunks.pop()) {
+    written = chunk->for_each([&](const auto &key, const auto &value) {
+      return sink.Put(key, value);
+    });
+    if (!written) {
+      break;
+    }
+    progress.bytes_written.fetch_add(chunk->bytes(),
+                                     std::memory_order_relaxed);
+  }
+  chunks.close();
+  reader.join();
+  if (!written) {
+    return sink.last_status;
+  }
+  if (!read_status.ok()) {
+    sink.abandon();
+    return read_status;
+  }
+  return sink.finish();
+}
 
+// Copies the keys in range that match filter to a sink, which is anything
+// with Put, abandon, finish and last_status like db_buffered_write or
+// bulk_table_sink. A null filter copies every key.
+template <typename Sink>
+leveldb::Status clone_range(ldb::DB &input, Sink &sink,
+                            const ldb::ReadOptions &ropts,
+                            const key_range &range,
+                            const std::atomic<bool> &cancelled,
+                            const size_t read_queue,
+                            const key_filter *filter) {
+  if (read_queue > 0) {
+    return queued_clone_range(input, sink, ropts, range, cancelled,
+                              read_queue, filter);
+  }
   auto input_iter = std::unique_ptr<ldb::Iterator>(input.NewIterator(ropts));
-  for (input_iter->SeekToFirst(); input_iter->Valid(); input_iter->Next()) {
-    if (!buffer.Put(input_iter->key(), input_iter->value())) {
-      return buffer.last_status;
+  range_progress copy_progress(input, range);
+  filtered_scan scan(*input_iter, range, filter);
+  for (scan.seek_to_first(); scan.valid(); scan.next()) {
+    copy_progress.read(scan.key(), scan.value());
+    if (!sink.Put(scan.key(), scan.value())) {
+      return sink.last_status;
+    }
+    copy_progress.wrote(scan.key().size() + scan.value().size());
+    if (cancelled.load(std::memory_order_relaxed)) {
+      break;
+    }
+  }
+  copy_progress.finish();
+  if (!input_iter->status().ok()) {
+    sink.abandon();
+    return input_iter->status();
+  }
+  return sink.finish();
+}
+
+// Copies every key from input that matches filter to the sinks made by
+// make_sink, with jobs > 1 the key space is split in ranges that are copied
+// concurrently, each one to its own sink. Everything is read from the same
+// snapshot.
+template <typename MakeSink>
+leveldb::Status clone_db(ldb::DB &input, MakeSink &&make_sink,
+                         const ldb::ReadOptions &ropts, const size_t jobs,
+                         const size_t read_queue,
+                         const key_filter *filter = nullptr) {
+  // A few ranges per thread so that a slow range doesn't leave others idle
+  const auto ranges = split_key_space(input, jobs > 1 ? jobs * 4 : 1);
+  std::vector<ldb::Status> statuses(ranges.size());
+  std::atomic<bool> cancelled{false};
+
+  pooled_decompress_allocator decompress_pool(bedrock_block_size);
+  auto snapshot_ropts = ropts;
+  snapshot_ropts.snapshot = input.GetSnapshot();
+  snapshot_ropts.decompress_allocator = &decompress_pool;
+  run_parallel(jobs, ranges.size(), [&](size_t i) {
+    if (cancelled) {
+      return;
+    }
+    auto sink = make_sink();
+    statuses[i] = clone_range(input, sink, snapshot_ropts, ranges[i],
+                              cancelled, read_queue, filter);
+    if (!statuses[i].ok()) {
+      cancelled = true;
     }
+  });
+  input.ReleaseSnapshot(snapshot_ropts.snapshot);
+
+  for (const auto &status : statuses) {
+    if (!status.ok()) {
+      return status;
+    }
+  }
+  return ldb::Status::OK();
+}
+
+// Memtable of a DB that is only being written by a copy, a 4 MB one as
+// Bedrock uses fills up and stalls writes on L0 flushes every few batches
+constexpr size_t ingest_write_buffer_size = 128 << 20;
+
+// Batches of a copy into a DB with ingest_write_buffer_size start at 10 MB
+// and are resized to take about 100 ms each, up to the share of
+// --memory-limit of each of threads filling one
+batch_sizer make_ingest_batch_sizer(const size_t threads) {
+  const auto max = memory.write_batch(256 * one_meg, threads);
+  return batch_sizer(10 * one_meg, std::min(one_meg, max), max,
+                     std::chrono::milliseconds(100));
+}
+
+leveldb::Status clone_db(ldb::DB &input, ldb::DB &output,
+                         const ldb::WriteOptions &wopts,
+                         const ldb::ReadOptions &ropts, const size_t jobs = 1,
+                         const pipeline_options &popts = {0, 0},
+                         batch_sizer *sizer = nullptr,
+                         const key_filter *filter = nullptr) {
+  // Every job fills one and has up to write_queue more waiting
+  const auto batch_bytes =
+      memory.write_batch(10 * one_meg, jobs * (popts.write_queue + 1));
+  if (popts.write_queue > 0) {
+    return clone_db(
+        input,
+        [&]() {
+          return db_queued_write(output, wopts, batch_bytes,
+                                 popts.write_queue, sizer);
+        },
+        ropts, jobs, popts.read_queue, filter);
   }
-  return buffer.finish();
+  return clone_db(
+      input,
+      [&]() {
+        return db_buffered_write{output, wopts, batch_bytes, sizer};
+      },
+      ropts, jobs, popts.read_queue, filter);
+}
+
+// How keys get into a DB that is being rebuilt
+enum class clone_engine {
+  // Through DB::Write followed by a full compaction
+  write,
+  // Straight into sorted tables in the last level, see bulk_load
+  bulk,
+};
+
+const std::unordered_map<std::string, clone_engine> clone_engine_names = {
+    {"write", clone_engine::write},
+    {"bulk", clone_engine::bulk},
+};
+
+const std::unordered_map<std::string, deflate_impl> deflate_impl_names = {
+    {"zlib", deflate_impl::zlib},
+    {"libdeflate", deflate_impl::libdeflate},
+};
+
+// Same as leveldb's kTargetFileSize
+constexpr size_t bulk_table_size = 2 * 1024 * 1024;
+
+// Copies every key from input that matches filter straight into sorted
+// tables, see bulk_load
+leveldb::Status bulk_clone_db(ldb::DB &input, bulk_load &load,
+                              const ldb::ReadOptions &ropts,
+                              const size_t jobs = 1,
+                              const size_t read_queue = 0,
+                              const key_filter *filter = nullptr) {
+  return clone_db(
+      input, [&]() { return bulk_table_sink{load}; }, ropts, jobs,
+      read_queue, filter);
 }
 
 leveldb::Status clear_db(ldb::DB &db) {
@@ -221,14 +483,19 @@ leveldb::Status clear_db(ldb::DB &db) {
   ropts.fill_cache = false;
   auto wopts = ldb::WriteOptions();
   {
-    db_buffered_write buffer{db, wopts, 10 * one_meg};
+    db_buffered_write buffer{db, wopts, memory.write_batch(10 * one_meg, 1)};
     auto iter = std::unique_ptr<ldb::Iterator>(db.NewIterator(ropts));
+    const key_range everything{};
+    range_progress clear_progress(db, everything);
 
     for (iter->SeekToFirst(); iter->Valid(); iter->Next()) {
+      clear_progress.read(iter->key(), iter->value());
       if (!buffer.Delete(iter->key())) {
         return buffer.last_status;
       }
+      clear_progress.wrote(iter->key().size());
     }
+    clear_progress.finish();
     return buffer.finish();
   }
 }
@@ -246,42 +513,61 @@ class func_logger : public ldb::Logger {
 
 using cid_t = hackdb::compression_id_t;
 struct block_compression_type_counter {
-  static_assert(std::numeric_limits<cid_t>::min() == 0);
-  static size_t constexpr counts_size = std::numeric_limits<cid_t>::max() + 1;
-  static_assert(counts_size < 10000);
-
-  std::array<std::atomic<size_t>, counts_size> counts{};
-  const hackdb::logger_entry entry;
+  hackdb::block_counter counter;
   auto get_counts() {
     std::map<cid_t, size_t> counts_set{};
-    for (size_t i = 0; i < counts_size; i++) {
-      auto counts_for_i =
-          counts[i].exchange(0, std::memory_order::memory_order_relaxed);
-      if (counts_for_i > 0) {
-        counts_set[i] = counts_for_i;
+    const auto counts = counter.take_counts();
+    for (size_t i = 0; i < counts.size(); i++) {
+      if (counts[i] > 0) {
+        counts_set[i] = counts[i];
       }
     }
     return counts_set;
   }
 
-  block_compression_type_counter(const ldb::Logger *logger)
-      : counts(), entry(logger, [this](cid_t compression_id) {
-          counts[compression_id].fetch_add(
-              1, std::memory_order::memory_order_relaxed);
-        }) {
+  block_compression_type_counter(const ldb::Logger *logger) : counter(logger) {
     assert(logger != nullptr);
   }
 };
 
-auto sweep_db(ldb::DB &db, const ldb::ReadOptions &ropts) {
-  auto iter = std::unique_ptr<ldb::Iterator>(db.NewIterator(ropts));
-  iter->SeekToFirst();
-  while (iter->Valid()) {
-    iter->Next();
+// Reads every pair in range, passing them to visit. The iterator is
+// returned so its status can be checked.
+template <typename Visit>
+auto sweep_range(ldb::DB &db, const ldb::ReadOptions &ropts,
+                 const key_range &range, Visit &&visit) {
+  pooled_decompress_allocator decompress_pool(bedrock_block_size);
+  auto pooled_ropts = ropts;
+  pooled_ropts.decompress_allocator = &decompress_pool;
+  auto iter = std::unique_ptr<ldb::Iterator>(db.NewIterator(pooled_ropts));
+  range_progress sweep_progress(db, range);
+  for (iter->Seek(range.begin);
+       iter->Valid() && range.before_end(iter->key()); iter->Next()) {
+    sweep_progress.read(iter->key(), iter->value());
+    visit(iter->key(), iter->value());
   }
+  sweep_progress.finish();
   return iter;
 }
 
+// Reads every pair of db, with jobs > 1 the key space is split in ranges
+// that are read concurrently. Returns the first error of their iterators.
+[[nodiscard]] ldb::Status sweep_db(ldb::DB &db, const ldb::ReadOptions &ropts,
+                                   const size_t jobs = 1) {
+  const auto ranges = split_key_space(db, jobs);
+  std::vector<ldb::Status> statuses(ranges.size());
+  run_parallel(jobs, ranges.size(), [&](const size_t i) {
+    statuses[i] = sweep_range(db, ropts, ranges[i],
+                              [](const auto &, const auto &) {})
+                      ->status();
+  });
+  for (auto &status : statuses) {
+    if (!status.ok()) {
+      return status;
+    }
+  }
+  return ldb::Status::OK();
+}
+
 template <typename DbContainer>
 std::optional<std::map<cid_t, size_t>> find_compression_algo(
     std::function<DbContainer()> &&open_db, const ldb::Logger *logger) {
@@ -297,19 +583,401 @@ std::optional<std::map<cid_t, size_t>> find_compression_algo(
     auto ropts = ldb::ReadOptions();
     ropts.fill_cache = false;
     ropts.verify_checksums = false;
-    sweep_db(db, ropts);
+    const auto status = sweep_db(db, ropts);
+    if (!status.ok()) {
+      std::cerr << "Failed to read DB: " << status.ToString() << std::endl;
+      return {};
+    }
   }
   return {counter.get_counts()};
 }
 
+// Engines that write the tables of the output DB share the same handling of
+// an existing output, it's replaced instead of written into
+[[nodiscard]] bool prepare_output_dir(const fs::path &output_dir,
+                                      const db_opts &output_opts,
+                                      const bool overwrite) {
+  ldb::Env *env = output_opts->env;
+  if (env->FileExists(ldb::CurrentFileName(output_dir))) {
+    if (!overwrite) {
+      std::cerr << "Output DB already exists" << std::endl;
+      return false;
+    }
+    auto status = ldb::DestroyDB(output_dir, *output_opts);
+    if (!status.ok()) {
+      std::cerr << "Failed to remove output DB: " << status.ToString()
+                << std::endl;
+      return false;
+    }
+  }
+  // Fails when it's already there, which is fine as long as it's a directory
+  auto status = env->CreateDir(output_dir);
+  std::error_code ec;
+  if (!status.ok() && !fs::is_directory(output_dir, ec)) {
+    std::cerr << "Failed to create " << output_dir << ": "
+              << status.ToString() << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// Opens the DB once to check that it's usable after writing its files,
+// leveldb adds the log file that a DB made by DB::Open would have
+[[nodiscard]] bool reopen_output_db(const fs::path &output_dir,
+                                    db_opts &&output_opts) {
+  output_opts.modify([](auto &opts) {
+    opts.create_if_missing = false;
+    opts.error_if_exists = false;
+  });
+  auto [maybe_output_db, output_status] =
+      open_db(std::move(output_opts), output_dir);
+  if (!maybe_output_db) {
+    std::cerr << "Failed to open output DB: " << output_status.ToString()
+              << std::endl;
+    return false;
+  }
+  return true;
+}
+
+auto make_output_compressors(const output_compression &compression) {
+  return compression.make_compressors(true);
+}
+
+// Writes the input keys into sorted tables of a new output DB
+[[nodiscard]] int bulk_copy(ldb::DB &input_db, const fs::path &output_dir,
+                            db_opts &&output_opts,
+                            const output_compression &compression,
+                            const compression_policy &policy,
+                            const bool overwrite, const size_t jobs,
+                            const pipeline_options &popts,
+                            const ldb::ReadOptions &ropts,
+                            const key_filter *filter,
+                            progress_reporter &reporter) {
+  ldb::Env *env = output_opts->env;
+  if (!prepare_output_dir(output_dir, output_opts, overwrite)) {
+    return 1;
+  }
+  {
+    db_lock output_lock(env, output_dir);
+    if (!output_lock.status.ok()) {
+      std::cerr << "Failed to lock output DB: "
+                << output_lock.status.ToString() << std::endl;
+      return 1;
+    }
+    bulk_load load(
+        output_dir, *output_opts,
+        [&compression]() { return make_output_compressors(compression); },
+        bulk_table_size, popts.write_queue,
+        [&]() { return policy.make_block_policy(compression); });
+    reporter.begin_phase("copy", approximate_size(input_db));
+    auto status = bulk_clone_db(input_db, load, ropts, jobs, popts.read_queue,
+                                filter);
+    if (!status.ok()) {
+      std::cerr << "Failed to clone DB: " << status.ToString() << std::endl;
+      return 1;
+    }
+    reporter.begin_phase("manifest");
+    auto manifest = load.make_manifest();
+    status = write_manifest(env, output_dir, manifest);
+    if (!status.ok()) {
+      std::cerr << "Failed to write output MANIFEST: " << status.ToString()
+                << std::endl;
+      return 1;
+    }
+  }
+  return reopen_output_db(output_dir, std::move(output_opts)) ? 0 : 1;
+}
+
+// Rebuilds every table of the input DB in the output DB with the output
+// compressors, keeping file numbers and levels. Nothing goes through the
+// write path, so there's no need to compact the output afterwards.
+[[nodiscard]] int transcode_copy(const fs::path &input_dir,
+                                 db_opts &&input_opts,
+                                 const fs::path &output_dir,
+                                 db_opts &&output_opts,
+                                 const output_compression &compression,
+                                 const compression_policy &policy,
+                                 const bool overwrite, const size_t jobs,
+                                 const size_t write_queue,
+                                 progress_reporter &reporter) {
+  ldb::Env *env = input_opts->env;
+  {
+    // Opening the DB moves whatever is in its logs to tables, once it's closed
+    // every key is in a table listed in the MANIFEST
+    ldb::DB *db;
+    auto status = ldb::DB::Open(*input_opts, input_dir, &db);
+    if (!status.ok()) {
+      std::cerr << "Failed to open input DB: " << status.ToString()
+                << std::endl;
+      return 1;
+    }
+    delete db;
+  }
+
+  if (!prepare_output_dir(output_dir, output_opts, overwrite)) {
+    return 1;
+  }
+
+  {
+    db_lock input_lock(env, input_dir);
+    db_lock output_lock(env, output_dir);
+    for (const auto *lock : {&input_lock, &output_lock}) {
+      if (!lock->status.ok()) {
+        std::cerr << "Failed to lock DB: " << lock->status.ToString()
+                  << std::endl;
+        return 1;
+      }
+    }
+
+    db_manifest manifest;
+    auto status = read_manifest(env, input_dir, manifest);
+    if (!status.ok()) {
+      std::cerr << "Failed to read input MANIFEST: " << status.ToString()
+                << std::endl;
+      return 1;
+    }
+
+    std::vector<table_file *> files;
+    uint64_t tables_size = 0;
+    for (auto &[_, file] : manifest.files) {
+      files.push_back(&file);
+      tables_size += file.size;
+    }
+    std::cout << "Transcoding " << files.size() << " tables..." << std::endl;
+    reporter.begin_phase("transcode", tables_size);
+
+    auto ropts = ldb::ReadOptions();
+    ropts.fill_cache = false;
+    ropts.verify_checksums = true;
+    const table_options input_table_opts(*input_opts);
+    std::vector<ldb::Status> statuses(files.size());
+    std::atomic<bool> cancelled{false};
+    run_parallel(jobs, files.size(), [&](size_t i) {
+      if (cancelled) {
+        return;
+      }
+      const table_options output_table_opts(
+          *output_opts, make_output_compressors(compression),
+          policy.make_block_policy(compression));
+      table_file transcoded;
+      statuses[i] = transcode_table(input_table_opts, input_dir,
+                                    output_table_opts, output_dir, ropts,
+                                    *files[i], files[i]->number, transcoded,
+                                    write_queue);
+      files[i]->size = transcoded.size;
+      progress.covered.fetch_add(files[i]->size, std::memory_order_relaxed);
+      if (!statuses[i].ok()) {
+        cancelled = true;
+      }
+    });
+    for (const auto &table_status : statuses) {
+      if (!table_status.ok()) {
+        std::cerr << "Failed to transcode table: " << table_status.ToString()
+                  << std::endl;
+        return 1;
+      }
+    }
+
+    // The output has no logs to recover from
+    manifest.log_number = 0;
+    manifest.prev_log_number = 0;
+    status = write_manifest(env, output_dir, manifest);
+    if (!status.ok()) {
+      std::cerr << "Failed to write output MANIFEST: " << status.ToString()
+                << std::endl;
+      return 1;
+    }
+  }
+
+  return reopen_output_db(output_dir, std::move(output_opts)) ? 0 : 1;
+}
+
+// Number of key ranges the input is split in the first time it's copied with
+// --incremental, later copies reuse the same ranges
+constexpr size_t incremental_ranges = 256;
+
+// Opening the DB moves whatever is in its logs to tables, so afterwards the
+// tables in the MANIFEST have every key
+ldb::Status read_flushed_manifest(const db_opts &opts, const fs::path &dir,
+                                  db_manifest &manifest) {
+  ldb::DB *db;
+  auto status = ldb::DB::Open(*opts, dir, &db);
+  if (!status.ok()) {
+    return status;
+  }
+  delete db;
+  db_lock lock(opts->env, dir);
+  if (!lock.status.ok()) {
+    return lock.status;
+  }
+  return read_manifest(opts->env, dir, manifest);
+}
+
+// Brings the output of an earlier copy up to date. Ranges covered by the same
+// input tables as in the previous run are skipped, the rest are hashed and
+// only diffed against the output when their contents changed.
+[[nodiscard]] int incremental_copy(const fs::path &input_dir,
+                                   db_opts &&input_opts,
+                                   const fs::path &output_dir,
+                                   db_opts &&output_opts, const size_t jobs,
+                                   progress_reporter &reporter) {
+  ldb::Env *env = input_opts->env;
+  db_manifest manifest;
+  {
+    // The tables in the MANIFEST tell what changed
+    auto status = read_flushed_manifest(input_opts, input_dir, manifest);
+    if (!status.ok()) {
+      std::cerr << "Failed to read input MANIFEST: " << status.ToString()
+                << std::endl;
+      return 1;
+    }
+  }
+
+  auto [input_db, input_status] = open_db(std::move(input_opts), input_dir);
+  if (!input_db) {
+    std::cerr << "Failed to open input DB: " << input_status.ToString()
+              << std::endl;
+    return 1;
+  }
+  output_opts.modify([](auto &opts) {
+    opts.create_if_missing = true;
+    opts.error_if_exists = false;
+  });
+  auto [output_db, output_status] = open_db(std::move(output_opts), output_dir);
+  if (!output_db) {
+    std::cerr << "Failed to open output DB: " << output_status.ToString()
+              << std::endl;
+    return 1;
+  }
+
+  incremental_state state;
+  bool found;
+  auto status = read_incremental_state(env, output_dir, state, found);
+  if (!status.ok()) {
+    std::cerr << "Failed to read incremental state: " << status.ToString()
+              << std::endl;
+    return 1;
+  }
+  if (!found) {
+    std::cout << "No incremental state in output, comparing every key..."
+              << std::endl;
+    for (auto &range : split_key_space(*input_db, incremental_ranges)) {
+      state.ranges.push_back({std::move(range), {}, 0});
+    }
+  } else {
+    // Until this run finishes the output doesn't match any state, if it's
+    // interrupted the next one compares every key
+    status = env->DeleteFile(output_dir / incremental_detail::state_file_name);
+    if (!status.ok()) {
+      std::cerr << "Failed to remove incremental state: " << status.ToString()
+                << std::endl;
+      return 1;
+    }
+  }
+
+  auto ropts = ldb::ReadOptions();
+  ropts.fill_cache = false;
+  ropts.verify_checksums = true;
+  ropts.snapshot = input_db->GetSnapshot();
+  auto output_ropts = ldb::ReadOptions();
+  output_ropts.fill_cache = false;
+  auto wopts = ldb::WriteOptions();
+  wopts.sync = false;
+
+  std::vector<ldb::Status> statuses(state.ranges.size());
+  std::atomic<size_t> skipped{0}, same_contents{0}, updated{0};
+  const auto update_range = [&](const size_t i) {
+    auto &range = state.ranges[i];
+    auto tables = overlapping_tables(manifest, range.range);
+    if (found && tables == range.tables) {
+      skipped++;
+      return;
+    }
+    uint64_t hash;
+    if (found) {
+      statuses[i] = hash_range(*input_db, ropts, range.range, hash);
+      if (!statuses[i].ok()) {
+        return;
+      }
+      if (hash == range.hash) {
+        range.tables = std::move(tables);
+        same_contents++;
+        return;
+      }
+    }
+    db_buffered_write sink{*output_db, wopts,
+                           memory.write_batch(10 * one_meg, jobs)};
+    statuses[i] = diff_range(*input_db, ropts, *output_db, output_ropts, sink,
+                             range.range, hash);
+    if (statuses[i].ok()) {
+      range.tables = std::move(tables);
+      range.hash = hash;
+      updated++;
+    }
+  };
+  reporter.begin_phase("update", approximate_size(*input_db));
+  run_parallel(jobs, state.ranges.size(), [&](size_t i) {
+    update_range(i);
+    progress.covered.fetch_add(
+        approximate_size(*input_db, state.ranges[i].range),
+        std::memory_order_relaxed);
+  });
+  input_db->ReleaseSnapshot(ropts.snapshot);
+  for (const auto &range_status : statuses) {
+    if (!range_status.ok()) {
+      std::cerr << "Failed to update output: " << range_status.ToString()
+                << std::endl;
+      return 1;
+    }
+  }
+  std::cout << skipped << " ranges with unchanged tables, " << same_contents
+            << " with rewritten tables and the same contents, " << updated
+            << " compared and updated" << std::endl;
+
+  // The diffs were written without syncing, the state can only say the
+  // ranges are current once they are on disk. Syncing the log with an empty
+  // batch also syncs every write before it.
+  auto sync_wopts = ldb::WriteOptions();
+  sync_wopts.sync = true;
+  ldb::WriteBatch empty_batch;
+  status = output_db->Write(sync_wopts, &empty_batch);
+  if (!status.ok()) {
+    std::cerr << "Failed to sync output: " << status.ToString() << std::endl;
+    return 1;
+  }
+  status = write_incremental_state(env, output_dir, state);
+  if (!status.ok()) {
+    std::cerr << "Failed to write incremental state: " << status.ToString()
+              << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
 [[nodiscard]] int compress_decompress(const fs::path &input_dir,
                                       const fs::path &output_dir,
-                                      const bool compress,
-                                      const bool overwrite) {
+                                      const output_compression &compression,
+                                      const compression_policy &policy,
+                                      const bool overwrite,
+                                      const clone_engine engine,
+                                      const size_t jobs,
+                                      const pipeline_options &queues,
+                                      const bool transcode_tables,
+                                      const bool incremental,
+                                      const key_filter &filter) {
+  // Write queues hold batches with the write engine and table buffers
+  // otherwise, each job has its own queues
+  const bool writes_batches =
+      engine == clone_engine::write && !transcode_tables;
+  const pipeline_options popts{
+      memory.queue_depth(queues.read_queue, one_meg, jobs),
+      memory.queue_depth(queues.write_queue,
+                         writes_batches ? 10 * one_meg : bulk_table_size,
+                         jobs)};
   std::cout << "Input database is at: " << input_dir << std::endl;
   std::cout << "Output database is at: " << output_dir << std::endl;
 
-  auto input_opts = bedrock_default_db_options(make_compressors(false));
+  auto input_opts = bedrock_input_db_options(make_compressors(false));
   auto input_logger = func_logger([](auto format, auto args) {
     printf("leveldb intput info: ");
     vprintf(format, args);
@@ -321,9 +989,8 @@ std::optional<std::map<cid_t, size_t>> find_compression_algo(
     opts.error_if_exists = false;
   });
 
-  auto output_opts = compress
-                         ? bedrock_default_db_options(make_compressors(true))
-                         : bedrock_default_db_options({});
+  auto output_opts =
+      bedrock_default_db_options(make_output_compressors(compression));
   auto output_logger = func_logger([](auto format, auto args) {
     printf("leveldb output info: ");
     vprintf(format, args);
@@ -334,6 +1001,32 @@ std::optional<std::map<cid_t, size_t>> find_compression_algo(
     opts.create_if_missing = !overwrite;
     opts.error_if_exists = !overwrite;
   });
+  hackdb::block_counter input_blocks(&input_logger);
+  progress_reporter reporter("copy", &input_blocks);
+
+  // Both of these go over whole tables
+  if (!filter.matches_everything() && (incremental || transcode_tables)) {
+    std::cerr << "Key filters can't be used with incremental or transcoded "
+                 "copies"
+              << std::endl;
+    return 1;
+  }
+  // Only the engines that build tables decide how each block is compressed
+  if (!policy.empty() &&
+      (incremental || (engine == clone_engine::write && !transcode_tables))) {
+    std::cerr << "--compress-for requires --engine=bulk or --transcode-tables"
+              << std::endl;
+    return 1;
+  }
+  if (incremental) {
+    return incremental_copy(input_dir, std::move(input_opts), output_dir,
+                            std::move(output_opts), jobs, reporter);
+  }
+  if (transcode_tables) {
+    return transcode_copy(input_dir, std::move(input_opts), output_dir,
+                          std::move(output_opts), compression, policy,
+                          overwrite, jobs, popts.write_queue, reporter);
+  }
 
   auto [maybe_input_db, input_status] =
       open_db(std::move(input_opts), input_dir);
@@ -344,6 +1037,20 @@ std::optional<std::map<cid_t, size_t>> find_compression_algo(
   }
   auto &input_db = maybe_input_db;
 
+  auto ropts = ldb::ReadOptions();
+  ropts.fill_cache = false;
+  ropts.verify_checksums = true;
+  if (engine == clone_engine::bulk) {
+    return bulk_copy(*input_db, output_dir, std::move(output_opts),
+                     compression, policy, overwrite, jobs, popts, ropts,
+                     &filter, reporter);
+  }
+
+  // Nothing reads the output until the copy is done, so it's written with a
+  // memtable big enough to keep L0 from stalling writes and reopened with
+  // Bedrock's options at the end
+  output_opts.modify(
+      [](auto &opts) { opts.write_buffer_size = ingest_write_buffer_size; });
   auto [maybe_output_db, output_status] =
       open_db(std::move(output_opts), output_dir);
   if (!maybe_output_db) {
@@ -355,19 +1062,36 @@ std::optional<std::map<cid_t, size_t>> find_compression_algo(
 
   auto wopts = ldb::WriteOptions();
   wopts.sync = false;
-  auto ropts = ldb::ReadOptions();
-  ropts.fill_cache = false;
-  ropts.verify_checksums = true;
-  auto clone_status = clone_db(*input_db, *output_db, wopts, ropts);
+  auto sizer = make_ingest_batch_sizer(jobs * (popts.write_queue + 1));
+  reporter.begin_phase("copy", approximate_size(*input_db));
+  auto clone_status =
+      clone_db(*input_db, *output_db, wopts, ropts, jobs, popts, &sizer,
+               &filter);
   if (!clone_status.ok()) {
     std::cerr << "Failed to clone DB: " << clone_status.ToString() << std::endl;
     return 1;
   }
+  reporter.begin_phase("compaction");
   output_db->CompactRange(nullptr, nullptr);
-  return 0;
+  output_db.reset();
+  reporter.begin_phase("reopen");
+  return reopen_output_db(
+             output_dir,
+             bedrock_default_db_options(make_output_compressors(compression)))
+             ? 0
+             : 1;
 }
 
-int cmd_find_compression_algos(const fs::path &db_path) {
+void print_compressor_counts(const std::map<cid_t, size_t> &counts) {
+  for (auto &[compressor_id, occurrences] : counts) {
+    std::cout << "Read blocks with compressor "
+              << compressor_name(compressor_id)
+              << " (id=" << (int)compressor_id << ")"
+              << " " << occurrences << " times" << std::endl;
+  }
+}
+
+int cmd_find_compression_algos(const fs::path &db_path, const bool read_only) {
   auto logger = func_logger([](auto format, auto args) {
     printf("leveldb info: ");
     vprintf(format, args);
@@ -377,43 +1101,241 @@ int cmd_find_compression_algos(const fs::path &db_path) {
   ldb::Status status{};
 
   auto result = find_compression_algo<db_unique_ptr_t>(
-      [&status, &db_path, &logger]() {
-        auto opts = bedrock_default_db_options(make_compressors(false));
+      [&status, &db_path, &logger, read_only]() {
+        auto opts = bedrock_input_db_options(make_compressors(false));
         opts.modify([&](auto &opts) {
           opts.create_if_missing = false;
           opts.error_if_exists = false;
           opts.info_log = &logger;
         });
 
-        auto [maybe_db, open_status] = open_db(std::move(opts), db_path);
+        auto [maybe_db, open_status] =
+            read_only ? open_db_read_only(std::move(opts), db_path)
+                      : open_db(std::move(opts), db_path);
         status = std::move(open_status);
         static_assert(std::is_move_constructible<decltype(open_status)>::value);
         return std::move(maybe_db);
       },
       &logger);
 
-  assert(result.has_value() == status.ok());
+  assert(status.ok() || !result.has_value());
   if (!status.ok()) {
     std::cerr << "Failed to open DB: " << status.ToString() << std::endl;
     return 1;
   }
+  if (!result) {
+    return 1;
+  }
 
-  for (auto &[compressor_id, occurrences] : *result) {
-    const auto &compressors = get_compressors();
-    const auto it =
-        std::find_if(compressors.begin(), compressors.end(),
-                     [&, id{compressor_id}](const auto &compressor) {
-                       return compressor.compression_id == id;
-                     });
-    std::string compressor_name =
-        (it != compressors.end()) ? it->name : "<unknown>";
-    std::cout << "Read blocks with compressor " << compressor_name
-              << " (id=" << (int)compressor_id << ")"
-              << " " << occurrences << " times" << std::endl;
+  print_compressor_counts(*result);
+  return 0;
+}
+
+// Reads the compressor IDs from the block trailers of the tables listed in
+// the MANIFEST instead of iterating the DB. Keys that are still in the logs
+// aren't part of any block and aren't accounted for.
+int cmd_find_compression_algos_in_tables(const fs::path &db_path,
+                                         const double sample) {
+  auto opts = bedrock_input_db_options(make_compressors(false));
+  ldb::Env *env = opts->env;
+  db_lock lock(env, db_path);
+  if (!lock.status.ok()) {
+    std::cerr << "Failed to lock DB: " << lock.status.ToString() << std::endl;
+    return 1;
+  }
+  db_manifest manifest;
+  auto status = read_manifest(env, db_path, manifest);
+  if (!status.ok()) {
+    std::cerr << "Failed to read MANIFEST: " << status.ToString() << std::endl;
+    return 1;
+  }
+
+  const table_options table_opts(*opts);
+  block_sampler sampler(sample);
+  hackdb::block_counts counts{};
+  for (const auto &[_, file] : manifest.files) {
+    status =
+        count_block_compressors(table_opts, db_path, file, sampler, counts);
+    if (!status.ok()) {
+      std::cerr << "Failed to read table " << file.number << ": "
+                << status.ToString() << std::endl;
+      return 1;
+    }
+  }
+
+  if (sample < 1) {
+    std::cout << "Sampled " << sample * 100 << "% of the data blocks"
+              << std::endl;
+  }
+  std::map<cid_t, size_t> counts_set{};
+  for (size_t i = 0; i < counts.size(); i++) {
+    if (counts[i] > 0) {
+      counts_set[i] = counts[i];
+    }
+  }
+  print_compressor_counts(counts_set);
+  return 0;
+}
+
+// Stored bytes sampled by estimate when no fraction is given
+constexpr uint64_t estimate_sample_bytes = 64 << 20;
+
+// Candidates of estimate without -c: no compression, every
+// compressor at its default level and a fast and a slow zstd level
+std::vector<output_compression> default_estimate_candidates() {
+  std::vector<output_compression> candidates{{}};
+  for (const auto &type : get_compressors()) {
+    if (type.compression_id == 0) {
+      continue;
+    }
+    candidates.push_back({&type, {}});
+    if (type.option_name == "zstd") {
+      candidates.push_back({&type, 1});
+      candidates.push_back({&type, 9});
+    }
+  }
+  return candidates;
+}
+
+// Projects the size of the tables of the DB and the compression speeds with
+// each candidate from sampled data blocks, jobs tables at a time. Speeds are
+// of one thread, keys still in the logs aren't sampled.
+int cmd_estimate(const fs::path &db_path, const std::optional<double> sample,
+                 const std::vector<output_compression> &candidates,
+                 const size_t jobs) {
+  auto opts = bedrock_input_db_options(make_compressors());
+  ldb::Env *env = opts->env;
+  db_lock lock(env, db_path);
+  if (!lock.status.ok()) {
+    std::cerr << "Failed to lock DB: " << lock.status.ToString() << std::endl;
+    return 1;
+  }
+  db_manifest manifest;
+  auto status = read_manifest(env, db_path, manifest);
+  if (!status.ok()) {
+    std::cerr << "Failed to read MANIFEST: " << status.ToString() << std::endl;
+    return 1;
+  }
+
+  std::vector<const table_file *> files;
+  uint64_t tables_size = 0;
+  for (const auto &[_, file] : manifest.files) {
+    files.push_back(&file);
+    tables_size += file.size;
+  }
+  const double fraction =
+      sample ? *sample
+             : std::min(1.0, static_cast<double>(estimate_sample_bytes) /
+                                 std::max<uint64_t>(tables_size, 1));
+  const table_options table_opts(*opts);
+  std::vector<block_estimates> results(files.size());
+  std::vector<ldb::Status> statuses(files.size());
+  run_parallel(jobs, files.size(), [&](const size_t i) {
+    block_sampler sampler(fraction);
+    statuses[i] = estimate_table(table_opts, db_path, *files[i], sampler,
+                                 candidates, results[i]);
+  });
+  block_estimates total{};
+  for (size_t i = 0; i < files.size(); i++) {
+    if (!statuses[i].ok()) {
+      std::cerr << "Failed to sample table " << files[i]->number << ": "
+                << statuses[i].ToString() << std::endl;
+      return 1;
+    }
+    total.merge(results[i]);
+  }
+  if (total.blocks == 0) {
+    std::cout << "No data blocks to sample" << std::endl;
+    return 0;
+  }
+
+  std::cout << std::fixed << std::setprecision(1) << "Sampled "
+            << total.blocks << " data blocks, " << fraction * 100
+            << "% of them, " << total.current_bytes / 1e6 << " MB stored and "
+            << total.raw_bytes / 1e6 << " MB decoded" << std::endl;
+  std::cout << std::left << std::setw(16) << "compression" << std::right
+            << std::setw(16) << "projected MB" << std::setw(12) << "of now"
+            << std::setw(16) << "compress MB/s" << std::setw(18)
+            << "decompress MB/s" << std::endl;
+  std::cout << std::left << std::setw(16) << "current" << std::right
+            << std::setw(16) << tables_size / 1e6 << std::setw(11) << 100.0
+            << "%" << std::endl;
+  const auto rate = [&](const double seconds) {
+    return seconds > 0 ? total.raw_bytes / 1e6 / seconds : 0.0;
+  };
+  for (size_t i = 0; i < candidates.size(); i++) {
+    const auto &estimate = total.candidates[i];
+    const double ratio =
+        static_cast<double>(estimate.stored_bytes) / total.current_bytes;
+    std::cout << std::left << std::setw(16) << candidates[i].spec()
+              << std::right << std::setw(16) << tables_size * ratio / 1e6
+              << std::setw(11) << ratio * 100 << "%";
+    if (candidates[i].enabled()) {
+      std::cout << std::setw(16) << rate(estimate.compress_seconds)
+                << std::setw(18) << rate(estimate.decompress_seconds);
+    }
+    std::cout << std::endl;
   }
   return 0;
 }
 
+// Checks the blocks of every table in the MANIFEST, jobs tables at a time.
+// Keys that are still in the logs aren't part of any table and aren't
+// checked, leveldb checks the records of the logs when it opens the DB.
+int cmd_verify(const fs::path &db_path, const bool decode,
+               const size_t jobs) {
+  auto opts = bedrock_input_db_options(make_compressors());
+  ldb::Env *env = opts->env;
+  db_lock lock(env, db_path);
+  if (!lock.status.ok()) {
+    std::cerr << "Failed to lock DB: " << lock.status.ToString() << std::endl;
+    return 1;
+  }
+  db_manifest manifest;
+  auto status = read_manifest(env, db_path, manifest);
+  if (!status.ok()) {
+    std::cerr << "Failed to read MANIFEST: " << status.ToString() << std::endl;
+    return 1;
+  }
+
+  std::vector<const table_file *> files;
+  uint64_t total_size = 0;
+  for (const auto &[_, file] : manifest.files) {
+    files.push_back(&file);
+    total_size += file.size;
+  }
+  const table_options table_opts(*opts);
+  std::vector<table_verification> results(files.size());
+  {
+    progress_reporter reporter("verify");
+    reporter.begin_phase("verify", total_size);
+    run_parallel(jobs, files.size(), [&](const size_t i) {
+      results[i] = verify_table(table_opts, db_path, *files[i], decode);
+    });
+  }
+
+  uint64_t blocks = 0, corrupt = 0;
+  std::string line;
+  for (size_t i = 0; i < files.size(); i++) {
+    blocks += results[i].blocks;
+    for (const auto &block : results[i].corrupt) {
+      corrupt++;
+      line = "Table " + std::to_string(block.table) + " " + block.kind +
+             " block at " + std::to_string(block.offset) + " (" +
+             std::to_string(block.size) + " bytes): " + block.error +
+             ", keys from ";
+      python_bytes_repr(line, block.first_key);
+      line += " to ";
+      python_bytes_repr(line, block.last_key);
+      std::cout << line << std::endl;
+    }
+  }
+  std::cout << "Verified " << blocks << " blocks of " << files.size()
+            << " tables" << (decode ? ", decoding data blocks" : "") << ", "
+            << corrupt << " corrupt" << std::endl;
+  return corrupt == 0 ? 0 : 1;
+}
+
 struct missing_compressor_counter {
   block_compression_type_counter counter;
   std::set<cid_t> compressor_ids;
@@ -440,20 +1362,126 @@ std::string_view slice_to_view(ldb::Slice slice) {
   return {slice.data(), slice.size()};
 }
 
-int cmd_dump(const fs::path &db_path) {
+// Values sampled from the records with the same tag, values of keys that
+// aren't chunk records are sampled together
+struct tag_samples {
+  std::vector<std::string> values{};
+  uint64_t seen = 0;
+};
+
+// Trains a zstd dictionary on values sampled evenly from every record tag, so
+// that rare record types are as represented as sub chunks
+int cmd_train_dict(const fs::path &db_path, const fs::path &dict_path,
+                   const size_t dict_size, const size_t samples_per_tag) {
+  // Samples bigger than this don't teach the trainer anything new
+  constexpr size_t max_sample_size = 64 * 1024;
+
   auto logger = func_logger([](auto format, auto args) {
     fprintf(stderr, "leveldb info: ");
     vfprintf(stderr, format, args);
     fprintf(stderr, "\n");
   });
-  auto opts = bedrock_default_db_options(make_compressors());
+  auto opts = bedrock_input_db_options(make_compressors());
   opts.modify([&](auto &opts) {
     opts.create_if_missing = false;
     opts.error_if_exists = false;
     opts.info_log = &logger;
   });
-  auto missing = missing_compressor_counter{opts};
   auto [maybe_db, status] = open_db(std::move(opts), db_path);
+  if (!maybe_db) {
+    std::cerr << "Failed to open DB: " << status.ToString() << std::endl;
+    return 1;
+  }
+
+  std::cout << "Sampling values..." << std::endl;
+  std::map<int, tag_samples> groups;
+  std::mt19937_64 rng(0);
+  auto ropts = ldb::ReadOptions();
+  ropts.fill_cache = false;
+  auto iter = std::unique_ptr<ldb::Iterator>(maybe_db->NewIterator(ropts));
+  for (iter->SeekToFirst(); iter->Valid(); iter->Next()) {
+    const auto tag = bedrock_keys::record_tag(slice_to_view(iter->key()));
+    auto &group = groups[tag ? *tag : -1];
+    const auto value = iter->value();
+    const auto sample_size = std::min(value.size(), max_sample_size);
+    // Reservoir sampling, every value of the group is as likely to be kept
+    if (group.values.size() < samples_per_tag) {
+      group.values.emplace_back(value.data(), sample_size);
+    } else {
+      const auto i =
+          std::uniform_int_distribution<uint64_t>(0, group.seen)(rng);
+      if (i < samples_per_tag) {
+        group.values[i].assign(value.data(), sample_size);
+      }
+    }
+    group.seen++;
+  }
+  if (!iter->status().ok()) {
+    std::cerr << "Failed to read DB: " << iter->status().ToString()
+              << std::endl;
+    return 1;
+  }
+  iter.reset();
+  maybe_db.reset();
+
+  std::string samples;
+  std::vector<size_t> sample_sizes;
+  for (const auto &[tag, group] : groups) {
+    if (tag < 0) {
+      std::cout << "Other keys: ";
+    } else {
+      std::cout << "Tag " << tag << ": ";
+    }
+    std::cout << group.values.size() << " of " << group.seen << " values"
+              << std::endl;
+    for (const auto &value : group.values) {
+      samples += value;
+      sample_sizes.push_back(value.size());
+    }
+  }
+
+  std::cout << "Training dictionary..." << std::endl;
+  std::string dictionary(dict_size, '\0');
+  const auto size =
+      ZDICT_trainFromBuffer(dictionary.data(), dictionary.size(),
+                            samples.data(), sample_sizes.data(),
+                            static_cast<unsigned>(sample_sizes.size()));
+  if (ZDICT_isError(size)) {
+    std::cerr << "Failed to train dictionary: " << ZDICT_getErrorName(size)
+              << std::endl;
+    return 1;
+  }
+  dictionary.resize(size);
+  status = ldb::WriteStringToFile(ldb::Env::Default(), dictionary, dict_path);
+  if (!status.ok()) {
+    std::cerr << "Failed to write dictionary: " << status.ToString()
+              << std::endl;
+    return 1;
+  }
+  std::cout << "Wrote " << size << " byte dictionary with id "
+            << ZDICT_getDictID(dictionary.data(), dictionary.size()) << " to "
+            << dict_path << std::endl;
+  return 0;
+}
+
+int cmd_dump(const fs::path &db_path,
+             const std::optional<fs::path> &output_path,
+             const key_filter &filter, const bool read_only) {
+  auto logger = func_logger([](auto format, auto args) {
+    fprintf(stderr, "leveldb info: ");
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
+  });
+  auto opts = bedrock_input_db_options(make_compressors());
+  opts.modify([&](auto &opts) {
+    opts.create_if_missing = false;
+    opts.error_if_exists = false;
+    opts.info_log = &logger;
+  });
+  auto missing = missing_compressor_counter{opts};
+  auto [maybe_db, status] = read_only
+                                ? open_db_read_only(std::move(opts), db_path)
+                                : open_db(std::move(opts), db_path);
   std::cerr << "Opening db..." << std::endl;
   assert(!maybe_db == !status.ok());
   if (!maybe_db) {
@@ -461,38 +1489,481 @@ int cmd_dump(const fs::path &db_path) {
     return 1;
   }
   auto &db = *maybe_db;
+  pooled_decompress_allocator decompress_pool(bedrock_block_size);
   auto ropts = ldb::ReadOptions();
   ropts.fill_cache = false;
   ropts.verify_checksums = true;
-  auto iter = std::unique_ptr<ldb::Iterator>(db.NewIterator(ropts));
-  std::cout << "{" << std::endl;
-  std::string buffer = "";
-  for (iter->SeekToFirst(); iter->Valid(); iter->Next()) {
-    python_bytes_repr(buffer, slice_to_view(iter->key()));
-    buffer += ": ";
-    python_bytes_repr(buffer, slice_to_view(iter->value()));
-    buffer += ",";
-    std::cout << buffer << std::endl;
-    buffer.clear();
-  }
-  std::cout << "}" << std::endl;
-  if (!iter->status().ok()) {
-    std::cerr << "Failed to read DB contents: " << iter->status().ToString()
+  ropts.decompress_allocator = &decompress_pool;
+
+  int fd = STDOUT_FILENO;
+  if (output_path) {
+    fd = open(output_path->c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+              0644);
+    if (fd < 0) {
+      std::cerr << "Failed to open " << *output_path << ": "
+                << std::strerror(errno) << std::endl;
+      return 1;
+    }
+  }
+  int result = 0;
+  {
+    output_writer output(fd);
+    auto iter = std::unique_ptr<ldb::Iterator>(db.NewIterator(ropts));
+    progress_reporter reporter("dump", &missing.counter.counter);
+    reporter.begin_phase("dump", approximate_size(db));
+    const key_range everything{};
+    range_progress dump_progress(db, everything);
+    filtered_scan scan(*iter, everything, &filter);
+    output.append("{\n");
+    std::string buffer = "";
+    for (scan.seek_to_first(); scan.valid() && output.error == 0;
+         scan.next()) {
+      dump_progress.read(scan.key(), scan.value());
+      python_bytes_repr(buffer, slice_to_view(scan.key()));
+      buffer += ": ";
+      python_bytes_repr(buffer, slice_to_view(scan.value()));
+      buffer += ",\n";
+      output.append(buffer);
+      dump_progress.wrote(buffer.size());
+      buffer.clear();
+    }
+    dump_progress.finish();
+    output.append("}\n");
+    if (!output.finish()) {
+      std::cerr << "Failed to write output: " << std::strerror(output.error)
+                << std::endl;
+      result = 1;
+    } else if (!iter->status().ok()) {
+      std::cerr << "Failed to read DB contents: " << iter->status().ToString()
+                << std::endl;
+      result = 1;
+    }
+  }
+  if (output_path && close(fd) != 0 && result == 0) {
+    std::cerr << "Failed to close " << *output_path << ": "
+              << std::strerror(errno) << std::endl;
+    result = 1;
+  }
+  return result;
+}
+
+// Key ranges of about this size in tables are exported by each task
+constexpr uint64_t export_part_bytes = 16 << 20;
+
+// Writes the keys of the DB as an export stream, see export_stream.hpp. Key
+// ranges are read and compressed by jobs threads and written in key order.
+int cmd_export(const fs::path &db_path,
+               const std::optional<fs::path> &output_path, const int level,
+               const size_t jobs) {
+  auto logger = func_logger([](auto format, auto args) {
+    fprintf(stderr, "leveldb info: ");
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
+  });
+  auto opts = bedrock_input_db_options(make_compressors());
+  opts.modify([&](auto &opts) {
+    opts.create_if_missing = false;
+    opts.error_if_exists = false;
+    opts.info_log = &logger;
+  });
+  auto missing = missing_compressor_counter{opts};
+  auto [maybe_db, status] = open_db(std::move(opts), db_path);
+  if (!maybe_db) {
+    std::cerr << "Failed to open DB: " << status.ToString() << std::endl;
+    return 1;
+  }
+  auto &db = *maybe_db;
+  auto ropts = ldb::ReadOptions();
+  ropts.fill_cache = false;
+  ropts.verify_checksums = true;
+  ropts.snapshot = db.GetSnapshot();
+
+  int fd = STDOUT_FILENO;
+  if (output_path) {
+    fd = open(output_path->c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+              0644);
+    if (fd < 0) {
+      std::cerr << "Failed to open " << *output_path << ": "
+                << std::strerror(errno) << std::endl;
+      return 1;
+    }
+  }
+  // Small ranges keep the parts waiting to be written small, the window
+  // lets every job get ahead of the one being written
+  const auto db_size = approximate_size(db);
+  const auto ranges = split_key_space(
+      db, std::clamp<uint64_t>(db_size / export_part_bytes, jobs, 4096));
+  std::vector<ldb::Status> statuses(ranges.size());
+  int result = 0;
+  {
+    output_writer output(fd, 4 << 20);
+    export_writer writer(output, ranges.size(), 2 * jobs);
+    progress_reporter reporter("export", &missing.counter.counter);
+    reporter.begin_phase("export", db_size);
+    run_parallel(jobs, ranges.size(), [&](const size_t i) {
+      if (!writer.wait_turn(i)) {
+        return;
+      }
+      pooled_decompress_allocator decompress_pool(bedrock_block_size);
+      auto pooled_ropts = ropts;
+      pooled_ropts.decompress_allocator = &decompress_pool;
+      auto iter =
+          std::unique_ptr<ldb::Iterator>(db.NewIterator(pooled_ropts));
+      range_progress export_progress(db, ranges[i]);
+      export_part part(level);
+      bool compressed = true;
+      for (iter->Seek(ranges[i].begin); compressed && iter->Valid() &&
+                                        ranges[i].before_end(iter->key());
+           iter->Next()) {
+        export_progress.read(iter->key(), iter->value());
+        compressed = part.add(iter->key(), iter->value());
+      }
+      compressed = compressed && part.finish();
+      statuses[i] = compressed ? iter->status()
+                               : ldb::Status::IOError("zstd", part.error);
+      if (!statuses[i].ok()) {
+        writer.cancel();
+        return;
+      }
+      export_progress.wrote(part.data.size());
+      export_progress.finish();
+      writer.submit(i, std::move(part));
+    });
+    const bool written = writer.finish();
+    for (const auto &range_status : statuses) {
+      if (!range_status.ok()) {
+        std::cerr << "Failed to export DB: " << range_status.ToString()
+                  << std::endl;
+        result = 1;
+        break;
+      }
+    }
+    if (result == 0 && !written) {
+      std::cerr << "Failed to write output: " << std::strerror(output.error)
+                << std::endl;
+      result = 1;
+    }
+    if (result == 0) {
+      std::cerr << "Exported " << writer.records() << " keys" << std::endl;
+    }
+  }
+  if (output_path && close(fd) != 0 && result == 0) {
+    std::cerr << "Failed to close " << *output_path << ": "
+              << std::strerror(errno) << std::endl;
+    result = 1;
+  }
+  return result;
+}
+
+// Bulk loads an export stream into sorted tables of a new DB. A stream in a
+// file is split at frame boundaries in up to jobs spans that are loaded at
+// once, one from a pipe is loaded as it comes.
+int cmd_import(const fs::path &db_path,
+               const std::optional<fs::path> &input_path,
+               const output_compression &compression, const bool overwrite,
+               const size_t jobs) {
+  int fd = STDIN_FILENO;
+  if (input_path) {
+    fd = open(input_path->c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      std::cerr << "Failed to open " << *input_path << ": "
+                << std::strerror(errno) << std::endl;
+      return 1;
+    }
+  }
+  struct fd_closer {
+    const int fd;
+    const bool owned;
+    ~fd_closer() {
+      if (owned) {
+        close(fd);
+      }
+    }
+  } closer{fd, input_path.has_value()};
+
+  struct stat st;
+  const bool seekable = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+  auto status = read_export_header(
+      fd, seekable ? std::optional<uint64_t>(0) : std::nullopt);
+  // [begin, end) of the stream for each span, the first key the index says
+  // it has and the first key of the next span, which its keys must be
+  // smaller than
+  struct span {
+    uint64_t begin;
+    std::optional<uint64_t> end;
+    std::optional<std::string> first;
+    std::optional<std::string> limit;
+  };
+  std::vector<span> spans{{export_detail::header_size, {}, {}, {}}};
+  if (status.ok() && seekable) {
+    std::vector<export_frame> frames;
+    uint64_t index_offset;
+    status = read_export_index(fd, st.st_size, frames, index_offset);
+    spans = {{export_detail::header_size, index_offset, {}, {}}};
+    const auto count = std::min<size_t>(jobs, frames.size());
+    if (status.ok() && count > 1) {
+      spans.clear();
+      const auto target = (index_offset - export_detail::header_size) / count;
+      for (const auto &frame : frames) {
+        if (spans.empty() ||
+            (spans.size() < count &&
+             frame.offset - export_detail::header_size >=
+                 target * spans.size())) {
+          if (!spans.empty()) {
+            if (ldb::Slice(*spans.back().first).compare(frame.first_key) >=
+                0) {
+              status = ldb::Status::Corruption("export index isn't sorted");
+              break;
+            }
+            spans.back().end = frame.offset;
+            spans.back().limit = frame.first_key;
+          }
+          spans.push_back({frame.offset, index_offset, frame.first_key, {}});
+        }
+      }
+    }
+  }
+  if (!status.ok()) {
+    std::cerr << "Failed to read export stream: " << status.ToString()
               << std::endl;
     return 1;
   }
-  return 0;
+
+  auto output_opts =
+      bedrock_default_db_options(make_output_compressors(compression));
+  output_opts.modify([&](auto &opts) {
+    opts.create_if_missing = !overwrite;
+    opts.error_if_exists = !overwrite;
+  });
+  ldb::Env *env = output_opts->env;
+  if (!prepare_output_dir(db_path, output_opts, overwrite)) {
+    return 1;
+  }
+  {
+    db_lock lock(env, db_path);
+    if (!lock.status.ok()) {
+      std::cerr << "Failed to lock DB: " << lock.status.ToString()
+                << std::endl;
+      return 1;
+    }
+    bulk_load load(
+        db_path, *output_opts,
+        [&compression]() { return make_output_compressors(compression); },
+        bulk_table_size);
+    std::vector<ldb::Status> statuses(spans.size());
+    std::atomic<bool> cancelled{false};
+    {
+      progress_reporter reporter("import");
+      reporter.begin_phase("import", seekable ? st.st_size : 0);
+      run_parallel(jobs, spans.size(), [&](const size_t i) {
+        const auto &part = spans[i];
+        bulk_table_sink sink(load);
+        std::string previous;
+        uint64_t records = 0;
+        bool sorted = true;
+        bool matches_index = true;
+        auto status = read_export_records(
+            fd, part.begin, part.end, [&](const auto &key, const auto &value) {
+              if (cancelled) {
+                return false;
+              }
+              // With the first key of each span the one of its index entry
+              // and the rest smaller than the first key of the next span,
+              // the tables of the spans can't overlap
+              if (records++ == 0) {
+                matches_index = !part.first || key.compare(*part.first) == 0;
+              } else {
+                sorted = ldb::Slice(previous).compare(key) < 0;
+              }
+              sorted = sorted && (!part.limit || key.compare(*part.limit) < 0);
+              if (!sorted || !matches_index || !sink.Put(key, value)) {
+                return false;
+              }
+              previous.assign(key.data(), key.size());
+              const auto size = key.size() + value.size();
+              progress.keys.fetch_add(1, std::memory_order_relaxed);
+              progress.bytes_read.fetch_add(size, std::memory_order_relaxed);
+              return true;
+            });
+        if (status.ok() && !sorted) {
+          status = ldb::Status::Corruption("export stream isn't sorted");
+        }
+        if (status.ok() && (!matches_index || (part.first && records == 0))) {
+          status = ldb::Status::Corruption(
+              "export stream doesn't match its index");
+        }
+        if (status.ok()) {
+          status = sink.finish();
+        }
+        if (part.end) {
+          progress.covered.fetch_add(*part.end - part.begin,
+                                     std::memory_order_relaxed);
+        }
+        statuses[i] = status;
+        if (!status.ok()) {
+          sink.abandon();
+          cancelled = true;
+        }
+      });
+    }
+    for (const auto &span_status : statuses) {
+      if (!span_status.ok()) {
+        std::cerr << "Failed to import: " << span_status.ToString()
+                  << std::endl;
+        return 1;
+      }
+    }
+    auto manifest = load.make_manifest();
+    status = write_manifest(env, db_path, manifest);
+    if (!status.ok()) {
+      std::cerr << "Failed to write MANIFEST: " << status.ToString()
+                << std::endl;
+      return 1;
+    }
+  }
+  return reopen_output_db(
+             db_path,
+             bedrock_default_db_options(make_output_compressors(compression)))
+             ? 0
+             : 1;
 }
 
-int cmd_compact(const fs::path &db_path, const bool use_compression) {
+// Bulk loaded tables are written here before replacing the DB ones, so they
+// are on the same filesystem. leveldb ignores anything it didn't name.
+constexpr auto bulk_staging_dir = "bedrock-unz-staging";
+
+// Input bytes of the ranges diff splits the key space into
+constexpr uint64_t diff_range_bytes = 16 << 20;
+
+// Compares the DBs at a_path and b_path key by key, jobs key ranges at a
+// time. Prints a line for every key that is only in b (+), only in a (-) or
+// has another value (~), in key order as ranges finish, or nothing with
+// quiet, which stops at the first difference. Returns 0 when they match, 1
+// when they differ and 2 when they can't be read, like diff(1).
+int cmd_diff(const fs::path &a_path, const fs::path &b_path,
+             const bool quiet, const size_t jobs) {
+  auto logger = func_logger([](auto format, auto args) {
+    fprintf(stderr, "leveldb info: ");
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
+  });
+  const auto open_input = [&](const fs::path &path) {
+    auto opts = bedrock_input_db_options(make_compressors());
+    opts.modify([&](auto &opts) {
+      opts.create_if_missing = false;
+      opts.error_if_exists = false;
+      opts.info_log = &logger;
+    });
+    auto [maybe_db, status] = open_db(std::move(opts), path);
+    if (!maybe_db) {
+      std::cerr << "Failed to open " << path << ": " << status.ToString()
+                << std::endl;
+    }
+    return std::move(maybe_db);
+  };
+  auto a = open_input(a_path);
+  auto b = open_input(b_path);
+  if (!a || !b) {
+    return 2;
+  }
+
+  auto a_ropts = ldb::ReadOptions();
+  a_ropts.fill_cache = false;
+  a_ropts.verify_checksums = true;
+  auto b_ropts = a_ropts;
+  a_ropts.snapshot = a->GetSnapshot();
+  b_ropts.snapshot = b->GetSnapshot();
+  // Differences are written range by range as they are found, small ranges
+  // keep the ones waiting for the range before them small
+  const auto a_size = approximate_size(*a);
+  const auto ranges = split_key_space(
+      *a, std::clamp<uint64_t>(a_size / diff_range_bytes, jobs, 4096));
+  std::vector<ldb::Status> statuses(ranges.size());
+  std::atomic<uint64_t> added{0}, removed{0}, changed{0};
+  std::atomic<bool> differ{false};
+  output_writer output(STDOUT_FILENO);
+  {
+    ordered_writer writer(output, ranges.size(), 2 * jobs);
+    progress_reporter reporter("diff");
+    reporter.begin_phase("diff", a_size);
+    run_parallel(jobs, ranges.size(), [&](const size_t i) {
+      if (!writer.wait_turn(i)) {
+        return;
+      }
+      auto a_iter = std::unique_ptr<ldb::Iterator>(a->NewIterator(a_ropts));
+      auto b_iter = std::unique_ptr<ldb::Iterator>(b->NewIterator(b_ropts));
+      range_progress diff_progress(*a, ranges[i]);
+      std::string output;
+      walk_pairs(*a_iter, *b_iter, ranges[i],
+                 [&](const key_change change, const ldb::Slice &key,
+                     const ldb::Slice &a_value, const ldb::Slice &) {
+                   diff_progress.read(key, a_value);
+                   if (change == key_change::same) {
+                     // With quiet every range stops once one differs
+                     return !(quiet && differ);
+                   }
+                   differ = true;
+                   if (quiet) {
+                     return false;
+                   }
+                   switch (change) {
+                     case key_change::added:
+                       added++;
+                       output += "+ ";
+                       break;
+                     case key_change::removed:
+                       removed++;
+                       output += "- ";
+                       break;
+                     default:
+                       changed++;
+                       output += "~ ";
+                       break;
+                   }
+                   python_bytes_repr(output, slice_to_view(key));
+                   output += "\n";
+                   return true;
+                 });
+      diff_progress.finish();
+      statuses[i] =
+          a_iter->status().ok() ? b_iter->status() : a_iter->status();
+      if (!statuses[i].ok()) {
+        writer.cancel();
+        return;
+      }
+      writer.submit(i, std::move(output));
+    });
+  }
+  a->ReleaseSnapshot(a_ropts.snapshot);
+  b->ReleaseSnapshot(b_ropts.snapshot);
+  for (const auto &status : statuses) {
+    if (!status.ok()) {
+      std::cerr << "Failed to read DB: " << status.ToString() << std::endl;
+      return 2;
+    }
+  }
+  if (!output.finish()) {
+    std::cerr << "Failed to write output: " << std::strerror(output.error)
+              << std::endl;
+    return 2;
+  }
+  if (quiet) {
+    return differ ? 1 : 0;
+  }
+  std::cerr << added << " keys added, " << removed << " removed, " << changed
+            << " changed" << std::endl;
+  return differ ? 1 : 0;
+}
+
+int cmd_compact(const fs::path &db_path, const output_compression &compression,
+                const compression_policy &policy, const clone_engine engine,
+                const size_t jobs) {
   auto logger = func_logger([](auto format, auto args) {
     printf("leveldb info: ");
     vprintf(format, args);
     printf("\n");
   });
-  auto opts = use_compression
-                  ? bedrock_default_db_options(make_compressors(false))
-                  : bedrock_default_db_options({});
+  auto opts = bedrock_scan_db_options(compression.make_compressors(false));
   opts.modify([&](auto &opts) {
     opts.create_if_missing = false;
     opts.error_if_exists = false;
@@ -510,8 +1981,14 @@ int cmd_compact(const fs::path &db_path, const bool use_compression) {
   auto ropts = ldb::ReadOptions();
   ropts.fill_cache = false;
   ropts.verify_checksums = true;
+  progress_reporter reporter("compact", &missing.counter.counter);
   std::cout << "Sweeping db..." << std::endl;
-  sweep_db(db, ropts);
+  reporter.begin_phase("sweep", approximate_size(db));
+  status = sweep_db(db, ropts, jobs);
+  if (!status.ok()) {
+    std::cerr << "Failed to sweep DB: " << status.ToString() << std::endl;
+    return 1;
+  }
   std::cout << "DB swept, checking for incompatible compressors..."
             << std::endl;
   for (const auto [compressor_id, occurrences] : missing.get_missing()) {
@@ -522,18 +1999,216 @@ int cmd_compact(const fs::path &db_path, const bool use_compression) {
               << std::endl;
     return 1;
   }
-  std::cout << "Running compaction" << std::endl;
-  maybe_db->CompactRange(nullptr, nullptr);
+  if (engine == clone_engine::write) {
+    std::cout << "Running compaction" << std::endl;
+    reporter.begin_phase("compaction");
+    maybe_db->CompactRange(nullptr, nullptr);
+    return 0;
+  }
+
+  std::cout << "Rebuilding tables..." << std::endl;
+  const auto staging_dir = db_path / bulk_staging_dir;
+  std::error_code ec;
+  fs::remove_all(staging_dir, ec);
+  if (!fs::create_directory(staging_dir, ec)) {
+    std::cerr << "Failed to create " << staging_dir << ": " << ec.message()
+              << std::endl;
+    return 1;
+  }
+  ldb::Env *env = get_db_opts(maybe_db)->env;
+  bulk_load load(
+      staging_dir, *get_db_opts(maybe_db),
+      [&compression]() { return make_output_compressors(compression); },
+      bulk_table_size, 0,
+      [&]() { return policy.make_block_policy(compression); });
+  // Every job rebuilds the tables of its own key range
+  reporter.begin_phase("rebuild", approximate_size(db));
+  status = bulk_clone_db(db, load, ropts, jobs);
+  if (!status.ok()) {
+    std::cerr << "Failed to rebuild tables: " << status.ToString()
+              << std::endl;
+    fs::remove_all(staging_dir, ec);
+    return 1;
+  }
+  maybe_db.reset();
+  std::cout << "Replacing tables..." << std::endl;
+  reporter.begin_phase("install");
+  status = install_tables(env, db_path, staging_dir, load.take_files());
+  fs::remove_all(staging_dir, ec);
+  if (!status.ok()) {
+    std::cerr << "Failed to replace tables: " << status.ToString()
+              << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+// True when every data block of the table is stored with compressor_id, or
+// raw because compressing it didn't save enough
+bool uses_only_compressor(const hackdb::block_counts &counts,
+                          const cid_t compressor_id) {
+  for (size_t i = 1; i < counts.size(); i++) {
+    if (i != compressor_id && counts[i] > 0) {
+      return false;
+    }
+  }
+  return compressor_id == 0 || counts[compressor_id] > 0;
+}
+
+// Rewrites the tables of the DB with compression one at a time. Each new
+// table is synced and swapped for the old one with an edit to a new MANIFEST
+// before the old one is deleted, so only jobs tables are ever stored twice.
+// After a crash the DB has the tables of the last edit, tables that already
+// use compression are skipped when it's run again.
+int cmd_recompress(const fs::path &db_path,
+                   const output_compression &compression, const size_t jobs) {
+  auto opts = bedrock_scan_db_options(compression.make_compressors(false));
+  opts.modify([&](auto &opts) {
+    opts.create_if_missing = false;
+    opts.error_if_exists = false;
+  });
+  ldb::Env *env = opts->env;
+  db_manifest manifest;
+  auto status = read_flushed_manifest(opts, db_path, manifest);
+  if (!status.ok()) {
+    std::cerr << "Failed to read MANIFEST: " << status.ToString() << std::endl;
+    return 1;
+  }
+
+  db_lock lock(env, db_path);
+  if (!lock.status.ok()) {
+    std::cerr << "Failed to lock DB: " << lock.status.ToString() << std::endl;
+    return 1;
+  }
+  status = read_manifest(env, db_path, manifest);
+  if (status.ok()) {
+    // Tables written by a run that didn't get to add them
+    status = remove_obsolete_files(env, db_path, manifest);
+  }
+  if (!status.ok()) {
+    std::cerr << "Failed to read MANIFEST: " << status.ToString() << std::endl;
+    return 1;
+  }
+
+  const table_options input_table_opts(*opts);
+  const cid_t compressor_id =
+      compression.enabled() ? compression.type->compression_id : 0;
+  std::vector<table_file> files;
+  uint64_t tables_size = 0;
+  size_t level0_skipped = 0;
+  for (const auto &[_, file] : manifest.files) {
+    // Level 0 tables are searched newest first by number, a rewritten one
+    // gets a higher number and would hide the newer tables overlapping it
+    if (file.level == 0) {
+      level0_skipped++;
+      continue;
+    }
+    block_sampler sampler(1);
+    hackdb::block_counts counts{};
+    status = count_block_compressors(input_table_opts, db_path, file, sampler,
+                                     counts);
+    if (!status.ok()) {
+      std::cerr << "Failed to read table " << file.number << ": "
+                << status.ToString() << std::endl;
+      return 1;
+    }
+    if (!uses_only_compressor(counts, compressor_id)) {
+      files.push_back(file);
+      tables_size += file.size;
+    }
+  }
+  if (level0_skipped > 0) {
+    std::cout << "Skipping " << level0_skipped
+              << " level 0 tables, run compact first to recompress them"
+              << std::endl;
+  }
+  std::cout << "Recompressing " << files.size() << " of "
+            << manifest.files.size() << " tables..." << std::endl;
+  if (files.empty()) {
+    return 0;
+  }
+
+  manifest_log log(env, db_path, manifest);
+  if (!log.status.ok()) {
+    std::cerr << "Failed to write MANIFEST: " << log.status.ToString()
+              << std::endl;
+    return 1;
+  }
+  auto ropts = ldb::ReadOptions();
+  ropts.fill_cache = false;
+  ropts.verify_checksums = true;
+  std::vector<ldb::Status> statuses(files.size());
+  std::atomic<bool> cancelled{false};
+  {
+    progress_reporter reporter("recompress");
+    reporter.begin_phase("recompress", tables_size);
+    run_parallel(jobs, files.size(), [&](const size_t i) {
+      if (cancelled) {
+        return;
+      }
+      const auto &file = files[i];
+      const table_options output_table_opts(
+          *opts, make_output_compressors(compression));
+      table_file recompressed;
+      auto status = transcode_table(input_table_opts, db_path,
+                                    output_table_opts, db_path, ropts, file,
+                                    log.new_file_number(), recompressed);
+      if (status.ok()) {
+        status = log.replace_file(file.number, std::move(recompressed));
+      }
+      if (status.ok()) {
+        // The MANIFEST no longer lists it, failing to delete it only wastes
+        // space until the next run
+        if (!env->DeleteFile(ldb::TableFileName(db_path, file.number)).ok()) {
+          env->DeleteFile(ldb::SSTTableFileName(db_path, file.number));
+        }
+      }
+      progress.covered.fetch_add(file.size, std::memory_order_relaxed);
+      statuses[i] = status;
+      if (!status.ok()) {
+        cancelled = true;
+      }
+    });
+  }
+  status = log.close();
+  for (const auto &table_status : statuses) {
+    if (!table_status.ok()) {
+      status = table_status;
+      break;
+    }
+  }
+  if (!status.ok()) {
+    std::cerr << "Failed to recompress table: " << status.ToString()
+              << std::endl;
+    return 1;
+  }
+  // The previous MANIFEST
+  status = remove_obsolete_files(env, db_path, manifest);
+  if (!status.ok()) {
+    std::cerr << "Failed to remove old files: " << status.ToString()
+              << std::endl;
+    return 1;
+  }
   return 0;
 }
 
-int cmd_clear(const fs::path &db_path) {
+int cmd_clear(const fs::path &db_path, const bool safe) {
+  if (!safe) {
+    std::cout << "Clearing db..." << std::endl;
+    auto status = clear_tables(ldb::Env::Default(), db_path);
+    if (!status.ok()) {
+      std::cerr << "Failed to clear db: " << status.ToString() << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+
   auto logger = func_logger([](auto format, auto args) {
     printf("leveldb info: ");
     vprintf(format, args);
     printf("\n");
   });
-  auto opts = bedrock_default_db_options(make_compressors());
+  auto opts = bedrock_scan_db_options(make_compressors());
   opts.modify([&](auto &opts) {
     opts.create_if_missing = false;
     opts.error_if_exists = false;
@@ -552,7 +2227,13 @@ int cmd_clear(const fs::path &db_path) {
   auto ropts = ldb::ReadOptions();
   ropts.fill_cache = false;
   ropts.verify_checksums = true;
-  sweep_db(db, ropts);
+  progress_reporter reporter("clear", &missing.counter.counter);
+  reporter.begin_phase("sweep", approximate_size(db));
+  status = sweep_db(db, ropts);
+  if (!status.ok()) {
+    std::cerr << "Failed to sweep DB: " << status.ToString() << std::endl;
+    return 1;
+  }
   std::cout << "DB swept, checking for incompatible compressors..."
             << std::endl;
   for (const auto [compressor_id, occurrences] : missing.get_missing()) {
@@ -565,6 +2246,7 @@ int cmd_clear(const fs::path &db_path) {
   }
 
   std::cout << "Clearing db..." << std::endl;
+  reporter.begin_phase("clear", approximate_size(db));
   status = clear_db(db);
   if (!status.ok()) {
     std::cerr << "Failed to clear db: " << status.ToString() << std::endl;
@@ -574,6 +2256,226 @@ int cmd_clear(const fs::path &db_path) {
   return 0;
 }
 
+// Builds the chunk index of the DB at index_path, or updates the one there
+// by indexing again only the chunks with records in tables that changed
+int cmd_index(const fs::path &db_path, const fs::path &index_path,
+              const bool rebuild, const bool read_only) {
+  auto logger = func_logger([](auto format, auto args) {
+    fprintf(stderr, "leveldb info: ");
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
+  });
+  auto opts = bedrock_input_db_options(make_compressors());
+  opts.modify([&](auto &opts) {
+    opts.create_if_missing = false;
+    opts.error_if_exists = false;
+    opts.info_log = &logger;
+  });
+  db_manifest manifest;
+  // Read-only, the keys in the logs aren't in any of these tables, which is
+  // why the index is then always rebuilt
+  auto status = read_only ? read_manifest(opts->env, db_path, manifest)
+                          : read_flushed_manifest(opts, db_path, manifest);
+  if (!status.ok()) {
+    std::cerr << "Failed to read MANIFEST: " << status.ToString()
+              << std::endl;
+    return 1;
+  }
+  const auto tables = chunk_index_tables(manifest);
+
+  std::vector<chunk_index_entry> kept;
+  std::vector<key_range> ranges{key_range{}};
+  if (!rebuild) {
+    bool found;
+    chunk_index_view old_index(index_path, found);
+    std::vector<chunk_index_table> old_tables;
+    status = old_index.status;
+    if (status.ok() && found) {
+      status = old_index.tables(old_tables);
+    }
+    if (!status.ok()) {
+      std::cerr << "Rebuilding unreadable chunk index: " << status.ToString()
+                << std::endl;
+    } else if (found) {
+      ranges = changed_chunk_ranges(old_tables, tables);
+      kept = entries_outside(old_index.entries(), ranges);
+    }
+  }
+
+  auto [maybe_db, open_status] =
+      read_only ? open_db_read_only(std::move(opts), db_path)
+                : open_db(std::move(opts), db_path);
+  if (!maybe_db) {
+    std::cerr << "Failed to open DB: " << open_status.ToString()
+              << std::endl;
+    return 1;
+  }
+  auto &db = *maybe_db;
+  auto ropts = ldb::ReadOptions();
+  ropts.fill_cache = false;
+  ropts.verify_checksums = true;
+  progress_reporter reporter("index");
+  uint64_t expected = 0;
+  for (const auto &range : ranges) {
+    expected += approximate_size(db, range);
+  }
+  reporter.begin_phase("sweep", expected);
+  chunk_index_builder builder;
+  for (const auto &range : ranges) {
+    auto iter = sweep_range(
+        db, ropts, range,
+        [&](const auto &key, const auto &value) {
+          builder.add(key, value.size());
+        });
+    if (!iter->status().ok()) {
+      std::cerr << "Failed to read DB: " << iter->status().ToString()
+                << std::endl;
+      return 1;
+    }
+  }
+  const auto entries = builder.finish(kept);
+  reporter.begin_phase("write");
+  status = write_chunk_index(ldb::Env::Default(), index_path, entries, tables);
+  if (!status.ok()) {
+    std::cerr << "Failed to write chunk index: " << status.ToString()
+              << std::endl;
+    return 1;
+  }
+  std::cout << "Indexed " << entries.size() << " chunks, "
+            << entries.size() - kept.size() << " of them read from "
+            << ranges.size() << " key ranges" << std::endl;
+  return 0;
+}
+
+// Prints the chunks in the index with their size, record tags and sub chunk
+// indexes, one per line
+int cmd_index_query(const fs::path &index_path, const int32_t dimension,
+                    const chunk_box &box) {
+  bool found;
+  chunk_index_view index(index_path, found);
+  if (!found) {
+    std::cerr << "No chunk index at " << index_path
+              << ", build one with the index command" << std::endl;
+    return 1;
+  }
+  if (!index.status.ok()) {
+    std::cerr << "Failed to read chunk index: " << index.status.ToString()
+              << std::endl;
+    return 1;
+  }
+  // Comma separated value_of(bit) of the bits that are set
+  const auto append_list = [](std::string &line, const uint64_t bits,
+                              auto &&value_of) {
+    if (bits == 0) {
+      line += "-";
+    }
+    for (int bit = 0; bit < 64; bit++) {
+      if (bits & (uint64_t{1} << bit)) {
+        line += std::to_string(value_of(bit));
+        line += bits >> bit > 1 ? "," : "";
+      }
+    }
+  };
+  output_writer output(STDOUT_FILENO);
+  output.append("dimension x z bytes tags sub_chunks\n");
+  std::string line;
+  index.find(dimension, box, [&](const chunk_index_entry &entry) {
+    using namespace chunk_index_detail;
+    line = std::to_string(entry.dimension) + " " + std::to_string(entry.x) +
+           " " + std::to_string(entry.z) + " " +
+           std::to_string(entry.value_bytes) + " ";
+    append_list(line, entry.tags, [](const int bit) {
+      return tag_bit('v') == 1u << bit ? 'v'
+                                       : bedrock_keys::first_record_tag + bit;
+    });
+    line += " ";
+    append_list(line, entry.sub_chunks,
+                [](const int bit) { return bit - sub_chunk_bias; });
+    line += "\n";
+    output.append(line);
+  });
+  if (!output.finish()) {
+    std::cerr << "Failed to write output: " << std::strerror(output.error)
+              << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+// Runs the jobs listed in jobs_path, or stdin for -, up to workers worlds at
+// a time and each on a single thread. Every DB they open shares a block
+// cache of cache_mb and max_open_files is split among the DBs that can be
+// open at once.
+int cmd_batch(const fs::path &jobs_path, const output_compression &compression,
+              const size_t cache_mb, const int max_open_files,
+              const size_t workers, const size_t per_device) {
+  std::vector<batch_job> jobs;
+  if (jobs_path == "-") {
+    if (!parse_batch_jobs(std::cin, jobs)) {
+      return 1;
+    }
+  } else {
+    std::ifstream file(jobs_path);
+    if (!file) {
+      std::cerr << "Failed to open " << jobs_path << std::endl;
+      return 1;
+    }
+    if (!parse_batch_jobs(file, jobs)) {
+      return 1;
+    }
+  }
+
+  const auto running = std::max<size_t>(1, std::min(workers, jobs.size()));
+  const auto cache_bytes = memory.block_cache(cache_mb << 20);
+  const memory_reservation cache_reservation(cache_bytes);
+  shared_block_cache.reset(ldb::NewLRUCache(cache_bytes));
+  // What the shared cache leaves of --memory-limit is split evenly among the
+  // running jobs, the cache is capped well under the limit
+  if (memory.limited()) {
+    memory.set_limit((memory.limit() - cache_bytes) / running);
+  }
+  // Copies have their input and output open, leveldb raises limits under 74
+  db_max_open_files =
+      std::max<int>(1, max_open_files / static_cast<int>(2 * running));
+  progress_config.enabled = false;
+
+  const compression_policy policy{};
+  std::vector<int> results(jobs.size());
+  const auto batch_start = metrics_detail::clock::now();
+  run_batch(jobs, running, per_device, [&](const size_t i) {
+    const auto &job = jobs[i];
+    const auto start = metrics_detail::clock::now();
+    switch (job.command) {
+      case batch_command::copy:
+        results[i] = compress_decompress(
+            job.input, job.output, compression, policy, false,
+            clone_engine::bulk, 1, {}, false, false, key_filter{});
+        break;
+      case batch_command::compact:
+        results[i] = cmd_compact(job.input, compression, policy,
+                                 clone_engine::bulk, 1);
+        break;
+      case batch_command::verify:
+        results[i] = cmd_verify(job.input, false, 1);
+        break;
+    }
+    std::ostringstream out;
+    out << "Line " << job.line << ": " << job.input << " "
+        << (results[i] == 0 ? "done" : "failed") << " in "
+        << metrics_detail::format_duration(
+               metrics_detail::seconds_since(start));
+    std::cout << out.str() << std::endl;
+  });
+
+  const auto failed = std::count_if(results.begin(), results.end(),
+                                    [](const int result) { return result; });
+  std::cout << jobs.size() << " jobs took "
+            << metrics_detail::format_duration(
+                   metrics_detail::seconds_since(batch_start))
+            << ", " << failed << " failed" << std::endl;
+  return failed > 0 ? 1 : 0;
+}
+
 class exit_with_code : std::runtime_error {
  public:
   const int code;
@@ -604,61 +2506,601 @@ void cli_parse_handler(std::function<void(void)> &&parse,
   }
 }
 
+// Flags of the commands that can work on a subset of the keys
+struct key_filter_flags {
+  explicit key_filter_flags(args::Subparser &subp)
+      : dimension(subp, "id",
+                  "Only chunk records of this dimension, 0 is the overworld",
+                  {"dimension"}),
+        chunk_box(subp, "x0,z0,x1,z1",
+                  "Only chunk records with chunk coordinates in this box, "
+                  "ends included",
+                  {"chunk-box"}),
+        tag(subp, "tag", "Only chunk records with this tag byte", {"tag"}),
+        prefixes(subp, "bytes",
+                 "Only keys starting with these bytes, \\xNN escapes a "
+                 "byte, can be repeated to match any of them",
+                 {"prefix"}) {}
+
+  key_filter make() const {
+    std::optional<::chunk_box> box{};
+    if (chunk_box) {
+      box = parse_chunk_box(*chunk_box);
+      if (!box) {
+        throw exit_with_code(1);
+      }
+    }
+    if (tag && (*tag > 0xff || !bedrock_keys::is_record_tag(*tag))) {
+      std::cerr << "--tag " << *tag << " is not a chunk record tag"
+                << std::endl;
+      throw exit_with_code(1);
+    }
+    std::vector<std::string> parsed_prefixes;
+    for (const auto &spec : *prefixes) {
+      auto prefix = parse_key_prefix(spec);
+      if (!prefix) {
+        throw exit_with_code(1);
+      }
+      parsed_prefixes.push_back(std::move(*prefix));
+    }
+    return key_filter(
+        dimension ? std::optional(*dimension) : std::nullopt, box,
+        tag ? std::optional(static_cast<unsigned char>(*tag)) : std::nullopt,
+        std::move(parsed_prefixes));
+  }
+
+  args::ValueFlag<int32_t> dimension;
+  args::ValueFlag<std::string> chunk_box;
+  args::ValueFlag<unsigned> tag;
+  args::ValueFlagList<std::string> prefixes;
+};
+
+// -c/--compress writes with zlib raw, the compressor Bedrock uses, and
+// --compression picks another compressor or level, which implies -c
+struct compress_flags {
+  compress_flags(args::Subparser &subp, const std::string &action)
+      : compress(subp, "compress",
+                 action + " with compression, zlib-raw unless --compression "
+                          "picks another",
+                 {'c', "compress"}),
+        compression(subp, "name[:level]",
+                    action + " with this compression, NAME is zlib-raw, "
+                             "zlib or zstd, implies --compress",
+                    {"compression"}) {}
+
+  output_compression make() const {
+    if (!compress && !compression) {
+      return output_compression{};
+    }
+    auto parsed = parse_output_compression(compression ? *compression : "");
+    if (!parsed) {
+      throw exit_with_code(1);
+    }
+    return *parsed;
+  }
+
+  args::Flag compress;
+  args::ValueFlag<std::string> compression;
+};
+
 int main(int argc, const char **argv) {
   args::ArgumentParser parser("Compress and decompress leveldb DB");
   args::HelpFlag help(parser, "help", "Display this help menu", {'h', "help"});
   args::CompletionFlag completion(parser, {"complete"});
   // should be a positional but https://github.com/Taywee/args/issues/125
-  args::ValueFlag<fs::path> input_dir(parser, "input", "Input DB directory",
-                                      {'i', "input"}, args::Options::Required);
+  args::ValueFlag<fs::path> input_dir(
+      parser, "input", "Input DB directory, every command but batch needs it",
+      {'i', "input"});
+  args::ValueFlag<fs::path> zstd_dict_path(
+      parser, "dict",
+      "zstd dictionary from train-dict, used to write zstd blocks and to read "
+      "blocks that were written with it",
+      {"zstd-dict"});
+  args::Flag stats_json(
+      parser, "stats-json",
+      "Report progress of copy, compact, clear and dump as JSON lines on "
+      "stderr",
+      {"stats-json"});
+  args::ValueFlag<double> stats_interval(
+      parser, "seconds",
+      "Seconds between progress reports, 0 to only report finished phases",
+      {"stats-interval"}, 10);
+  args::MapFlag<std::string, deflate_impl> deflate(
+      parser, "impl",
+      "What reads and writes zlib and zlib raw blocks: zlib, or libdeflate "
+      "when built with it (then the default)",
+      {"deflate"}, deflate_impl_names, deflate_implementation);
+  args::ValueFlag<uint64_t> memory_limit(
+      parser, "MB",
+      "Megabytes split among block caches, memtables, open tables, write "
+      "batches and copy queues, 0 for no limit",
+      {"memory-limit"}, 0);
+  auto load_global_options = [&](const bool needs_input = true) {
+    if (needs_input && !input_dir) {
+      std::cerr << "--input is required" << std::endl;
+      throw exit_with_code(1);
+    }
+    if (zstd_dict_path && !load_zstd_dictionary(*zstd_dict_path)) {
+      throw exit_with_code(1);
+    }
+    if (!(*stats_interval >= 0)) {
+      std::cerr << "--stats-interval can't be negative" << std::endl;
+      throw exit_with_code(1);
+    }
+    if (*deflate == deflate_impl::libdeflate && !libdeflate_available) {
+      std::cerr << "Built without libdeflate, configure with "
+                   "-DBEDROCK_UNZ_LIBDEFLATE=ON to use it"
+                << std::endl;
+      throw exit_with_code(1);
+    }
+    deflate_implementation = *deflate;
+    // Below this the minimum size of each share is most of it
+    if (*memory_limit != 0 && *memory_limit < 64) {
+      std::cerr << "--memory-limit has to be at least 64 MB" << std::endl;
+      throw exit_with_code(1);
+    }
+    memory.set_limit(*memory_limit << 20);
+    progress_config.json = stats_json;
+    progress_config.interval = std::chrono::milliseconds(
+        static_cast<int64_t>(*stats_interval * 1000));
+  };
+  const auto read_only_help =
+      "Open the DB without replaying its logs into tables or writing to it, "
+      "works on read-only copies";
+  const auto compress_for_help =
+      "Compression for some of the keys, KEYS=COMPRESSION where KEYS is a "
+      "chunk record tag or prefix:BYTES and COMPRESSION is none or "
+      "NAME[:LEVEL], the first one that matches a key is used. Data blocks "
+      "are cut when the compression changes once they have a quarter of "
+      "the block size, a smaller block is compressed the way most of its "
+      "compressed keys are and only stored raw if all of its keys are";
+  auto parse_compress_for =
+      [](const args::ValueFlagList<std::string> &flag) {
+        std::vector<compression_rule> rules;
+        for (const auto &spec : *flag) {
+          auto rule = parse_compression_rule(spec);
+          if (!rule) {
+            throw exit_with_code(1);
+          }
+          rules.push_back(std::move(*rule));
+        }
+        return compression_policy(std::move(rules));
+      };
   args::Group commands(parser, "commands");
   args::Command copy(
       commands, "copy", "Copy database", [&](args::Subparser &subp) {
         auto out_dir = args::Positional<fs::path>(
             subp, "out", "Output DB directory", args::Options::Required);
-        auto compress = args::Flag(subp, "compress", "Copy with compression",
-                                   {'c', "compress"});
+        const compress_flags compress(subp, "Copy");
+        auto compress_for = args::ValueFlagList<std::string>(
+            subp, "keys=compression", compress_for_help, {"compress-for"});
         auto overwrite =
             args::Flag(subp, "overwrite", "Overwrite existing database",
                        {'o', "overwrite"});
+        auto jobs = args::ValueFlag<size_t>(
+            subp, "jobs",
+            "Number of threads copying key ranges, 0 for one per core",
+            {'j', "jobs"}, 1);
+        auto engine = args::MapFlag<std::string, clone_engine>(
+            subp, "engine",
+            "How keys are written to the output: bulk (sorted tables, "
+            "default) or write (DB writes and a compaction)",
+            {"engine"}, clone_engine_names, clone_engine::bulk);
+        const pipeline_options default_popts{};
+        auto read_queue = args::ValueFlag<size_t>(
+            subp, "chunks",
+            "Chunks of read keys queued for encoding, 0 to read and encode "
+            "on the same thread",
+            {"read-queue"}, default_popts.read_queue);
+        auto write_queue = args::ValueFlag<size_t>(
+            subp, "buffers",
+            "Encoded batches or table buffers queued for writing, 0 to "
+            "encode and write on the same thread",
+            {"write-queue"}, default_popts.write_queue);
+        auto transcode_tables = args::Flag(
+            subp, "transcode-tables",
+            "Rewrite each table file instead of replaying keys through the "
+            "output DB, keeps the input level layout",
+            {"transcode-tables"});
+        auto incremental = args::Flag(
+            subp, "incremental",
+            "Update an output from an earlier copy, only key ranges whose "
+            "input tables changed are compared and written",
+            {"incremental"});
+        const key_filter_flags filter(subp);
 
         subp.Parse();
-
-        throw exit_with_code(
-            compress_decompress(*input_dir, *out_dir, compress, overwrite));
+        load_global_options();
+        if (incremental && (transcode_tables || overwrite)) {
+          std::cerr << "--incremental updates the output in place, it can't "
+                       "be used with --transcode-tables or --overwrite"
+                    << std::endl;
+          throw exit_with_code(1);
+        }
+
+        const auto policy = parse_compress_for(compress_for);
+        throw exit_with_code(compress_decompress(
+            *input_dir, *out_dir, compress.make(), policy, overwrite,
+            *engine, resolve_jobs(*jobs), {*read_queue, *write_queue},
+            transcode_tables, incremental, filter.make()));
       });
 
   args::Command list_algos(
       commands, "list-algos", "Lists compression algorithms used in DB",
       [&](args::Subparser &subp) {
+        auto index_only = args::Flag(
+            subp, "index-only",
+            "Read compressor IDs from block trailers through table indexes "
+            "instead of decompressing every block",
+            {"index-only"});
+        auto sample = args::ValueFlag<double>(
+            subp, "fraction",
+            "With --index-only, fraction of the data blocks to look at",
+            {"sample"}, 1.0);
+        auto read_only =
+            args::Flag(subp, "read-only", read_only_help, {"read-only"});
         subp.Parse();
-        throw exit_with_code(cmd_find_compression_algos(*input_dir));
+        load_global_options();
+        if (!index_only) {
+          if (sample) {
+            std::cerr << "--sample requires --index-only" << std::endl;
+            throw exit_with_code(1);
+          }
+          throw exit_with_code(
+              cmd_find_compression_algos(*input_dir, read_only));
+        }
+        if (!(*sample > 0 && *sample <= 1)) {
+          std::cerr << "--sample must be in (0, 1]" << std::endl;
+          throw exit_with_code(1);
+        }
+        throw exit_with_code(
+            cmd_find_compression_algos_in_tables(*input_dir, *sample));
+      });
+
+  args::Command estimate(
+      commands, "estimate",
+      "Project the size and speed of each compression from sampled blocks",
+      [&](args::Subparser &subp) {
+        auto sample = args::ValueFlag<double>(
+            subp, "fraction",
+            "Fraction of the data blocks to sample, by default enough for "
+            "about 64 MB",
+            {"sample"});
+        auto compress = args::ValueFlagList<std::string>(
+            subp, "compress",
+            "Compression to estimate, none or NAME[:LEVEL], can be repeated. "
+            "By default every compressor and some zstd levels",
+            {'c', "compress"});
+        auto jobs = args::ValueFlag<size_t>(
+            subp, "jobs",
+            "Number of threads sampling tables, 0 for one per core",
+            {'j', "jobs"}, 0);
+        subp.Parse();
+        load_global_options();
+        if (sample && !(*sample > 0 && *sample <= 1)) {
+          std::cerr << "--sample must be in (0, 1]" << std::endl;
+          throw exit_with_code(1);
+        }
+        auto candidates = default_estimate_candidates();
+        if (compress) {
+          candidates.clear();
+          for (const auto &spec : *compress) {
+            auto candidate = spec == "none"
+                                 ? std::optional(output_compression{})
+                                 : parse_output_compression(spec);
+            if (!candidate) {
+              throw exit_with_code(1);
+            }
+            candidates.push_back(*candidate);
+          }
+        }
+        throw exit_with_code(cmd_estimate(
+            *input_dir, sample ? std::optional(*sample) : std::nullopt,
+            candidates, resolve_jobs(*jobs)));
       });
 
   args::Command compact(
       commands, "compact", "Compact DB in place", [&](args::Subparser &subp) {
-        auto compress = args::Flag(subp, "compress",
-                                   "Run compaction with compression algorithm",
-                                   {'c', "compress"});
+        const compress_flags compress(subp, "Run compaction");
+        auto compress_for = args::ValueFlagList<std::string>(
+            subp, "keys=compression", compress_for_help, {"compress-for"});
+        auto engine = args::MapFlag<std::string, clone_engine>(
+            subp, "engine",
+            "How the DB is rewritten: bulk (rebuild sorted tables, default) "
+            "or write (leveldb compaction)",
+            {"engine"}, clone_engine_names, clone_engine::bulk);
+        auto jobs = args::ValueFlag<size_t>(
+            subp, "jobs",
+            "Number of threads sweeping and rebuilding key ranges, 0 for one "
+            "per core",
+            {'j', "jobs"}, 1);
+        subp.Parse();
+        load_global_options();
+        if (*engine == clone_engine::write && *jobs != 1) {
+          std::cerr << "leveldb compacts on a single thread, --jobs requires "
+                       "--engine=bulk"
+                    << std::endl;
+          throw exit_with_code(1);
+        }
+        const auto policy = parse_compress_for(compress_for);
+        if (*engine == clone_engine::write && !policy.empty()) {
+          std::cerr << "leveldb compresses every block the same way, "
+                       "--compress-for requires --engine=bulk"
+                    << std::endl;
+          throw exit_with_code(1);
+        }
+        throw exit_with_code(cmd_compact(*input_dir, compress.make(),
+                                         policy, *engine,
+                                         resolve_jobs(*jobs)));
+      });
+
+  args::Command recompress(
+      commands, "recompress",
+      "Rewrite the tables of the DB with another compressor",
+      [&](args::Subparser &subp) {
+        auto in_place = args::Flag(
+            subp, "in-place",
+            "Replace the tables of the DB one at a time, the only mode there "
+            "is for now",
+            {"in-place"}, args::Options::Required);
+        const compress_flags compress(subp, "Rewrite tables");
+        auto jobs = args::ValueFlag<size_t>(
+            subp, "jobs",
+            "Number of tables rewritten at once, each takes its size in free "
+            "disk space, 0 for one per core",
+            {'j', "jobs"}, 1);
+        subp.Parse();
+        load_global_options();
+        throw exit_with_code(cmd_recompress(
+            *input_dir, compress.make(), resolve_jobs(*jobs)));
+      });
+
+  args::Command batch(
+      commands, "batch",
+      "Run copy, compact and verify jobs on many worlds from one process",
+      [&](args::Subparser &subp) {
+        auto jobs_path = args::Positional<fs::path>(
+            subp, "jobs",
+            "File listing a job per line as COMMAND INPUT [OUTPUT], - for "
+            "stdin",
+            args::Options::Required);
+        const compress_flags compress(subp, "Write copies and compactions");
+        auto cache_mb = args::ValueFlag<size_t>(
+            subp, "MB", "Size of the block cache shared by every DB",
+            {"cache-mb"}, 64);
+        auto max_open_files = args::ValueFlag<int>(
+            subp, "files",
+            "Files kept open by all the DBs that aren't mapped together",
+            {"max-open-files"}, 1000);
+        auto jobs = args::ValueFlag<size_t>(
+            subp, "jobs",
+            "Number of worlds processed at once, 0 for one per core",
+            {'j', "jobs"}, 0);
+        auto per_device = args::ValueFlag<size_t>(
+            subp, "jobs",
+            "Most worlds processed at once whose input is on the same "
+            "device, 0 for no limit",
+            {"per-device"}, 0);
+        subp.Parse();
+        load_global_options(false);
+        if (*max_open_files <= 0) {
+          std::cerr << "--max-open-files must be positive" << std::endl;
+          throw exit_with_code(1);
+        }
+        throw exit_with_code(cmd_batch(*jobs_path, compress.make(),
+                                       *cache_mb, *max_open_files,
+                                       resolve_jobs(*jobs), *per_device));
+      });
+
+  args::Command clear(
+      commands, "clear", "Clear DB in place", [&](args::Subparser &subp) {
+        auto safe = args::Flag(
+            subp, "safe",
+            "Delete every key through the DB instead of replacing its "
+            "MANIFEST with an empty one",
+            {"safe"});
         subp.Parse();
-        throw exit_with_code(cmd_compact(*input_dir, compress));
+        load_global_options();
+        throw exit_with_code(cmd_clear(*input_dir, safe));
       });
 
-  args::Command clear(commands, "clear", "Clear DB in place",
-                      [&](args::Subparser &subp) {
-                        subp.Parse();
-                        throw exit_with_code(cmd_clear(*input_dir));
-                      });
+  args::Command dump(
+      commands, "dump", "Dump DB in Python dict format",
+      [&](args::Subparser &subp) {
+        auto output = args::ValueFlag<fs::path>(
+            subp, "file", "Write to file instead of stdout", {'o', "output"});
+        auto read_only =
+            args::Flag(subp, "read-only", read_only_help, {"read-only"});
+        const key_filter_flags filter(subp);
+        subp.Parse();
+        load_global_options();
+        throw exit_with_code(
+            cmd_dump(*input_dir,
+                     output ? std::optional(*output) : std::nullopt,
+                     filter.make(), read_only));
+      });
 
-  args::Command dump(commands, "dump", "Dump DB in Python dict format",
-                     [&](args::Subparser &subp) {
-                       subp.Parse();
-                       throw exit_with_code(cmd_dump(*input_dir));
-                     });
+  args::Command export_(
+      commands, "export",
+      "Write the keys of the DB as a zstd compressed stream for import",
+      [&](args::Subparser &subp) {
+        auto output = args::ValueFlag<fs::path>(
+            subp, "file", "Write to file instead of stdout", {'o', "output"});
+        auto level = args::ValueFlag<int>(
+            subp, "level", "zstd compression level", {"level"},
+            ZSTD_CLEVEL_DEFAULT);
+        auto jobs = args::ValueFlag<size_t>(
+            subp, "jobs",
+            "Number of threads reading and compressing key ranges, 0 for one "
+            "per core",
+            {'j', "jobs"}, 0);
+        subp.Parse();
+        load_global_options();
+        if (*level < ZSTD_minCLevel() || *level > ZSTD_maxCLevel()) {
+          std::cerr << "--level must be from " << ZSTD_minCLevel() << " to "
+                    << ZSTD_maxCLevel() << std::endl;
+          throw exit_with_code(1);
+        }
+        throw exit_with_code(
+            cmd_export(*input_dir,
+                       output ? std::optional(*output) : std::nullopt,
+                       *level, resolve_jobs(*jobs)));
+      });
+
+  args::Command import(
+      commands, "import", "Create the DB from a stream written by export",
+      [&](args::Subparser &subp) {
+        auto file = args::ValueFlag<fs::path>(
+            subp, "file", "Read from file instead of stdin", {"file"});
+        const compress_flags compress(subp, "Write tables");
+        auto overwrite =
+            args::Flag(subp, "overwrite", "Overwrite existing database",
+                       {'o', "overwrite"});
+        auto jobs = args::ValueFlag<size_t>(
+            subp, "jobs",
+            "Number of threads loading parts of a stream read from a file, "
+            "0 for one per core",
+            {'j', "jobs"}, 0);
+        subp.Parse();
+        load_global_options();
+        throw exit_with_code(
+            cmd_import(*input_dir, file ? std::optional(*file) : std::nullopt,
+                       compress.make(), overwrite,
+                       resolve_jobs(*jobs)));
+      });
+
+  args::Command index(
+      commands, "index",
+      "Build or update a chunk index of the DB, or query one",
+      [&](args::Subparser &subp) {
+        auto file = args::ValueFlag<fs::path>(
+            subp, "file",
+            "Index file, by default bedrock-unz-index in the DB directory",
+            {"file"});
+        auto rebuild = args::Flag(
+            subp, "rebuild",
+            "Index every chunk instead of only the ones in changed tables",
+            {"rebuild"});
+        auto query = args::Flag(
+            subp, "query",
+            "Print the chunks in the index instead of building it",
+            {"query"});
+        auto dimension = args::ValueFlag<int32_t>(
+            subp, "id", "With --query, dimension of the chunks", {"dimension"},
+            0);
+        auto box = args::ValueFlag<std::string>(
+            subp, "x0,z0,x1,z1",
+            "With --query, only chunks with coordinates in this box, ends "
+            "included",
+            {"chunk-box"});
+        auto read_only = args::Flag(
+            subp, "read-only",
+            "Index the DB without replaying its logs into tables or writing "
+            "to it, requires --rebuild",
+            {"read-only"});
+        subp.Parse();
+        load_global_options();
+        const auto index_path =
+            file ? *file : fs::path(chunk_index_file(*input_dir));
+        if (!query) {
+          if (dimension || box) {
+            std::cerr << "--dimension and --chunk-box require --query"
+                      << std::endl;
+            throw exit_with_code(1);
+          }
+          if (read_only && !rebuild) {
+            std::cerr << "--read-only can't tell what changed in the logs, "
+                         "it requires --rebuild"
+                      << std::endl;
+            throw exit_with_code(1);
+          }
+          throw exit_with_code(
+              cmd_index(*input_dir, index_path, rebuild, read_only));
+        }
+        if (rebuild) {
+          std::cerr << "--rebuild can't be used with --query" << std::endl;
+          throw exit_with_code(1);
+        }
+        chunk_box query_box{std::numeric_limits<int32_t>::min(),
+                            std::numeric_limits<int32_t>::min(),
+                            std::numeric_limits<int32_t>::max(),
+                            std::numeric_limits<int32_t>::max()};
+        if (box) {
+          auto parsed = parse_chunk_box(*box);
+          if (!parsed) {
+            throw exit_with_code(1);
+          }
+          query_box = *parsed;
+        }
+        throw exit_with_code(
+            cmd_index_query(index_path, *dimension, query_box));
+      });
+
+  args::Command verify(
+      commands, "verify",
+      "Check the checksums of every block of the tables of the DB",
+      [&](args::Subparser &subp) {
+        auto decode = args::Flag(
+            subp, "decode",
+            "Also decompress data blocks and check that their entries parse",
+            {"decode"});
+        auto jobs = args::ValueFlag<size_t>(
+            subp, "jobs",
+            "Number of threads verifying tables, 0 for one per core",
+            {'j', "jobs"}, 0);
+        subp.Parse();
+        load_global_options();
+        throw exit_with_code(
+            cmd_verify(*input_dir, decode, resolve_jobs(*jobs)));
+      });
+
+  args::Command diff(
+      commands, "diff", "Compare the keys of the DB with another one",
+      [&](args::Subparser &subp) {
+        auto other = args::Positional<fs::path>(
+            subp, "other", "DB directory to compare with",
+            args::Options::Required);
+        auto quiet = args::Flag(
+            subp, "quiet",
+            "Print nothing and stop at the first difference, only the exit "
+            "code tells whether they match",
+            {'q', "quiet"});
+        auto jobs = args::ValueFlag<size_t>(
+            subp, "jobs",
+            "Number of threads comparing key ranges, 0 for one per core",
+            {'j', "jobs"}, 0);
+        subp.Parse();
+        load_global_options();
+        throw exit_with_code(
+            cmd_diff(*input_dir, *other, quiet, resolve_jobs(*jobs)));
+      });
+
+  args::Command train_dict(
+      commands, "train-dict",
+      "Train a zstd dictionary on values sampled from every record type",
+      [&](args::Subparser &subp) {
+        auto out = args::Positional<fs::path>(
+            subp, "out", "Dictionary file", args::Options::Required);
+        auto size = args::ValueFlag<size_t>(
+            subp, "bytes", "Maximum size of the dictionary", {"size"},
+            112640);
+        auto samples_per_tag = args::ValueFlag<size_t>(
+            subp, "count", "Values sampled from each record tag",
+            {"samples-per-tag"}, 1000);
+        subp.Parse();
+        load_global_options();
+        throw exit_with_code(
+            cmd_train_dict(*input_dir, *out, *size, *samples_per_tag));
+      });
 
   try {
     cli_parse_handler([&]() { parser.ParseCLI(argc, argv); }, parser);
   } catch (const exit_with_code &e) {
+    if (*memory_limit != 0) {
+      std::cerr << "Peak memory: " << (peak_rss() >> 20) << " MB resident, "
+                << (memory.peak_reserved() >> 20) << " MB budgeted of "
+                << *memory_limit << " MB" << std::endl;
+    }
     return e.code;
   }
   assert(false);
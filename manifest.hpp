@@ -0,0 +1,397 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "db/filename.h"
+#include "db/log_reader.h"
+#include "db/log_writer.h"
+#include "db/version_edit.h"
+#include "leveldb/env.h"
+#include "util/coding.h"
+#include "utils.hpp"
+
+namespace ldb = leveldb;
+
+// A table file as listed in the MANIFEST, keys are internal keys
+struct table_file {
+  int level;
+  uint64_t number;
+  uint64_t size;
+  std::string smallest;
+  std::string largest;
+};
+
+// The current version of a DB, as rebuilt from its MANIFEST. leveldb keeps
+// this inside of VersionSet, which isn't usable without an open DB.
+struct db_manifest {
+  std::string comparator{};
+  uint64_t log_number = 0;
+  uint64_t prev_log_number = 0;
+  uint64_t next_file = 0;
+  uint64_t last_sequence = 0;
+  uint64_t descriptor_number = 0;
+  std::map<uint64_t, table_file> files{};
+
+  uint64_t new_file_number() { return next_file++; }
+};
+
+namespace manifest_detail {
+// Tags used by VersionEdit::EncodeTo, which has no public accessors for the
+// files it adds and removes
+enum edit_tag : uint32_t {
+  comparator_tag = 1,
+  log_number_tag = 2,
+  next_file_number_tag = 3,
+  last_sequence_tag = 4,
+  compact_pointer_tag = 5,
+  deleted_file_tag = 6,
+  new_file_tag = 7,
+  prev_log_number_tag = 9,
+};
+
+struct manifest_reporter : public ldb::log::Reader::Reporter {
+  ldb::Status status{};
+  void Corruption(size_t, const ldb::Status &s) override {
+    if (status.ok()) {
+      status = s;
+    }
+  }
+};
+
+struct seen_fields {
+  bool log_number = false;
+  bool next_file = false;
+  bool last_sequence = false;
+};
+
+ldb::Status apply_edit(db_manifest &manifest, seen_fields &seen,
+                       ldb::Slice input) {
+  uint32_t tag, level;
+  uint64_t number, size;
+  ldb::Slice str, smallest, largest;
+  while (ldb::GetVarint32(&input, &tag)) {
+    switch (tag) {
+      case comparator_tag:
+        if (!ldb::GetLengthPrefixedSlice(&input, &str)) {
+          return ldb::Status::Corruption("MANIFEST", "bad comparator name");
+        }
+        manifest.comparator = str.ToString();
+        break;
+      case log_number_tag:
+        if (!ldb::GetVarint64(&input, &manifest.log_number)) {
+          return ldb::Status::Corruption("MANIFEST", "bad log number");
+        }
+        seen.log_number = true;
+        break;
+      case prev_log_number_tag:
+        if (!ldb::GetVarint64(&input, &manifest.prev_log_number)) {
+          return ldb::Status::Corruption("MANIFEST",
+                                         "bad previous log number");
+        }
+        break;
+      case next_file_number_tag:
+        if (!ldb::GetVarint64(&input, &manifest.next_file)) {
+          return ldb::Status::Corruption("MANIFEST", "bad next file number");
+        }
+        seen.next_file = true;
+        break;
+      case last_sequence_tag:
+        if (!ldb::GetVarint64(&input, &manifest.last_sequence)) {
+          return ldb::Status::Corruption("MANIFEST", "bad last sequence");
+        }
+        seen.last_sequence = true;
+        break;
+      case compact_pointer_tag:
+        if (!ldb::GetVarint32(&input, &level) ||
+            !ldb::GetLengthPrefixedSlice(&input, &str)) {
+          return ldb::Status::Corruption("MANIFEST",
+                                         "bad compaction pointer");
+        }
+        break;
+      case deleted_file_tag:
+        if (!ldb::GetVarint32(&input, &level) ||
+            !ldb::GetVarint64(&input, &number)) {
+          return ldb::Status::Corruption("MANIFEST", "bad deleted file");
+        }
+        manifest.files.erase(number);
+        break;
+      case new_file_tag:
+        if (!ldb::GetVarint32(&input, &level) ||
+            !ldb::GetVarint64(&input, &number) ||
+            !ldb::GetVarint64(&input, &size) ||
+            !ldb::GetLengthPrefixedSlice(&input, &smallest) ||
+            !ldb::GetLengthPrefixedSlice(&input, &largest) ||
+            level >= ldb::config::kNumLevels) {
+          return ldb::Status::Corruption("MANIFEST", "bad new file");
+        }
+        manifest.files[number] = {static_cast<int>(level), number, size,
+                                  smallest.ToString(), largest.ToString()};
+        break;
+      default:
+        return ldb::Status::Corruption("MANIFEST", "unknown tag");
+    }
+  }
+  if (!input.empty()) {
+    return ldb::Status::Corruption("MANIFEST", "trailing bytes in edit");
+  }
+  return ldb::Status::OK();
+}
+}  // namespace manifest_detail
+
+// Replays the MANIFEST that CURRENT points to, the DB must not be open
+ldb::Status read_manifest(ldb::Env *env, const std::string &dbname,
+                          db_manifest &manifest) {
+  using namespace manifest_detail;
+  std::string current;
+  auto status =
+      ldb::ReadFileToString(env, ldb::CurrentFileName(dbname), &current);
+  if (!status.ok()) {
+    return status;
+  }
+  if (current.empty() || current.back() != '\n') {
+    return ldb::Status::Corruption("CURRENT file does not end with newline");
+  }
+  current.pop_back();
+  uint64_t number;
+  ldb::FileType type;
+  if (!ldb::ParseFileName(current, &number, &type) ||
+      type != ldb::kDescriptorFile) {
+    return ldb::Status::Corruption("CURRENT points to an invalid file",
+                                   current);
+  }
+
+  ldb::SequentialFile *file_ptr;
+  status = env->NewSequentialFile(dbname + "/" + current, &file_ptr);
+  if (!status.ok()) {
+    return status;
+  }
+  auto file = std::unique_ptr<ldb::SequentialFile>(file_ptr);
+
+  manifest = {};
+  manifest.descriptor_number = number;
+  seen_fields seen{};
+  manifest_reporter reporter{};
+  ldb::log::Reader reader(file.get(), &reporter, true, 0);
+  ldb::Slice record;
+  std::string scratch;
+  while (reader.ReadRecord(&record, &scratch) && reporter.status.ok()) {
+    status = apply_edit(manifest, seen, record);
+    if (!status.ok()) {
+      return status;
+    }
+  }
+  if (!reporter.status.ok()) {
+    return reporter.status;
+  }
+  if (!seen.log_number || !seen.next_file || !seen.last_sequence) {
+    return ldb::Status::Corruption("MANIFEST", "missing required fields");
+  }
+  return ldb::Status::OK();
+}
+
+namespace manifest_detail {
+void add_file(ldb::VersionEdit &edit, const table_file &file) {
+  ldb::InternalKey smallest, largest;
+  smallest.DecodeFrom(file.smallest);
+  largest.DecodeFrom(file.largest);
+  edit.AddFile(file.level, file.number, file.size, smallest, largest);
+}
+
+// Edit with the whole version, the first record of a MANIFEST
+std::string snapshot_record(const db_manifest &manifest) {
+  ldb::VersionEdit edit;
+  if (!manifest.comparator.empty()) {
+    edit.SetComparatorName(manifest.comparator);
+  }
+  edit.SetLogNumber(manifest.log_number);
+  edit.SetPrevLogNumber(manifest.prev_log_number);
+  edit.SetNextFile(manifest.next_file);
+  edit.SetLastSequence(manifest.last_sequence);
+  for (const auto &[_, file] : manifest.files) {
+    add_file(edit, file);
+  }
+  std::string record;
+  edit.EncodeTo(&record);
+  return record;
+}
+}  // namespace manifest_detail
+
+// A new MANIFEST that starts with the whole version and then gets the edits
+// made to it, like the descriptor log of VersionSet. CURRENT points to it
+// once it's created, and every edit is synced before it's applied to
+// manifest, so after a crash the DB has the tables of the last edit made.
+class manifest_log {
+ public:
+  UTILS_NOT_COPYABLE(manifest_log)
+  UTILS_NOT_MOVEABLE(manifest_log)
+  manifest_log(ldb::Env *env, const std::string &dbname,
+               db_manifest &manifest)
+      : manifest(manifest) {
+    const auto number = manifest.new_file_number();
+    const auto fname = ldb::DescriptorFileName(dbname, number);
+    ldb::WritableFile *file_ptr;
+    status = env->NewWritableFile(fname, &file_ptr);
+    if (!status.ok()) {
+      return;
+    }
+    file.reset(file_ptr);
+    writer = std::make_unique<ldb::log::Writer>(file.get());
+    status = append(manifest_detail::snapshot_record(manifest));
+    if (status.ok()) {
+      status = ldb::SetCurrentFile(env, dbname, number);
+    }
+    if (!status.ok()) {
+      writer.reset();
+      file.reset();
+      env->DeleteFile(fname);
+      return;
+    }
+    manifest.descriptor_number = number;
+  }
+
+  // Numbers for new tables, taken before the edit that adds them
+  uint64_t new_file_number() {
+    std::unique_lock lock(mutex);
+    return manifest.new_file_number();
+  }
+
+  // Swaps the table number for replacement, which goes to the same level.
+  // Not for level 0, whose tables are ordered by number: the new one would
+  // be taken as newer than the tables overlapping it.
+  ldb::Status replace_file(const uint64_t number, table_file replacement) {
+    std::unique_lock lock(mutex);
+    if (!status.ok()) {
+      return status;
+    }
+    const auto it = manifest.files.find(number);
+    if (it == manifest.files.end()) {
+      return ldb::Status::InvalidArgument("table not in MANIFEST");
+    }
+    if (it->second.level == 0) {
+      return ldb::Status::InvalidArgument(
+          "level 0 tables can't be replaced in place");
+    }
+    replacement.level = it->second.level;
+    ldb::VersionEdit edit;
+    edit.SetNextFile(manifest.next_file);
+    edit.DeleteFile(replacement.level, number);
+    manifest_detail::add_file(edit, replacement);
+    std::string record;
+    edit.EncodeTo(&record);
+    status = append(record);
+    if (!status.ok()) {
+      return status;
+    }
+    manifest.files.erase(it);
+    manifest.files[replacement.number] = std::move(replacement);
+    return status;
+  }
+
+  ldb::Status close() {
+    std::unique_lock lock(mutex);
+    if (status.ok() && file) {
+      status = file->Close();
+    }
+    writer.reset();
+    file.reset();
+    return status;
+  }
+
+  ~manifest_log() { close(); }
+
+  // Once it fails no more edits are made
+  ldb::Status status{};
+
+ private:
+  ldb::Status append(const std::string &record) {
+    auto status = writer->AddRecord(record);
+    if (status.ok()) {
+      status = file->Sync();
+    }
+    return status;
+  }
+
+  db_manifest &manifest;
+  std::unique_ptr<ldb::WritableFile> file{};
+  std::unique_ptr<ldb::log::Writer> writer{};
+  std::mutex mutex{};
+};
+
+// Writes the whole version as a new MANIFEST and points CURRENT to it, the
+// previous MANIFEST is left in place
+ldb::Status write_manifest(ldb::Env *env, const std::string &dbname,
+                           db_manifest &manifest) {
+  manifest_log log(env, dbname, manifest);
+  if (!log.status.ok()) {
+    return log.status;
+  }
+  return log.close();
+}
+
+// Holds the LOCK file of a DB so it can't be opened while its files are
+// being modified
+class db_lock {
+ public:
+  UTILS_NOT_COPYABLE(db_lock)
+  UTILS_NOT_MOVEABLE(db_lock)
+  db_lock(ldb::Env *env, const std::string &dbname)
+      : env(env),
+        status(env->LockFile(ldb::LockFileName(dbname), &lock)) {}
+  ~db_lock() {
+    if (status.ok()) {
+      env->UnlockFile(lock);
+    }
+  }
+
+  ldb::Env *const env;
+  ldb::FileLock *lock = nullptr;
+  const ldb::Status status;
+};
+
+// Deletes the tables, logs and MANIFESTs that the version in manifest doesn't
+// use, the same way DBImpl::DeleteObsoleteFiles does
+ldb::Status remove_obsolete_files(ldb::Env *env, const std::string &dbname,
+                                  const db_manifest &manifest) {
+  std::vector<std::string> filenames;
+  auto status = env->GetChildren(dbname, &filenames);
+  if (!status.ok()) {
+    return status;
+  }
+  for (const auto &filename : filenames) {
+    uint64_t number;
+    ldb::FileType type;
+    if (!ldb::ParseFileName(filename, &number, &type)) {
+      continue;
+    }
+    bool keep = true;
+    switch (type) {
+      case ldb::kLogFile:
+        keep = number >= manifest.log_number ||
+               number == manifest.prev_log_number;
+        break;
+      case ldb::kDescriptorFile:
+        keep = number == manifest.descriptor_number;
+        break;
+      case ldb::kTableFile:
+        keep = manifest.files.count(number) > 0;
+        break;
+      case ldb::kTempFile:
+        keep = false;
+        break;
+      default:
+        break;
+    }
+    if (!keep) {
+      auto delete_status = env->DeleteFile(dbname + "/" + filename);
+      if (status.ok()) {
+        status = delete_status;
+      }
+    }
+  }
+  return status;
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+#include "utils.hpp"
+
+// Splits --memory-limit among what takes most of the memory of a command:
+// block caches, memtables and open tables of each DB, write batches and the
+// queues between copy threads. Each size is capped by its share and kept as
+// it is when it fits, without a limit nothing is capped. Whatever isn't
+// split, like iterators and decompression buffers, lives off the last
+// eighth.
+class memory_budget {
+ public:
+  // Shares of the DBs are split as if two were open, like in copy and diff
+  static constexpr size_t dbs = 2;
+  // Index and filter blocks of a table kept open, tables of 2 MB with
+  // Bedrock's 160 KB blocks need much less
+  static constexpr uint64_t open_table_bytes = 64 << 10;
+
+  // 0 for no limit
+  void set_limit(const uint64_t bytes) { limit_ = bytes; }
+  uint64_t limit() const { return limit_; }
+  bool limited() const { return limit_ != 0; }
+
+  // Block cache of a DB, an eighth of the limit for every DB
+  size_t block_cache(const size_t preferred) const {
+    return cap(preferred, limit_ / 8 / dbs, 1 << 20);
+  }
+
+  // Memtable of a DB, a quarter of the limit for every DB. leveldb can have
+  // two, one being written and the one being flushed.
+  size_t write_buffer(const size_t preferred) const {
+    return cap(preferred, limit_ / 4 / dbs / 2, 1 << 20);
+  }
+
+  // Tables a DB keeps open, an eighth of the limit for every DB. leveldb
+  // raises anything under 74.
+  int open_files(const int preferred) const {
+    return static_cast<int>(
+        cap(preferred, limit_ / 8 / dbs / open_table_bytes, 74));
+  }
+
+  // Write batch filled by each of threads, an eighth of the limit for all of
+  // them
+  size_t write_batch(const size_t preferred, const size_t threads) const {
+    return cap(preferred, limit_ / 8 / std::max<size_t>(threads, 1),
+               64 << 10);
+  }
+
+  // Queue of items of item_bytes used by each of threads, another eighth for
+  // all of them. A depth of 0, no queue, stays that way.
+  size_t queue_depth(const size_t preferred, const size_t item_bytes,
+                     const size_t threads) const {
+    return preferred == 0
+               ? 0
+               : cap(preferred,
+                     limit_ / 8 / std::max<size_t>(threads, 1) / item_bytes,
+                     1);
+  }
+
+  // What DBs have reserved now and at most, see memory_reservation
+  void reserve(const uint64_t bytes) {
+    const auto now = reserved.fetch_add(bytes) + bytes;
+    auto seen = peak.load();
+    while (now > seen && !peak.compare_exchange_weak(seen, now)) {
+    }
+  }
+  void release(const uint64_t bytes) { reserved.fetch_sub(bytes); }
+  uint64_t peak_reserved() const { return peak.load(); }
+
+ private:
+  uint64_t cap(const uint64_t preferred, const uint64_t share,
+               const uint64_t min) const {
+    return limited() ? std::min(preferred, std::max(share, min)) : preferred;
+  }
+
+  uint64_t limit_ = 0;
+  std::atomic<uint64_t> reserved{0};
+  std::atomic<uint64_t> peak{0};
+};
+memory_budget memory{};
+
+// Bytes that memory accounts for until this is destroyed, moved along with
+// whatever holds them
+class memory_reservation {
+ public:
+  UTILS_NOT_COPYABLE(memory_reservation)
+  memory_reservation() = default;
+  explicit memory_reservation(const uint64_t bytes) : bytes(bytes) {
+    memory.reserve(bytes);
+  }
+  memory_reservation(memory_reservation &&other) noexcept
+      : bytes(std::exchange(other.bytes, 0)) {}
+  memory_reservation &operator=(memory_reservation &&other) noexcept {
+    memory.release(bytes);
+    bytes = std::exchange(other.bytes, 0);
+    return *this;
+  }
+  ~memory_reservation() { memory.release(bytes); }
+
+ private:
+  uint64_t bytes = 0;
+};
+
+// Most memory the process had resident so far, in bytes
+uint64_t peak_rss() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+}
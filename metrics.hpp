@@ -0,0 +1,386 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "db_options.hpp"
+#include "hackdb.h"
+#include "leveldb/db.h"
+#include "ranges.hpp"
+#include "utils.hpp"
+
+namespace ldb = leveldb;
+
+// How long running commands report their progress, set from the global
+// --stats-json and --stats-interval flags
+struct progress_settings {
+  // JSON lines instead of text
+  bool json = false;
+  // 0 only reports the end of each phase
+  std::chrono::milliseconds interval{10000};
+  // Off while commands run at the same time, like in batch, as they would
+  // reset and add to the counters of each other
+  bool enabled = true;
+};
+progress_settings progress_config{};
+
+// Updated by every thread doing the work of a command, reset when a phase
+// begins. Bytes are uncompressed key and value sizes.
+struct progress_counters {
+  std::atomic<uint64_t> keys{0};
+  std::atomic<uint64_t> bytes_read{0};
+  std::atomic<uint64_t> bytes_written{0};
+  // Approximate size in tables of the keys that were already processed,
+  // compared to what the phase expects to go through for the ETA
+  std::atomic<uint64_t> covered{0};
+  // Decompression buffers handed out by pooled_decompress_allocator
+  std::atomic<uint64_t> buffers_reused{0};
+  std::atomic<uint64_t> buffers_allocated{0};
+} progress{};
+
+// Approximate size in tables of the keys in [begin, limit)
+uint64_t approximate_size(ldb::DB &db, const ldb::Slice &begin,
+                          const ldb::Slice &limit) {
+  const ldb::Range range(begin, limit);
+  uint64_t size;
+  db.GetApproximateSizes(&range, 1, &size);
+  return size;
+}
+
+uint64_t approximate_size(ldb::DB &db, const key_range &range = {}) {
+  return approximate_size(
+      db, range.begin,
+      range.end ? ldb::Slice(*range.end)
+                : ldb::Slice(ranges_detail::key_space_end));
+}
+
+// Progress of a single thread going through a key range in order, added to
+// the shared counters every few MB so threads don't contend on them
+class range_progress {
+ public:
+  UTILS_NOT_COPYABLE(range_progress)
+  UTILS_NOT_MOVEABLE(range_progress)
+  range_progress(ldb::DB &db, const key_range &range) : db(db), range(range) {}
+
+  void read(const ldb::Slice &key, const ldb::Slice &value) {
+    keys++;
+    bytes_read += key.size() + value.size();
+    if (bytes_read >= publish_bytes) {
+      publish(approximate_size(db, range.begin, key));
+    }
+  }
+
+  void wrote(const size_t bytes) { bytes_written += bytes; }
+
+  // Once every key of the range went through read
+  void finish() { publish(approximate_size(db, range)); }
+
+ private:
+  static constexpr uint64_t publish_bytes = 16 << 20;
+
+  void publish(const uint64_t range_covered) {
+    progress.keys.fetch_add(keys, std::memory_order_relaxed);
+    progress.bytes_read.fetch_add(bytes_read, std::memory_order_relaxed);
+    progress.bytes_written.fetch_add(bytes_written,
+                                     std::memory_order_relaxed);
+    keys = bytes_read = bytes_written = 0;
+    if (range_covered > covered) {
+      progress.covered.fetch_add(range_covered - covered,
+                                 std::memory_order_relaxed);
+      covered = range_covered;
+    }
+  }
+
+  ldb::DB &db;
+  const key_range &range;
+  uint64_t keys = 0;
+  uint64_t bytes_read = 0;
+  uint64_t bytes_written = 0;
+  uint64_t covered = 0;
+};
+
+namespace metrics_detail {
+using clock = std::chrono::steady_clock;
+
+double seconds_since(const clock::time_point start) {
+  return std::chrono::duration<double>(clock::now() - start).count();
+}
+
+std::string json_string(const std::string &value) {
+  std::string quoted = "\"";
+  for (const auto c : value) {
+    if (c == '"' || c == '\\') {
+      quoted += '\\';
+    }
+    quoted += c;
+  }
+  return quoted + "\"";
+}
+
+std::string format_duration(const double seconds) {
+  const auto total = static_cast<uint64_t>(seconds);
+  std::ostringstream out;
+  if (total >= 3600) {
+    out << total / 3600 << "h";
+  }
+  if (total >= 60) {
+    out << total / 60 % 60 << "m";
+  }
+  out << total % 60 << "s";
+  return out.str();
+}
+}  // namespace metrics_detail
+
+// Prints the progress counters of a command every progress_config.interval
+// from its own thread, and a summary with the wall time of each phase when
+// it ends. Reports go to stderr, stdout keeps the messages of the command.
+class progress_reporter {
+ public:
+  UTILS_NOT_COPYABLE(progress_reporter)
+  UTILS_NOT_MOVEABLE(progress_reporter)
+  // blocks, if set, is the counter of the DB being read, its counts are
+  // reported as they grow
+  explicit progress_reporter(std::string command,
+                             hackdb::block_counter *blocks = nullptr)
+      : command(std::move(command)),
+        blocks(blocks),
+        enabled(progress_config.enabled),
+        start(metrics_detail::clock::now()) {
+    if (enabled && progress_config.interval.count() > 0) {
+      reporter = std::thread([this]() { run(); });
+    }
+  }
+
+  // Ends the running phase, expected is the approximate table size of the
+  // keys the new one goes through or 0 when it isn't known
+  void begin_phase(std::string name, const uint64_t expected = 0) {
+    if (!enabled) {
+      return;
+    }
+    std::unique_lock lock(mutex);
+    end_phase();
+    phase = std::move(name);
+    phase_expected = expected;
+    phase_start = last_report = metrics_detail::clock::now();
+    last_bytes_read = 0;
+    for (auto *counter :
+         {&progress.keys, &progress.bytes_read, &progress.bytes_written,
+          &progress.covered, &progress.buffers_reused,
+          &progress.buffers_allocated}) {
+      counter->store(0, std::memory_order_relaxed);
+    }
+  }
+
+  ~progress_reporter() {
+    {
+      std::unique_lock lock(mutex);
+      end_phase();
+      stopped = true;
+      wake.notify_all();
+    }
+    if (reporter.joinable()) {
+      reporter.join();
+    }
+    if (enabled) {
+      print_summary();
+    }
+  }
+
+ private:
+  struct snapshot {
+    uint64_t keys;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t covered;
+    uint64_t buffers_reused;
+    uint64_t buffers_allocated;
+  };
+
+  static snapshot read_counters() {
+    return {progress.keys.load(std::memory_order_relaxed),
+            progress.bytes_read.load(std::memory_order_relaxed),
+            progress.bytes_written.load(std::memory_order_relaxed),
+            progress.covered.load(std::memory_order_relaxed),
+            progress.buffers_reused.load(std::memory_order_relaxed),
+            progress.buffers_allocated.load(std::memory_order_relaxed)};
+  }
+
+  void run() {
+    std::unique_lock lock(mutex);
+    while (!wake.wait_for(lock, progress_config.interval,
+                          [this]() { return stopped; })) {
+      if (!phase.empty()) {
+        report();
+      }
+    }
+  }
+
+  std::vector<std::pair<std::string, uint64_t>> block_counts() {
+    std::vector<std::pair<std::string, uint64_t>> named;
+    if (!blocks) {
+      return named;
+    }
+    const auto counts = blocks->total_counts();
+    for (size_t i = 0; i < counts.size(); i++) {
+      if (counts[i] > 0) {
+        named.emplace_back(compressor_name(i), counts[i]);
+      }
+    }
+    return named;
+  }
+
+  // Called with mutex held
+  void report() {
+    using namespace metrics_detail;
+    const auto counters = read_counters();
+    const auto now = clock::now();
+    const auto elapsed = seconds_since(phase_start);
+    const auto interval =
+        std::chrono::duration<double>(now - last_report).count();
+    const auto rate =
+        interval > 0 ? (counters.bytes_read - last_bytes_read) / interval : 0;
+    last_report = now;
+    last_bytes_read = counters.bytes_read;
+
+    const bool has_eta = phase_expected > 0 && counters.covered > 0;
+    const auto done =
+        has_eta ? std::min(1.0, static_cast<double>(counters.covered) /
+                                    phase_expected)
+                : 0;
+    const auto eta = has_eta ? elapsed / done - elapsed : 0;
+    const auto named_blocks = block_counts();
+
+    std::ostringstream out;
+    if (progress_config.json) {
+      out << "{\"event\":\"progress\",\"command\":" << json_string(command)
+          << ",\"phase\":" << json_string(phase)
+          << ",\"elapsed_s\":" << elapsed << ",\"keys\":" << counters.keys
+          << ",\"bytes_read\":" << counters.bytes_read
+          << ",\"bytes_written\":" << counters.bytes_written
+          << ",\"read_mb_per_s\":" << rate / 1e6
+          << ",\"buffers_reused\":" << counters.buffers_reused
+          << ",\"buffers_allocated\":" << counters.buffers_allocated;
+      if (has_eta) {
+        out << ",\"done\":" << done << ",\"eta_s\":" << eta;
+      }
+      out << ",\"blocks\":{";
+      for (size_t i = 0; i < named_blocks.size(); i++) {
+        out << (i > 0 ? "," : "") << json_string(named_blocks[i].first)
+            << ":" << named_blocks[i].second;
+      }
+      out << "}}";
+    } else {
+      out << std::fixed << std::setprecision(1) << command << " " << phase
+          << ": " << counters.keys << " keys, " << counters.bytes_read / 1e6
+          << " MB read, " << counters.bytes_written / 1e6 << " MB written, "
+          << rate / 1e6 << " MB/s";
+      if (has_eta) {
+        out << ", " << done * 100 << "% done, ETA " << format_duration(eta);
+      }
+      if (counters.buffers_reused > 0) {
+        out << ", " << counters.buffers_reused
+            << " decompression buffer allocations avoided";
+      }
+      for (size_t i = 0; i < named_blocks.size(); i++) {
+        out << (i > 0 ? ", " : ", blocks: ") << named_blocks[i].first << " "
+            << named_blocks[i].second;
+      }
+    }
+    std::cerr << out.str() << std::endl;
+  }
+
+  // Called with mutex held
+  void end_phase() {
+    using namespace metrics_detail;
+    if (phase.empty()) {
+      return;
+    }
+    const auto counters = read_counters();
+    const auto seconds = seconds_since(phase_start);
+    const auto rate = seconds > 0 ? counters.bytes_read / seconds : 0;
+    std::ostringstream out;
+    if (progress_config.json) {
+      out << "{\"event\":\"phase\",\"command\":" << json_string(command)
+          << ",\"phase\":" << json_string(phase) << ",\"seconds\":" << seconds
+          << ",\"keys\":" << counters.keys
+          << ",\"bytes_read\":" << counters.bytes_read
+          << ",\"bytes_written\":" << counters.bytes_written
+          << ",\"read_mb_per_s\":" << rate / 1e6
+          << ",\"buffers_reused\":" << counters.buffers_reused
+          << ",\"buffers_allocated\":" << counters.buffers_allocated << "}";
+    } else {
+      out << std::fixed << std::setprecision(1) << command << " " << phase
+          << ": finished in " << format_duration(seconds) << ", "
+          << counters.keys << " keys, " << counters.bytes_read / 1e6
+          << " MB read, " << counters.bytes_written / 1e6 << " MB written, "
+          << rate / 1e6 << " MB/s";
+      if (counters.buffers_reused > 0) {
+        out << ", " << counters.buffers_reused
+            << " decompression buffer allocations avoided";
+      }
+    }
+    std::cerr << out.str() << std::endl;
+    phases.emplace_back(std::move(phase), seconds);
+    phase.clear();
+  }
+
+  void print_summary() {
+    using namespace metrics_detail;
+    const auto named_blocks = block_counts();
+    std::ostringstream out;
+    if (progress_config.json) {
+      out << "{\"event\":\"done\",\"command\":" << json_string(command)
+          << ",\"seconds\":" << seconds_since(start) << ",\"phases\":{";
+      for (size_t i = 0; i < phases.size(); i++) {
+        out << (i > 0 ? "," : "") << json_string(phases[i].first) << ":"
+            << phases[i].second;
+      }
+      out << "},\"blocks\":{";
+      for (size_t i = 0; i < named_blocks.size(); i++) {
+        out << (i > 0 ? "," : "") << json_string(named_blocks[i].first)
+            << ":" << named_blocks[i].second;
+      }
+      out << "},\"peak_rss_bytes\":" << peak_rss() << "}";
+    } else {
+      out << std::fixed << std::setprecision(1) << command << ": took "
+          << format_duration(seconds_since(start));
+      for (size_t i = 0; i < phases.size(); i++) {
+        out << (i > 0 ? ", " : " (") << phases[i].first << " "
+            << format_duration(phases[i].second);
+      }
+      out << (phases.empty() ? "" : ")");
+      for (size_t i = 0; i < named_blocks.size(); i++) {
+        out << (i > 0 ? ", " : ", blocks read: ") << named_blocks[i].first
+            << " " << named_blocks[i].second;
+      }
+      out << ", peak memory " << peak_rss() / double(1 << 20) << " MB";
+    }
+    std::cerr << out.str() << std::endl;
+  }
+
+  const std::string command;
+  hackdb::block_counter *const blocks;
+  const bool enabled;
+  const metrics_detail::clock::time_point start;
+  std::mutex mutex;
+  std::condition_variable wake;
+  bool stopped = false;
+  std::string phase{};
+  uint64_t phase_expected = 0;
+  metrics_detail::clock::time_point phase_start{};
+  metrics_detail::clock::time_point last_report{};
+  uint64_t last_bytes_read = 0;
+  std::vector<std::pair<std::string, double>> phases{};
+  std::thread reporter{};
+};
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <utility>
+
+#include "leveldb/env.h"
+#include "leveldb/slice.h"
+#include "readahead_env.hpp"
+#include "utils.hpp"
+
+namespace ldb = leveldb;
+
+// A table file mapped as a whole. Reads return slices into the mapping, so
+// scratch is never used and uncompressed blocks are never copied.
+class mmap_random_access_file : public ldb::RandomAccessFile {
+ public:
+  UTILS_NOT_COPYABLE(mmap_random_access_file)
+  UTILS_NOT_MOVEABLE(mmap_random_access_file)
+  mmap_random_access_file(std::string fname, const char *base,
+                          const uint64_t size)
+      : fname(std::move(fname)), base(base), size(size), readahead(size) {}
+
+  ~mmap_random_access_file() {
+    munmap(const_cast<char *>(base), size);
+  }
+
+  ldb::Status Read(const uint64_t offset, size_t n, ldb::Slice *result,
+                   char *) const override {
+    if (offset > size) {
+      *result = ldb::Slice();
+      return ldb::Status::IOError(fname, "read past the end of the file");
+    }
+    n = std::min<uint64_t>(n, size - offset);
+    advise_ahead(offset + n);
+    *result = ldb::Slice(base + offset, n);
+    return ldb::Status::OK();
+  }
+
+ private:
+  void advise_ahead(const uint64_t end) const {
+    const auto [from, to] = readahead.next(end);
+    if (from < to) {
+      madvise(const_cast<char *>(base) + from, to - from, MADV_WILLNEED);
+    }
+  }
+
+  const std::string fname;
+  const char *const base;
+  const uint64_t size;
+  mutable readahead_tracker readahead;
+};
+
+// Env for DBs that are only read. Tables are memory mapped and closed right
+// away, so keeping every table of a big world open costs no descriptors.
+// Everything else, including the files DB::Open writes and tables that can't
+// be mapped, goes to target.
+class mmap_read_env : public ldb::EnvWrapper {
+ public:
+  explicit mmap_read_env(ldb::Env *target) : ldb::EnvWrapper(target) {}
+
+  ldb::Status NewRandomAccessFile(const std::string &fname,
+                                  ldb::RandomAccessFile **result) override {
+    const int fd = open(fname.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      // Let the target report the error
+      return target()->NewRandomAccessFile(fname, result);
+    }
+    struct stat st;
+    void *base = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      base = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (base == MAP_FAILED) {
+      return target()->NewRandomAccessFile(fname, result);
+    }
+    // Blocks are read in order by iterators, pages behind them can go
+    madvise(base, st.st_size, MADV_SEQUENTIAL);
+    *result = new mmap_random_access_file(fname, static_cast<char *>(base),
+                                          st.st_size);
+    return ldb::Status::OK();
+  }
+};
+
+// Lives as long as the process, same as Env::Default
+ldb::Env *get_mmap_read_env() {
+  static auto *env = new mmap_read_env(get_readahead_env());
+  return env;
+}
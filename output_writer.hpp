@@ -0,0 +1,288 @@
+#pragma once
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "utils.hpp"
+
+namespace output_detail {
+struct free_deleter {
+  void operator()(char *p) const { std::free(p); }
+};
+using page_buffer = std::unique_ptr<char, free_deleter>;
+
+size_t page_size() {
+  static const size_t size = sysconf(_SC_PAGESIZE);
+  return size;
+}
+
+page_buffer allocate_pages(const size_t size) {
+  return page_buffer(static_cast<char *>(std::aligned_alloc(
+      page_size(), (size + page_size() - 1) / page_size() * page_size())));
+}
+}  // namespace output_detail
+
+// Collects output in large buffers that are written with a single syscall
+// once full. When the output is a pipe, buffers are handed to it with
+// vmsplice so the kernel references their pages instead of copying them.
+// When it is a regular file, space is preallocated ahead of the writes.
+class output_writer {
+ public:
+  UTILS_NOT_COPYABLE(output_writer)
+  UTILS_NOT_MOVEABLE(output_writer)
+  // fd is not closed, capacity is the size of each buffer
+  explicit output_writer(const int fd, const size_t capacity = 1 << 20)
+      : fd(fd) {
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+      is_pipe = S_ISFIFO(st.st_mode);
+      is_file = S_ISREG(st.st_mode);
+      if (is_file) {
+        const auto offset = lseek(fd, 0, SEEK_CUR);
+        position = offset < 0 ? 0 : offset;
+        allocated = position;
+      }
+    }
+    size = capacity;
+#ifdef __linux__
+    if (is_pipe) {
+      // A page handed to vmsplice can only be reused once the reader has
+      // consumed it, which is guaranteed for a buffer once a whole other
+      // buffer at least as big as the pipe went in after it
+      fcntl(fd, F_SETPIPE_SZ, static_cast<int>(capacity));
+      const auto pipe_size = fcntl(fd, F_GETPIPE_SZ);
+      if (pipe_size > 0) {
+        size = std::max(size, static_cast<size_t>(pipe_size));
+      }
+    }
+#endif
+    size = (size + output_detail::page_size() - 1) /
+           output_detail::page_size() * output_detail::page_size();
+    for (auto &buffer : buffers) {
+      buffer = output_detail::allocate_pages(size);
+    }
+  }
+
+  // errno of the first write that failed, 0 if none did
+  int error = 0;
+
+  void append(const char *data, size_t length) {
+    while (length > 0 && error == 0) {
+      const auto n = std::min(length, size - used);
+      std::memcpy(buffers[current].get() + used, data, n);
+      used += n;
+      data += n;
+      length -= n;
+      if (used == size) {
+        write_buffer();
+      }
+    }
+  }
+  void append(const std::string_view data) {
+    append(data.data(), data.size());
+  }
+
+  // Writes out what is buffered, after this the buffers can be released
+  [[nodiscard]] bool finish() {
+    if (error == 0 && used > 0) {
+      // A buffer that isn't full can't be vmspliced safely, its pages could
+      // be released before the reader gets to them
+      write_all(buffers[current].get(), used);
+      used = 0;
+    }
+    wait_for_reader();
+    if (error == 0 && is_file && allocated > position) {
+      // Give back what was preallocated past the end
+      if (ftruncate(fd, position) != 0) {
+        error = errno;
+      }
+    }
+    return error == 0;
+  }
+
+  ~output_writer() { wait_for_reader(); }
+
+ private:
+  static constexpr size_t preallocate_step = 64 << 20;
+
+  void write_buffer() {
+    const char *data = buffers[current].get();
+#ifdef __linux__
+    if (is_pipe && use_vmsplice) {
+      if (splice_all(data, used)) {
+        spliced = true;
+        current = (current + 1) % std::size(buffers);
+        used = 0;
+        return;
+      }
+      if (error != 0) {
+        return;
+      }
+      // Not supported for this pipe, nothing was written
+      use_vmsplice = false;
+    }
+#endif
+    write_all(data, used);
+    used = 0;
+  }
+
+#ifdef __linux__
+  bool splice_all(const char *data, size_t length) {
+    bool any_written = false;
+    while (length > 0) {
+      iovec iov{const_cast<char *>(data), length};
+      const auto written = vmsplice(fd, &iov, 1, 0);
+      if (written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        if (!any_written && (errno == EINVAL || errno == ENOSYS)) {
+          return false;
+        }
+        error = errno;
+        return false;
+      }
+      any_written = true;
+      data += written;
+      length -= written;
+    }
+    return true;
+  }
+#endif
+
+  void write_all(const char *data, size_t length) {
+    preallocate(length);
+    while (length > 0 && error == 0) {
+      const auto written = write(fd, data, length);
+      if (written < 0) {
+        if (errno != EINTR) {
+          error = errno;
+        }
+        continue;
+      }
+      data += written;
+      length -= written;
+      position += written;
+    }
+  }
+
+  // Reserves space in steps so a big output isn't grown one write at a time
+  void preallocate(const size_t length) {
+#ifdef __linux__
+    if (!is_file || !can_preallocate || position + length <= allocated) {
+      return;
+    }
+    const auto end = position + length + preallocate_step;
+    if (fallocate(fd, FALLOC_FL_KEEP_SIZE, allocated, end - allocated) == 0) {
+      allocated = end;
+    } else {
+      // Not supported by the filesystem, don't try again
+      can_preallocate = false;
+    }
+#endif
+  }
+
+  // vmspliced pages must stay untouched until the reader consumes them, so
+  // the buffers aren't released while the pipe has data in it
+  void wait_for_reader() {
+    if (!spliced) {
+      return;
+    }
+    int unread;
+    while (ioctl(fd, FIONREAD, &unread) == 0 && unread > 0) {
+      // Once the reader is gone the pages are never going to be read
+      pollfd pfd{fd, POLLOUT, 0};
+      if (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLERR)) {
+        break;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    spliced = false;
+  }
+
+  const int fd;
+  bool is_pipe = false;
+  bool is_file = false;
+  bool can_preallocate = true;
+  bool use_vmsplice = true;
+  bool spliced = false;
+  size_t size;
+  output_detail::page_buffer buffers[2];
+  size_t current = 0;
+  size_t used = 0;
+  uint64_t position = 0;
+  uint64_t allocated = 0;
+};
+
+// Writes parts made by several threads to output in the order of their
+// numbers, each one as soon as the ones before it are. Part i can only be
+// started once part i - window was written, so at most window parts are held
+// in memory.
+class ordered_writer {
+ public:
+  UTILS_NOT_COPYABLE(ordered_writer)
+  UTILS_NOT_MOVEABLE(ordered_writer)
+  ordered_writer(output_writer &output, const size_t parts,
+                 const size_t window)
+      : output(output), parts(parts), window(std::max<size_t>(window, 1)) {}
+
+  // Waits until part can be started, false if writing was cancelled
+  [[nodiscard]] bool wait_turn(const size_t part) {
+    std::unique_lock lock(mutex);
+    written_cv.wait(lock,
+                    [&]() { return cancelled || part < written + window; });
+    return !cancelled;
+  }
+
+  // Writes part and the ones after it that were waiting for it
+  void submit(const size_t part, std::string &&data) {
+    std::unique_lock lock(mutex);
+    if (cancelled) {
+      return;
+    }
+    parts[part] = std::move(data);
+    while (written < parts.size() && parts[written]) {
+      output.append(*parts[written]);
+      parts[written].reset();
+      written++;
+    }
+    if (output.error != 0) {
+      cancelled = true;
+    }
+    written_cv.notify_all();
+  }
+
+  // Parts submitted after this are dropped
+  void cancel() {
+    std::unique_lock lock(mutex);
+    cancelled = true;
+    written_cv.notify_all();
+  }
+
+ private:
+  output_writer &output;
+  std::vector<std::optional<std::string>> parts;
+  const size_t window;
+  std::mutex mutex{};
+  std::condition_variable written_cv{};
+  size_t written = 0;
+  bool cancelled = false;
+};
@@ -0,0 +1,211 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "leveldb/env.h"
+#include "leveldb/slice.h"
+#include "utils.hpp"
+
+namespace ldb = leveldb;
+
+// Depths of the queues between the stages of a copy, a depth of 0 runs both
+// sides of it on the same thread
+struct pipeline_options {
+  // Chunks of key/value pairs between the iterator and the encoding stage
+  size_t read_queue = 8;
+  // Write batches or table file buffers between encoding and writing
+  size_t write_queue = 4;
+};
+
+// Queue between two threads, push blocks while it's full and pop while it's
+// empty. Once closed pushing fails and pop returns what is left.
+template <typename T>
+class bounded_queue {
+ public:
+  UTILS_NOT_COPYABLE(bounded_queue)
+  UTILS_NOT_MOVEABLE(bounded_queue)
+  explicit bounded_queue(const size_t capacity)
+      : capacity(std::max<size_t>(capacity, 1)) {}
+
+  [[nodiscard]] bool push(T &&item) {
+    std::unique_lock lock(mutex);
+    not_full.wait(lock, [&]() { return closed || items.size() < capacity; });
+    if (closed) {
+      return false;
+    }
+    items.push_back(std::move(item));
+    not_empty.notify_one();
+    return true;
+  }
+
+  std::optional<T> pop() {
+    std::unique_lock lock(mutex);
+    not_empty.wait(lock, [&]() { return closed || !items.empty(); });
+    if (items.empty()) {
+      return {};
+    }
+    auto item = std::move(items.front());
+    items.pop_front();
+    not_full.notify_one();
+    return item;
+  }
+
+  void close() {
+    std::unique_lock lock(mutex);
+    closed = true;
+    not_empty.notify_all();
+    not_full.notify_all();
+  }
+
+ private:
+  const size_t capacity;
+  std::mutex mutex;
+  std::condition_variable not_empty;
+  std::condition_variable not_full;
+  std::deque<T> items{};
+  bool closed = false;
+};
+
+// Key/value pairs copied out of an iterator, stored back to back so that
+// handing them to another thread is a single allocation
+class kv_chunk {
+ public:
+  UTILS_DEFAULT_MOVE(kv_chunk)
+  UTILS_NOT_COPYABLE(kv_chunk)
+  kv_chunk() = default;
+
+  void add(const ldb::Slice &key, const ldb::Slice &value) {
+    data.append(key.data(), key.size());
+    data.append(value.data(), value.size());
+    sizes.emplace_back(key.size(), value.size());
+  }
+
+  size_t bytes() const { return data.size(); }
+  bool empty() const { return sizes.empty(); }
+
+  // Calls func(key, value) for every pair until it returns false
+  template <typename Func>
+  bool for_each(Func &&func) const {
+    const char *p = data.data();
+    for (const auto &[key_size, value_size] : sizes) {
+      if (!func(ldb::Slice(p, key_size),
+                ldb::Slice(p + key_size, value_size))) {
+        return false;
+      }
+      p += key_size + value_size;
+    }
+    return true;
+  }
+
+ private:
+  std::string data{};
+  std::vector<std::pair<size_t, size_t>> sizes{};
+};
+
+// Hands appended data to a thread that writes it to the wrapped file, so the
+// thread building a table keeps compressing while the previous blocks are
+// written. Sync and Close wait for everything queued before them.
+class queued_writable_file : public ldb::WritableFile {
+ public:
+  UTILS_NOT_COPYABLE(queued_writable_file)
+  UTILS_NOT_MOVEABLE(queued_writable_file)
+  queued_writable_file(std::unique_ptr<ldb::WritableFile> &&file,
+                       const size_t depth)
+      : file(std::move(file)), queue(depth), writer([this]() { write(); }) {}
+
+  ldb::Status Append(const ldb::Slice &data) override {
+    pending.append(data.data(), data.size());
+    if (pending.size() >= buffer_size) {
+      return push_pending();
+    }
+    return get_error();
+  }
+
+  ldb::Status Flush() override { return push_pending(); }
+
+  ldb::Status Sync() override {
+    auto status = drain();
+    return status.ok() ? file->Sync() : status;
+  }
+
+  ldb::Status Close() override {
+    auto status = drain();
+    stop();
+    return status.ok() ? file->Close() : status;
+  }
+
+  ~queued_writable_file() { stop(); }
+
+ private:
+  static constexpr size_t buffer_size = 1 << 20;
+
+  ldb::Status get_error() {
+    std::unique_lock lock(mutex);
+    return error;
+  }
+
+  ldb::Status push_pending() {
+    if (!pending.empty()) {
+      {
+        std::unique_lock lock(mutex);
+        queued++;
+      }
+      if (!queue.push(std::move(pending))) {
+        std::unique_lock lock(mutex);
+        queued--;
+        return ldb::Status::IOError("file writer stopped");
+      }
+      pending = {};
+    }
+    return get_error();
+  }
+
+  ldb::Status drain() {
+    auto status = push_pending();
+    std::unique_lock lock(mutex);
+    written_cv.wait(lock, [&]() { return written == queued; });
+    return status.ok() ? error : status;
+  }
+
+  void stop() {
+    queue.close();
+    if (writer.joinable()) {
+      writer.join();
+    }
+  }
+
+  void write() {
+    while (auto buffer = queue.pop()) {
+      auto status = get_error();
+      if (status.ok()) {
+        status = file->Append(*buffer);
+      }
+      std::unique_lock lock(mutex);
+      if (error.ok()) {
+        error = status;
+      }
+      written++;
+      written_cv.notify_all();
+    }
+  }
+
+  std::unique_ptr<ldb::WritableFile> file;
+  std::string pending{};
+  std::mutex mutex;
+  std::condition_variable written_cv;
+  size_t queued = 0;
+  size_t written = 0;
+  ldb::Status error{};
+  bounded_queue<std::string> queue;
+  std::thread writer;
+};
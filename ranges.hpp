@@ -0,0 +1,152 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "leveldb/db.h"
+
+namespace ldb = leveldb;
+
+// Half open range of user keys, an empty begin is the start of the key space
+// and a missing end is the end of it
+struct key_range {
+  std::string begin{};
+  std::optional<std::string> end{};
+
+  bool before_end(const ldb::Slice &key) const {
+    return !end || key.compare(*end) < 0;
+  }
+  bool contains(const ldb::Slice &key) const {
+    return key.compare(begin) >= 0 && before_end(key);
+  }
+};
+
+namespace ranges_detail {
+// Keys in [begin, next bucket's begin), all of them starting with prefix
+// except for the first bucket which also holds the empty key
+struct bucket {
+  std::string begin;
+  std::string prefix;
+  uint64_t size;
+};
+
+// GetApproximateSizes wants a limit for every range, keys past this one are
+// not accounted for
+const std::string key_space_end(64, '\xff');
+
+void measure(ldb::DB &db, std::vector<bucket> &buckets) {
+  std::vector<ldb::Range> ranges;
+  ranges.reserve(buckets.size());
+  for (size_t i = 0; i < buckets.size(); i++) {
+    ranges.emplace_back(buckets[i].begin, i + 1 < buckets.size()
+                                              ? buckets[i + 1].begin
+                                              : key_space_end);
+  }
+  std::vector<uint64_t> sizes(ranges.size());
+  db.GetApproximateSizes(ranges.data(), ranges.size(), sizes.data());
+  for (size_t i = 0; i < buckets.size(); i++) {
+    buckets[i].size = sizes[i];
+  }
+}
+
+// Buckets bigger than max_size are split in 256 by appending a byte to their
+// prefix, the first child keeps the parent's begin so no keys are lost
+std::vector<bucket> refine(const std::vector<bucket> &buckets,
+                           const uint64_t max_size,
+                           const size_t max_prefix_len) {
+  std::vector<bucket> refined;
+  for (const auto &parent : buckets) {
+    if (parent.size <= max_size || parent.prefix.size() >= max_prefix_len) {
+      refined.push_back(parent);
+      continue;
+    }
+    refined.push_back({parent.begin, parent.prefix + '\0', 0});
+    for (int byte = 1; byte < 256; byte++) {
+      auto prefix = parent.prefix + static_cast<char>(byte);
+      refined.push_back({prefix, prefix, 0});
+    }
+  }
+  return refined;
+}
+}  // namespace ranges_detail
+
+// Splits the key space of db in up to n ranges of roughly the same on-disk
+// size, boundaries are taken from byte prefixes that get longer where the
+// data is denser. Data that is still in the memtable is not accounted for.
+std::vector<key_range> split_key_space(ldb::DB &db, const size_t n,
+                                       const size_t max_prefix_len = 3) {
+  using namespace ranges_detail;
+  if (n <= 1) {
+    return {key_range{}};
+  }
+
+  std::vector<bucket> buckets{{"", std::string(1, '\0'), 0}};
+  for (int byte = 1; byte < 256; byte++) {
+    auto prefix = std::string(1, static_cast<char>(byte));
+    buckets.push_back({prefix, prefix, 0});
+  }
+  measure(db, buckets);
+
+  uint64_t total = 0;
+  for (const auto &bucket : buckets) total += bucket.size;
+  if (total == 0) {
+    return {key_range{}};
+  }
+  const uint64_t target = total / n;
+  for (size_t prefix_len = 2; prefix_len <= max_prefix_len; prefix_len++) {
+    const auto previous_count = buckets.size();
+    buckets = refine(buckets, target / 4, prefix_len);
+    if (buckets.size() == previous_count) {
+      break;
+    }
+    measure(db, buckets);
+  }
+
+  std::vector<key_range> ranges{key_range{}};
+  uint64_t accumulated = 0;
+  for (const auto &bucket : buckets) {
+    if (ranges.size() < n && accumulated >= target * ranges.size() &&
+        !bucket.begin.empty()) {
+      ranges.back().end = bucket.begin;
+      ranges.push_back({bucket.begin, {}});
+    }
+    accumulated += bucket.size;
+  }
+  return ranges;
+}
+
+// Runs func(i) for every i in [0, tasks) using up to jobs threads, tasks are
+// handed out in order
+template <typename Func>
+void run_parallel(const size_t jobs, const size_t tasks, Func &&func) {
+  if (jobs <= 1 || tasks <= 1) {
+    for (size_t i = 0; i < tasks; i++) {
+      func(i);
+    }
+    return;
+  }
+  std::atomic<size_t> next_task{0};
+  auto worker = [&]() {
+    for (size_t i = next_task++; i < tasks; i = next_task++) {
+      func(i);
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < std::min(jobs, tasks); i++) {
+    threads.emplace_back(worker);
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+size_t resolve_jobs(const size_t jobs) {
+  if (jobs != 0) {
+    return jobs;
+  }
+  return std::max(1u, std::thread::hardware_concurrency());
+}
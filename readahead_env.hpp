@@ -0,0 +1,140 @@
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <utility>
+
+#include "leveldb/env.h"
+#include "leveldb/slice.h"
+#include "utils.hpp"
+
+namespace ldb = leveldb;
+
+namespace readahead_detail {
+// How far ahead of the reads the kernel is asked to have pages ready
+constexpr uint64_t window = 4 << 20;
+
+uint64_t page_floor(const uint64_t offset) {
+  static const uint64_t page = sysconf(_SC_PAGESIZE);
+  return offset / page * page;
+}
+}  // namespace readahead_detail
+
+// Follows the reads of a file that is read from start to end. When they get
+// within half a window of the pages already requested, the next window is
+// handed out to be requested. Reads far from it, like the footer and index
+// at the end of a table, don't move it.
+class readahead_tracker {
+ public:
+  explicit readahead_tracker(const uint64_t size) : size(size) {}
+
+  // Pages to request after a read that ended at end, from == to when there
+  // are none. Concurrent reads get each window once.
+  std::pair<uint64_t, uint64_t> next(const uint64_t end) {
+    using namespace readahead_detail;
+    auto advised = advised_end.load(std::memory_order_relaxed);
+    if (advised >= size || end + window / 2 < advised ||
+        end > advised + window) {
+      return {0, 0};
+    }
+    const auto from = page_floor(std::max(advised, end));
+    const auto to = std::min(size, from + window);
+    if (!advised_end.compare_exchange_strong(advised, to,
+                                             std::memory_order_relaxed)) {
+      return {0, 0};
+    }
+    return {from, to};
+  }
+
+ private:
+  const uint64_t size;
+  std::atomic<uint64_t> advised_end{0};
+};
+
+// Reads with pread and asks the kernel to read ahead of them, so the next
+// blocks are on their way while the current ones are decoded
+class readahead_random_access_file : public ldb::RandomAccessFile {
+ public:
+  UTILS_NOT_COPYABLE(readahead_random_access_file)
+  UTILS_NOT_MOVEABLE(readahead_random_access_file)
+  readahead_random_access_file(std::string fname, const int fd,
+                               const uint64_t size)
+      : fname(std::move(fname)), fd(fd), readahead(size) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    // Tables are opened when an iterator gets to them, by then the first
+    // blocks are about to be read
+    advise(0);
+  }
+
+  ~readahead_random_access_file() { close(fd); }
+
+  ldb::Status Read(const uint64_t offset, const size_t n, ldb::Slice *result,
+                   char *scratch) const override {
+    size_t done = 0;
+    while (done < n) {
+      const auto r = pread(fd, scratch + done, n - done, offset + done);
+      if (r < 0 && errno == EINTR) {
+        continue;
+      }
+      if (r < 0) {
+        *result = ldb::Slice(scratch, 0);
+        return ldb::Status::IOError(fname, std::strerror(errno));
+      }
+      if (r == 0) {
+        break;
+      }
+      done += r;
+    }
+    *result = ldb::Slice(scratch, done);
+    advise(offset + done);
+    return ldb::Status::OK();
+  }
+
+ private:
+  void advise(const uint64_t end) const {
+    const auto [from, to] = readahead.next(end);
+    if (from < to) {
+      posix_fadvise(fd, from, to - from, POSIX_FADV_WILLNEED);
+    }
+  }
+
+  const std::string fname;
+  const int fd;
+  mutable readahead_tracker readahead;
+};
+
+// Env for DBs that are scanned from start to end. Tables are read through
+// readahead_random_access_file, everything else goes to target.
+class readahead_env : public ldb::EnvWrapper {
+ public:
+  explicit readahead_env(ldb::Env *target) : ldb::EnvWrapper(target) {}
+
+  ldb::Status NewRandomAccessFile(const std::string &fname,
+                                  ldb::RandomAccessFile **result) override {
+    const int fd = open(fname.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      // Let the target report the error
+      return target()->NewRandomAccessFile(fname, result);
+    }
+    const auto size = lseek(fd, 0, SEEK_END);
+    if (size < 0) {
+      close(fd);
+      return target()->NewRandomAccessFile(fname, result);
+    }
+    *result = new readahead_random_access_file(fname, fd, size);
+    return ldb::Status::OK();
+  }
+};
+
+// Lives as long as the process, same as Env::Default
+ldb::Env *get_readahead_env() {
+  static auto *env = new readahead_env(ldb::Env::Default());
+  return env;
+}
@@ -0,0 +1,547 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "db/dbformat.h"
+#include "db/filename.h"
+#include "db/log_reader.h"
+#include "db/write_batch_internal.h"
+#include "db_options.hpp"
+#include "leveldb/db.h"
+#include "leveldb/env.h"
+#include "leveldb/iterator.h"
+#include "leveldb/options.h"
+#include "leveldb/write_batch.h"
+#include "manifest.hpp"
+#include "table/merger.h"
+#include "table/two_level_iterator.h"
+#include "tables.hpp"
+#include "util/coding.h"
+#include "utils.hpp"
+
+namespace ldb = leveldb;
+
+namespace readonly_detail {
+// Entries from the logs, with internal keys
+using log_entries = std::vector<std::pair<std::string, std::string>>;
+
+class log_inserter : public ldb::WriteBatch::Handler {
+ public:
+  explicit log_inserter(log_entries &entries) : entries(entries) {}
+
+  void Put(const ldb::Slice &key, const ldb::Slice &value) override {
+    add(key, ldb::kTypeValue, value);
+  }
+  void Delete(const ldb::Slice &key) override {
+    add(key, ldb::kTypeDeletion, {});
+  }
+
+  ldb::SequenceNumber sequence = 0;
+
+ private:
+  void add(const ldb::Slice &key, const ldb::ValueType type,
+           const ldb::Slice &value) {
+    auto &[internal_key, entry_value] = entries.emplace_back();
+    ldb::AppendInternalKey(&internal_key, {key, sequence++, type});
+    entry_value.assign(value.data(), value.size());
+  }
+
+  log_entries &entries;
+};
+
+// Iterates over sorted entries, what a MemTable would be for them
+class entries_iterator : public ldb::Iterator {
+ public:
+  entries_iterator(const ldb::Comparator &comparator,
+                   const log_entries &entries)
+      : comparator(comparator), entries(entries), pos(entries.size()) {}
+
+  bool Valid() const override { return pos < entries.size(); }
+  void SeekToFirst() override { pos = 0; }
+  void SeekToLast() override {
+    pos = entries.empty() ? entries.size() : entries.size() - 1;
+  }
+  void Seek(const ldb::Slice &target) override {
+    pos = std::lower_bound(entries.begin(), entries.end(), target,
+                           [&](const auto &entry, const ldb::Slice &key) {
+                             return comparator.Compare(entry.first, key) < 0;
+                           }) -
+          entries.begin();
+  }
+  void Next() override { pos++; }
+  void Prev() override { pos = pos == 0 ? entries.size() : pos - 1; }
+  ldb::Slice key() const override { return entries[pos].first; }
+  ldb::Slice value() const override { return entries[pos].second; }
+  ldb::Status status() const override { return ldb::Status::OK(); }
+
+ private:
+  const ldb::Comparator &comparator;
+  const log_entries &entries;
+  size_t pos;
+};
+
+struct level_table {
+  table_file file;
+  open_table table;
+};
+using level_tables = std::vector<const level_table *>;
+
+// Over the tables of a level past 0, sorted and not overlapping. Keys are
+// the largest key of each table and values their index, like the iterator
+// Version uses for its levels.
+class level_iterator : public ldb::Iterator {
+ public:
+  level_iterator(const ldb::Comparator &comparator, const level_tables &tables)
+      : comparator(comparator), tables(tables), pos(tables.size()) {}
+
+  bool Valid() const override { return pos < tables.size(); }
+  void SeekToFirst() override { pos = 0; }
+  void SeekToLast() override {
+    pos = tables.empty() ? tables.size() : tables.size() - 1;
+  }
+  void Seek(const ldb::Slice &target) override {
+    pos = std::lower_bound(tables.begin(), tables.end(), target,
+                           [&](const level_table *table,
+                               const ldb::Slice &key) {
+                             return comparator.Compare(table->file.largest,
+                                                       key) < 0;
+                           }) -
+          tables.begin();
+  }
+  void Next() override { pos++; }
+  void Prev() override { pos = pos == 0 ? tables.size() : pos - 1; }
+  ldb::Slice key() const override { return tables[pos]->file.largest; }
+  ldb::Slice value() const override {
+    ldb::EncodeFixed64(value_buf, pos);
+    return {value_buf, sizeof(value_buf)};
+  }
+  ldb::Status status() const override { return ldb::Status::OK(); }
+
+  static ldb::Iterator *open_table(void *arg, const ldb::ReadOptions &ropts,
+                                   const ldb::Slice &value) {
+    const auto &tables = *static_cast<const level_tables *>(arg);
+    return tables[ldb::DecodeFixed64(value.data())]->table.table->NewIterator(
+        ropts);
+  }
+
+ private:
+  const ldb::Comparator &comparator;
+  const level_tables &tables;
+  size_t pos;
+  mutable char value_buf[8];
+};
+
+// Turns internal keys into the newest value of each user key, skipping
+// deleted ones. The same as DBIter without snapshots, as nothing newer
+// than what was there when the DB was opened can show up.
+class user_key_iterator : public ldb::Iterator {
+ public:
+  UTILS_NOT_COPYABLE(user_key_iterator)
+  UTILS_NOT_MOVEABLE(user_key_iterator)
+  user_key_iterator(const ldb::Comparator &user_comparator,
+                    ldb::Iterator *internal)
+      : user_comparator(user_comparator), iter(internal) {}
+
+  bool Valid() const override { return valid; }
+  ldb::Slice key() const override {
+    return reverse ? ldb::Slice(saved_key) : ldb::ExtractUserKey(iter->key());
+  }
+  ldb::Slice value() const override {
+    return reverse ? ldb::Slice(saved_value) : iter->value();
+  }
+  ldb::Status status() const override {
+    return error.ok() ? iter->status() : error;
+  }
+
+  void Next() override {
+    if (reverse) {
+      // iter is just before the entries of key(), which saved_key has
+      reverse = false;
+      if (iter->Valid()) {
+        iter->Next();
+      } else {
+        iter->SeekToFirst();
+      }
+    } else {
+      save_key(ldb::ExtractUserKey(iter->key()));
+      iter->Next();
+    }
+    if (!iter->Valid()) {
+      valid = false;
+      saved_key.clear();
+      return;
+    }
+    find_next_user_entry(true);
+  }
+
+  void Prev() override {
+    if (!reverse) {
+      save_key(ldb::ExtractUserKey(iter->key()));
+      do {
+        iter->Prev();
+      } while (iter->Valid() &&
+               user_comparator.Compare(ldb::ExtractUserKey(iter->key()),
+                                       saved_key) >= 0);
+      if (!iter->Valid()) {
+        valid = false;
+        saved_key.clear();
+        saved_value.clear();
+        return;
+      }
+      reverse = true;
+    }
+    find_prev_user_entry();
+  }
+
+  void Seek(const ldb::Slice &target) override {
+    reverse = false;
+    saved_key.clear();
+    ldb::AppendInternalKey(&saved_key, {target, ldb::kMaxSequenceNumber,
+                                        ldb::kValueTypeForSeek});
+    iter->Seek(saved_key);
+    valid = iter->Valid();
+    if (valid) {
+      find_next_user_entry(false);
+    }
+  }
+
+  void SeekToFirst() override {
+    reverse = false;
+    saved_value.clear();
+    iter->SeekToFirst();
+    valid = iter->Valid();
+    if (valid) {
+      find_next_user_entry(false);
+    }
+  }
+
+  void SeekToLast() override {
+    reverse = true;
+    saved_value.clear();
+    iter->SeekToLast();
+    find_prev_user_entry();
+  }
+
+ private:
+  void save_key(const ldb::Slice &key) {
+    saved_key.assign(key.data(), key.size());
+  }
+
+  bool parse_key(ldb::ParsedInternalKey &parsed) {
+    if (!ldb::ParseInternalKey(iter->key(), &parsed)) {
+      error = ldb::Status::Corruption("corrupted internal key in DB");
+      return false;
+    }
+    return true;
+  }
+
+  // Moves iter to the newest value of the next user key, skipping the ones
+  // that aren't after saved_key when skipping
+  void find_next_user_entry(bool skipping) {
+    do {
+      ldb::ParsedInternalKey parsed;
+      if (parse_key(parsed)) {
+        if (parsed.type == ldb::kTypeDeletion) {
+          save_key(parsed.user_key);
+          skipping = true;
+        } else if (!skipping ||
+                   user_comparator.Compare(parsed.user_key, saved_key) > 0) {
+          valid = true;
+          saved_key.clear();
+          return;
+        }
+      }
+      iter->Next();
+    } while (iter->Valid());
+    saved_key.clear();
+    valid = false;
+  }
+
+  // Moves iter to just before the entries of the previous user key with a
+  // value, which is copied to saved_key and saved_value
+  void find_prev_user_entry() {
+    auto type = ldb::kTypeDeletion;
+    while (iter->Valid()) {
+      ldb::ParsedInternalKey parsed;
+      if (parse_key(parsed)) {
+        if (type != ldb::kTypeDeletion &&
+            user_comparator.Compare(parsed.user_key, saved_key) < 0) {
+          break;
+        }
+        type = parsed.type;
+        if (type == ldb::kTypeDeletion) {
+          saved_key.clear();
+          saved_value.clear();
+        } else {
+          save_key(parsed.user_key);
+          const auto value = iter->value();
+          saved_value.assign(value.data(), value.size());
+        }
+      }
+      iter->Prev();
+    }
+    if (type == ldb::kTypeDeletion) {
+      valid = false;
+      reverse = false;
+      saved_key.clear();
+      saved_value.clear();
+    } else {
+      valid = true;
+    }
+  }
+
+  const ldb::Comparator &user_comparator;
+  std::unique_ptr<ldb::Iterator> iter;
+  // First key that failed to parse
+  ldb::Status error{};
+  bool valid = false;
+  bool reverse = false;
+  std::string saved_key{};
+  std::string saved_value{};
+};
+
+struct readonly_snapshot : public ldb::Snapshot {};
+}  // namespace readonly_detail
+
+// A DB opened without DB::Open, which would replay the logs into a new table
+// and write a new MANIFEST. The version is rebuilt from the MANIFEST and the
+// logs are read into memory, nothing is written or locked so it works on
+// read-only copies. Every table is opened up front, so tables that the owner
+// of the DB removes after that can still be read.
+class readonly_db : public ldb::DB {
+ public:
+  UTILS_NOT_COPYABLE(readonly_db)
+  UTILS_NOT_MOVEABLE(readonly_db)
+
+  // opts has to outlive the DB, like with DB::Open
+  static ldb::Status open(const ldb::Options &opts, const std::string &dbname,
+                          ldb::DB **result) {
+    *result = nullptr;
+    db_manifest manifest;
+    auto status = read_manifest(opts.env, dbname, manifest);
+    if (!status.ok()) {
+      return status;
+    }
+    if (!manifest.comparator.empty() &&
+        manifest.comparator != opts.comparator->Name()) {
+      return ldb::Status::InvalidArgument(
+          manifest.comparator, "does not match the comparator of the options");
+    }
+    auto db = std::unique_ptr<readonly_db>(new readonly_db(opts));
+    status = db->open_tables(dbname, manifest);
+    if (status.ok()) status = db->read_logs(dbname, manifest);
+    if (!status.ok()) {
+      return status;
+    }
+    *result = db.release();
+    return status;
+  }
+
+  ldb::Status Put(const ldb::WriteOptions &, const ldb::Slice &,
+                  const ldb::Slice &) override {
+    return read_only_error();
+  }
+  ldb::Status Delete(const ldb::WriteOptions &, const ldb::Slice &) override {
+    return read_only_error();
+  }
+  ldb::Status Write(const ldb::WriteOptions &, ldb::WriteBatch *) override {
+    return read_only_error();
+  }
+
+  ldb::Status Get(const ldb::ReadOptions &ropts, const ldb::Slice &key,
+                  std::string *value) override {
+    std::unique_ptr<ldb::Iterator> iter(NewIterator(ropts));
+    iter->Seek(key);
+    if (iter->Valid() &&
+        opts.comparator->Compare(iter->key(), key) == 0) {
+      const auto found = iter->value();
+      value->assign(found.data(), found.size());
+      return ldb::Status::OK();
+    }
+    return iter->status().ok() ? ldb::Status::NotFound(key) : iter->status();
+  }
+
+  // ropts.snapshot is ignored, every snapshot would see the same keys
+  ldb::Iterator *NewIterator(const ldb::ReadOptions &ropts) override {
+    using namespace readonly_detail;
+    std::vector<ldb::Iterator *> children;
+    if (!logged.empty()) {
+      children.push_back(new entries_iterator(*table_opts->comparator, logged));
+    }
+    for (const auto *table : levels[0]) {
+      children.push_back(table->table.table->NewIterator(ropts));
+    }
+    for (size_t level = 1; level < levels.size(); level++) {
+      if (levels[level].empty()) {
+        continue;
+      }
+      children.push_back(ldb::NewTwoLevelIterator(
+          new level_iterator(*table_opts->comparator, levels[level]),
+          &level_iterator::open_table, &levels[level], ropts));
+    }
+    return new user_key_iterator(
+        *opts.comparator,
+        ldb::NewMergingIterator(table_opts->comparator, children.data(),
+                                static_cast<int>(children.size())));
+  }
+
+  const ldb::Snapshot *GetSnapshot() override {
+    return new readonly_detail::readonly_snapshot();
+  }
+  void ReleaseSnapshot(const ldb::Snapshot *snapshot) override {
+    delete static_cast<const readonly_detail::readonly_snapshot *>(snapshot);
+  }
+
+  bool GetProperty(const ldb::Slice &, std::string *) override {
+    return false;
+  }
+
+  // Like DBImpl, keys that are only in the logs aren't counted
+  void GetApproximateSizes(const ldb::Range *ranges, const int n,
+                           uint64_t *sizes) override {
+    for (int i = 0; i < n; i++) {
+      const auto start = approximate_offset(ranges[i].start);
+      const auto limit = approximate_offset(ranges[i].limit);
+      sizes[i] = limit >= start ? limit - start : 0;
+    }
+  }
+
+  void CompactRange(const ldb::Slice *, const ldb::Slice *) override {}
+
+  // Added to DB by leveldb-mcpe, there are no compactions to suspend
+  void SuspendCompaction() {}
+  void ResumeCompaction() {}
+
+ private:
+  explicit readonly_db(const ldb::Options &opts)
+      : opts(opts), table_opts(opts) {}
+
+  static ldb::Status read_only_error() {
+    return ldb::Status::NotSupported("DB was opened read-only");
+  }
+
+  ldb::Status open_tables(const std::string &dbname,
+                          const db_manifest &manifest) {
+    using namespace readonly_detail;
+    for (const auto &[_, file] : manifest.files) {
+      if (file.level < 0 || static_cast<size_t>(file.level) >= levels.size()) {
+        return ldb::Status::Corruption("MANIFEST", "table in invalid level");
+      }
+      auto &table = tables.emplace_back(new level_table{file, {}});
+      auto status = open_table_file(table_opts, dbname, file, table->table);
+      if (!status.ok()) {
+        return status;
+      }
+      levels[file.level].push_back(table.get());
+    }
+    const auto *comparator = table_opts->comparator;
+    for (size_t level = 1; level < levels.size(); level++) {
+      std::sort(levels[level].begin(), levels[level].end(),
+                [&](const level_table *a, const level_table *b) {
+                  return comparator->Compare(a->file.smallest,
+                                             b->file.smallest) < 0;
+                });
+    }
+    return ldb::Status::OK();
+  }
+
+  // Reads the logs DB::Open would recover, in order. Like DBImpl, a torn end
+  // of a log is only an error with paranoid_checks.
+  ldb::Status read_logs(const std::string &dbname,
+                        const db_manifest &manifest) {
+    ldb::Env *env = opts.env;
+    std::vector<std::string> filenames;
+    auto status = env->GetChildren(dbname, &filenames);
+    if (!status.ok()) {
+      return status;
+    }
+    std::vector<uint64_t> logs;
+    for (const auto &filename : filenames) {
+      uint64_t number;
+      ldb::FileType type;
+      if (ldb::ParseFileName(filename, &number, &type) &&
+          type == ldb::kLogFile &&
+          (number >= manifest.log_number ||
+           number == manifest.prev_log_number)) {
+        logs.push_back(number);
+      }
+    }
+    std::sort(logs.begin(), logs.end());
+
+    readonly_detail::log_inserter inserter(logged);
+    for (const auto number : logs) {
+      ldb::SequentialFile *file_ptr;
+      status = env->NewSequentialFile(ldb::LogFileName(dbname, number),
+                                      &file_ptr);
+      if (!status.ok()) {
+        return status;
+      }
+      auto file = std::unique_ptr<ldb::SequentialFile>(file_ptr);
+      manifest_detail::manifest_reporter reporter{};
+      ldb::log::Reader reader(file.get(), &reporter, true, 0);
+      ldb::Slice record;
+      std::string scratch;
+      ldb::WriteBatch batch;
+      while (reader.ReadRecord(&record, &scratch)) {
+        // Smaller than the header of a batch
+        if (record.size() < 12) {
+          reporter.Corruption(record.size(),
+                              ldb::Status::Corruption("log record too small"));
+          continue;
+        }
+        ldb::WriteBatchInternal::SetContents(&batch, record);
+        inserter.sequence = ldb::WriteBatchInternal::Sequence(&batch);
+        status = batch.Iterate(&inserter);
+        if (!status.ok()) {
+          return status;
+        }
+      }
+      if (opts.paranoid_checks && !reporter.status.ok()) {
+        return reporter.status;
+      }
+    }
+    const auto *comparator = table_opts->comparator;
+    std::sort(logged.begin(), logged.end(),
+              [&](const auto &a, const auto &b) {
+                return comparator->Compare(a.first, b.first) < 0;
+              });
+    return ldb::Status::OK();
+  }
+
+  // Bytes in tables before key, the same estimate VersionSet makes
+  uint64_t approximate_offset(const ldb::Slice &key) const {
+    const ldb::InternalKey internal_key(key, ldb::kMaxSequenceNumber,
+                                        ldb::kValueTypeForSeek);
+    const auto encoded = internal_key.Encode();
+    const auto *comparator = table_opts->comparator;
+    uint64_t offset = 0;
+    for (const auto &table : tables) {
+      if (comparator->Compare(table->file.largest, encoded) <= 0) {
+        offset += table->file.size;
+      } else if (comparator->Compare(table->file.smallest, encoded) <= 0) {
+        offset += table->table.table->ApproximateOffsetOf(encoded);
+      }
+    }
+    return offset;
+  }
+
+  const ldb::Options opts;
+  const table_options table_opts;
+  std::vector<std::unique_ptr<readonly_detail::level_table>> tables{};
+  std::array<readonly_detail::level_tables, ldb::config::kNumLevels> levels{};
+  readonly_detail::log_entries logged{};
+};
+
+// Same as open_db without writing to the DB, see readonly_db
+auto open_db_read_only(db_opts &&opts, const std::string &name) {
+  ldb::DB *db;
+  auto status = readonly_db::open(*opts, name, &db);
+  auto arena = unique_deleter_arena(std::move(opts));
+  return std::pair{db_unique_ptr_t(db, std::move(arena)), status};
+}
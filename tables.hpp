@@ -0,0 +1,597 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "db/dbformat.h"
+#include "db/filename.h"
+#include "hackdb.h"
+#include "leveldb/compressor.h"
+#include "leveldb/env.h"
+#include "leveldb/iterator.h"
+#include "leveldb/options.h"
+#include "leveldb/table.h"
+#include "leveldb/table_builder.h"
+#include "manifest.hpp"
+#include "pipeline.hpp"
+#include "table/block.h"
+#include "table/format.h"
+#include "utils.hpp"
+
+namespace ldb = leveldb;
+
+// Decides which compressor writes each data block of a table. Blocks are cut
+// where the class of their keys changes, so most hold keys of a single class
+// and are compressed with compressors[class], or stored raw if it's null. See
+// table_writer for the blocks that are too small to cut.
+struct block_policy {
+  std::function<size_t(const ldb::Slice &user_key)> classify{};
+  std::vector<std::unique_ptr<ldb::Compressor>> compressors{};
+
+  bool enabled() const { return static_cast<bool>(classify); }
+};
+
+// Options for table files used outside of a DB. Their keys are internal keys,
+// so the comparator and filter policy are wrapped the same way DBImpl does.
+class table_options {
+ public:
+  UTILS_NOT_COPYABLE(table_options)
+  UTILS_NOT_MOVEABLE(table_options)
+  explicit table_options(const ldb::Options &db_options)
+      : comparator(db_options.comparator),
+        filter_policy(db_options.filter_policy),
+        opts(db_options) {
+    opts.comparator = &comparator;
+    opts.filter_policy = db_options.filter_policy ? &filter_policy : nullptr;
+  }
+
+  // Blocks are compressed with compressors owned by these options instead of
+  // the DB ones, Compressor::compress keeps stats that aren't thread safe
+  table_options(const ldb::Options &db_options,
+                std::vector<std::unique_ptr<ldb::Compressor>> &&compressors)
+      : table_options(db_options) {
+    this->compressors = std::move(compressors);
+    assert(this->compressors.size() <= std::size(opts.compressors));
+    for (size_t i = 0; i < std::size(opts.compressors); i++) {
+      opts.compressors[i] =
+          i < this->compressors.size() ? this->compressors[i].get() : nullptr;
+    }
+  }
+
+  // Same as above, data blocks written with these options follow policy
+  table_options(const ldb::Options &db_options,
+                std::vector<std::unique_ptr<ldb::Compressor>> &&compressors,
+                block_policy &&policy)
+      : table_options(db_options, std::move(compressors)) {
+    this->policy = std::move(policy);
+    for (const auto &compressor : this->policy.compressors) {
+      auto &class_opts = block_class_opts.emplace_back(opts);
+      std::fill(std::begin(class_opts.compressors),
+                std::end(class_opts.compressors), nullptr);
+      class_opts.compressors[0] = compressor.get();
+    }
+  }
+
+  bool has_block_policy() const { return policy.enabled(); }
+  size_t block_class(const ldb::Slice &user_key) const {
+    return policy.classify(user_key);
+  }
+  // Only compresses with the compressor of block_class
+  const ldb::Options &block_class_options(const size_t block_class) const {
+    return block_class_opts[block_class];
+  }
+  size_t block_classes() const { return block_class_opts.size(); }
+  bool block_class_compresses(const size_t block_class) const {
+    return block_class_opts[block_class].compressors[0] != nullptr;
+  }
+
+  const ldb::Options *operator->() const { return &opts; }
+  const ldb::Options &operator*() const { return opts; }
+
+ private:
+  ldb::InternalKeyComparator comparator;
+  ldb::InternalFilterPolicy filter_policy;
+  std::vector<std::unique_ptr<ldb::Compressor>> compressors{};
+  ldb::Options opts;
+  block_policy policy{};
+  std::vector<ldb::Options> block_class_opts{};
+};
+
+// A table together with the file it reads from, which must outlive it
+struct open_table {
+  std::unique_ptr<ldb::RandomAccessFile> file;
+  std::unique_ptr<ldb::Table> table;
+};
+
+ldb::Status open_table_data(ldb::Env *env, const std::string &dbname,
+                            const uint64_t number,
+                            std::unique_ptr<ldb::RandomAccessFile> &result) {
+  ldb::RandomAccessFile *file_ptr;
+  auto status =
+      env->NewRandomAccessFile(ldb::TableFileName(dbname, number), &file_ptr);
+  if (!status.ok()) {
+    // Same fallback as TableCache, older DBs use the .sst extension
+    if (!env->NewRandomAccessFile(ldb::SSTTableFileName(dbname, number),
+                                  &file_ptr)
+             .ok()) {
+      return status;
+    }
+  }
+  result.reset(file_ptr);
+  return status;
+}
+
+ldb::Status open_table_file(const table_options &opts,
+                            const std::string &dbname, const table_file &file,
+                            open_table &result) {
+  result.table.reset();
+  auto status = open_table_data(opts->env, dbname, file.number, result.file);
+  if (!status.ok()) {
+    return status;
+  }
+  ldb::Table *table_ptr;
+  status = ldb::Table::Open(*opts, result.file.get(), file.size, &table_ptr);
+  if (!status.ok()) {
+    return status;
+  }
+  result.table.reset(table_ptr);
+  return status;
+}
+
+// Writes a new table file with entries added in internal key order, the file
+// is removed unless finish succeeds
+class table_writer {
+ public:
+  UTILS_NOT_COPYABLE(table_writer)
+  UTILS_NOT_MOVEABLE(table_writer)
+  // With write_queue > 0 the file is written by its own thread, see
+  // queued_writable_file
+  table_writer(const table_options &opts, const std::string &dbname,
+               const uint64_t number, const size_t write_queue = 0)
+      : opts(opts),
+        env(opts->env),
+        fname(ldb::TableFileName(dbname, number)),
+        number(number),
+        class_bytes(opts.block_classes(), 0) {
+    ldb::WritableFile *file_ptr;
+    status = env->NewWritableFile(fname, &file_ptr);
+    if (status.ok()) {
+      file.reset(file_ptr);
+      if (write_queue > 0) {
+        file = std::make_unique<queued_writable_file>(std::move(file),
+                                                      write_queue);
+      }
+      builder = std::make_unique<ldb::TableBuilder>(*opts, file.get());
+    }
+  }
+
+  ldb::Status get_status() const {
+    return status.ok() ? builder->status() : status;
+  }
+
+  void add(const ldb::Slice &internal_key, const ldb::Slice &value) {
+    assert(status.ok());
+    if (builder->NumEntries() == 0) {
+      smallest.assign(internal_key.data(), internal_key.size());
+    }
+    largest.assign(internal_key.data(), internal_key.size());
+    const auto entry_bytes = internal_key.size() + value.size();
+    if (opts.has_block_policy()) {
+      set_block_class(opts.block_class(ldb::ExtractUserKey(internal_key)),
+                      entry_bytes);
+    }
+    builder->Add(internal_key, value);
+    if (builder->FileSize() != flushed_size) {
+      // The builder ended the block after this entry
+      block_ended();
+    } else {
+      pending_bytes += entry_bytes;
+    }
+  }
+
+  uint64_t entries() const { return builder ? builder->NumEntries() : 0; }
+  uint64_t file_size() const { return builder ? builder->FileSize() : 0; }
+
+  // Finishes and syncs the table, result describes it as a file in level
+  ldb::Status finish(const int level, table_file &result) {
+    if (!status.ok()) {
+      return status;
+    }
+    closed = true;
+    status = builder->Finish();
+    if (status.ok()) status = file->Sync();
+    if (status.ok()) status = file->Close();
+    if (!status.ok()) {
+      return status;
+    }
+    finished = true;
+    result = {level, number, builder->FileSize(), smallest, largest};
+    return status;
+  }
+
+  ~table_writer() {
+    if (builder && !closed) {
+      builder->Abandon();
+    }
+    builder.reset();
+    file.reset();
+    if (!finished) {
+      env->DeleteFile(fname);
+    }
+  }
+
+ private:
+  // Ends the data block being built when a key of another class comes, the
+  // ones after it are compressed the way the new class is. Blocks under a
+  // quarter of block_size aren't cut, so the records of a chunk aren't
+  // spread over a block per tag. They are compressed with the class that has
+  // the most bytes in them among the ones that compress, and only stored raw
+  // when all their keys are, so a rule for no compression never takes in
+  // keys that are meant to be compressed.
+  void set_block_class(const size_t block_class, const size_t entry_bytes) {
+    if (block_class != current_class &&
+        (pending_bytes == 0 || pending_bytes >= opts->block_size / 4)) {
+      builder->Flush();
+      block_ended();
+      change_class(block_class);
+    }
+    class_bytes[block_class] += entry_bytes;
+    if (block_class == current_class) {
+      return;
+    }
+    auto best = current_class;
+    for (size_t i = 0; i < class_bytes.size(); i++) {
+      if (class_bytes[i] > 0 && opts.block_class_compresses(i) &&
+          (!opts.block_class_compresses(best) ||
+           class_bytes[i] > class_bytes[best])) {
+        best = i;
+      }
+    }
+    if (best != current_class) {
+      // The builder compresses the block when it ends it, with the options
+      // it has then
+      change_class(best);
+    }
+  }
+
+  void change_class(const size_t block_class) {
+    auto change_status =
+        builder->ChangeOptions(opts.block_class_options(block_class));
+    if (!change_status.ok() && status.ok()) {
+      status = change_status;
+    }
+    current_class = block_class;
+  }
+
+  void block_ended() {
+    flushed_size = builder->FileSize();
+    pending_bytes = 0;
+    std::fill(class_bytes.begin(), class_bytes.end(), 0);
+  }
+
+  const table_options &opts;
+  ldb::Env *const env;
+  const std::string fname;
+  const uint64_t number;
+  size_t current_class = std::numeric_limits<size_t>::max();
+  // Size of the file when the builder last ended a block, and the key and
+  // value bytes added since
+  uint64_t flushed_size = 0;
+  uint64_t pending_bytes = 0;
+  // Key and value bytes of each class in the block being built
+  std::vector<uint64_t> class_bytes;
+  ldb::Status status{};
+  std::unique_ptr<ldb::WritableFile> file{};
+  std::unique_ptr<ldb::TableBuilder> builder{};
+  std::string smallest{};
+  std::string largest{};
+  bool closed = false;
+  bool finished = false;
+};
+
+// Picks about fraction of the blocks it's asked about, spread evenly instead
+// of at random so the same blocks are picked on every run
+class block_sampler {
+ public:
+  explicit block_sampler(const double fraction)
+      : fraction(std::clamp(fraction, 0.0, 1.0)), credit(1 - this->fraction) {}
+
+  bool take() {
+    credit += fraction;
+    if (credit < 1) {
+      return false;
+    }
+    credit -= 1;
+    return true;
+  }
+
+ private:
+  const double fraction;
+  double credit;
+};
+
+// Calls visit(file, handle) with the data blocks of a table that sampler
+// picks, until it returns an error. Only the footer and the index block are
+// read here, visit reads what it needs of each block.
+template <typename Visit>
+ldb::Status for_each_sampled_block(const table_options &opts,
+                                   const std::string &dbname,
+                                   const table_file &file,
+                                   block_sampler &sampler, Visit &&visit) {
+  std::unique_ptr<ldb::RandomAccessFile> data;
+  auto status = open_table_data(opts->env, dbname, file.number, data);
+  if (!status.ok()) {
+    return status;
+  }
+  if (file.size < ldb::Footer::kEncodedLength) {
+    return ldb::Status::Corruption("file is too short to be an sstable");
+  }
+
+  char footer_space[ldb::Footer::kEncodedLength];
+  ldb::Slice footer_input;
+  status = data->Read(file.size - ldb::Footer::kEncodedLength,
+                      ldb::Footer::kEncodedLength, &footer_input,
+                      footer_space);
+  if (!status.ok()) {
+    return status;
+  }
+  ldb::Footer footer;
+  status = footer.DecodeFrom(&footer_input);
+  if (!status.ok()) {
+    return status;
+  }
+
+  auto ropts = ldb::ReadOptions();
+  ropts.fill_cache = false;
+  ldb::BlockContents contents;
+  status = ldb::ReadBlock(data.get(), *opts, ropts, footer.index_handle(),
+                          &contents);
+  if (!status.ok()) {
+    return status;
+  }
+  ldb::Block index(contents);
+  auto iter =
+      std::unique_ptr<ldb::Iterator>(index.NewIterator(opts->comparator));
+  for (iter->SeekToFirst(); iter->Valid(); iter->Next()) {
+    if (!sampler.take()) {
+      continue;
+    }
+    ldb::BlockHandle handle;
+    auto handle_input = iter->value();
+    status = handle.DecodeFrom(&handle_input);
+    if (status.ok()) {
+      status = visit(*data, static_cast<const ldb::BlockHandle &>(handle));
+    }
+    if (!status.ok()) {
+      return status;
+    }
+  }
+  return iter->status();
+}
+
+// Adds the compressor IDs of the data blocks of a table to counts. The ID of
+// each data block picked by sampler comes from the 5 byte trailer at its end
+// so data blocks are never read or inflated.
+ldb::Status count_block_compressors(const table_options &opts,
+                                    const std::string &dbname,
+                                    const table_file &file,
+                                    block_sampler &sampler,
+                                    hackdb::block_counts &counts) {
+  char trailer_space[ldb::kBlockTrailerSize];
+  return for_each_sampled_block(
+      opts, dbname, file, sampler,
+      [&](ldb::RandomAccessFile &data, const ldb::BlockHandle &handle) {
+        ldb::Slice trailer;
+        auto status = data.Read(handle.offset() + handle.size(),
+                                ldb::kBlockTrailerSize, &trailer,
+                                trailer_space);
+        if (!status.ok()) {
+          return status;
+        }
+        if (trailer.size() != ldb::kBlockTrailerSize) {
+          return ldb::Status::Corruption("truncated block read");
+        }
+        counts[static_cast<hackdb::compression_id_t>(trailer[0])]++;
+        return status;
+      });
+}
+
+// Rewrites a table of input_db into output_db as table number, blocks are
+// decoded with the input options and encoded with the output ones. result
+// describes the new table, which has the same keys and level.
+ldb::Status transcode_table(const table_options &input,
+                            const std::string &input_db,
+                            const table_options &output,
+                            const std::string &output_db,
+                            const ldb::ReadOptions &ropts,
+                            const table_file &file, const uint64_t number,
+                            table_file &result,
+                            const size_t write_queue = 0) {
+  open_table source{};
+  auto status = open_table_file(input, input_db, file, source);
+  if (!status.ok()) {
+    return status;
+  }
+  auto iter =
+      std::unique_ptr<ldb::Iterator>(source.table->NewIterator(ropts));
+  table_writer writer(output, output_db, number, write_queue);
+  if (!writer.get_status().ok()) {
+    return writer.get_status();
+  }
+  for (iter->SeekToFirst(); iter->Valid(); iter->Next()) {
+    writer.add(iter->key(), iter->value());
+  }
+  if (!iter->status().ok()) {
+    return iter->status();
+  }
+  return writer.finish(file.level, result);
+}
+
+// Tables written while bulk loading a DB. They all go to the last level, so
+// entries have to come sorted, without duplicated keys and ranges loaded
+// concurrently must not overlap.
+class bulk_load {
+ public:
+  using compressors_t = std::vector<std::unique_ptr<ldb::Compressor>>;
+  UTILS_NOT_COPYABLE(bulk_load)
+  UTILS_NOT_MOVEABLE(bulk_load)
+  bulk_load(const std::string &dbname, const ldb::Options &options,
+            std::function<compressors_t()> &&make_compressors,
+            const uint64_t target_file_size, const size_t write_queue = 0,
+            std::function<block_policy()> &&make_block_policy = {})
+      : dbname(dbname),
+        options(options),
+        make_compressors(std::move(make_compressors)),
+        make_block_policy(std::move(make_block_policy)),
+        target_file_size(target_file_size),
+        write_queue(write_queue) {}
+
+  static constexpr int level = ldb::config::kNumLevels - 1;
+  const std::string dbname;
+  const ldb::Options &options;
+  const std::function<compressors_t()> make_compressors;
+  // Optional, tables follow the policies it makes
+  const std::function<block_policy()> make_block_policy;
+  const uint64_t target_file_size;
+  // See table_writer
+  const size_t write_queue;
+
+  uint64_t new_file_number() { return next_file++; }
+
+  void add_file(table_file &&file) {
+    std::unique_lock lock(mutex);
+    files.push_back(std::move(file));
+  }
+
+  std::vector<table_file> take_files() {
+    std::unique_lock lock(mutex);
+    return std::move(files);
+  }
+
+  // The loaded tables as the only version of a new DB
+  db_manifest make_manifest() {
+    db_manifest manifest{};
+    manifest.comparator = options.comparator->Name();
+    for (auto &file : take_files()) {
+      manifest.files[file.number] = std::move(file);
+    }
+    manifest.next_file = next_file;
+    return manifest;
+  }
+
+ private:
+  std::atomic<uint64_t> next_file{1};
+  std::mutex mutex;
+  std::vector<table_file> files{};
+};
+
+// Writes sorted user keys to tables of a bulk load, a new table is started
+// once the current one reaches the target size
+class bulk_table_sink {
+ public:
+  UTILS_NOT_COPYABLE(bulk_table_sink)
+  UTILS_NOT_MOVEABLE(bulk_table_sink)
+  bulk_table_sink(bulk_load &load)
+      : load(load),
+        opts(load.options, load.make_compressors(),
+             load.make_block_policy ? load.make_block_policy()
+                                    : block_policy{}) {}
+
+  ldb::Status last_status{};
+
+  [[nodiscard]] bool Put(const ldb::Slice &key, const ldb::Slice &value) {
+    if (!writer) {
+      writer = std::make_unique<table_writer>(
+          opts, load.dbname, load.new_file_number(), load.write_queue);
+      last_status = writer->get_status();
+      if (!last_status.ok()) {
+        return false;
+      }
+    }
+    internal_key.clear();
+    ldb::AppendInternalKey(&internal_key,
+                           ldb::ParsedInternalKey(key, 0, ldb::kTypeValue));
+    writer->add(internal_key, value);
+    if (writer->file_size() >= load.target_file_size) {
+      return cut();
+    }
+    return true;
+  }
+
+  ldb::Status finish() {
+    if (writer && last_status.ok()) {
+      cut();
+    }
+    return last_status;
+  }
+
+  // Drops the table being written
+  void abandon() { writer.reset(); }
+
+ private:
+  bool cut() {
+    table_file file;
+    last_status = writer->finish(bulk_load::level, file);
+    writer.reset();
+    if (!last_status.ok()) {
+      return false;
+    }
+    load.add_file(std::move(file));
+    return true;
+  }
+
+  bulk_load &load;
+  const table_options opts;
+  std::unique_ptr<table_writer> writer{};
+  std::string internal_key{};
+};
+
+// Replaces every table of the closed DB at dbname with the given tables from
+// staging_dir, which must be on the same filesystem. The new tables get file
+// numbers the DB hasn't used, until CURRENT is switched to the new MANIFEST
+// they are just unreferenced files that leveldb removes when opening the DB.
+ldb::Status install_tables(ldb::Env *env, const std::string &dbname,
+                           const std::string &staging_dir,
+                           std::vector<table_file> &&files) {
+  db_lock lock(env, dbname);
+  if (!lock.status.ok()) {
+    return lock.status;
+  }
+  db_manifest manifest;
+  auto status = read_manifest(env, dbname, manifest);
+  if (!status.ok()) {
+    return status;
+  }
+  manifest.files.clear();
+  for (auto &file : files) {
+    const auto number = manifest.new_file_number();
+    status = env->RenameFile(ldb::TableFileName(staging_dir, file.number),
+                             ldb::TableFileName(dbname, number));
+    if (!status.ok()) {
+      return status;
+    }
+    file.number = number;
+    manifest.files[number] = std::move(file);
+  }
+  // The logs don't hold anything that isn't in the new tables
+  manifest.log_number = manifest.next_file;
+  manifest.prev_log_number = 0;
+  status = write_manifest(env, dbname, manifest);
+  if (!status.ok()) {
+    return status;
+  }
+  return remove_obsolete_files(env, dbname, manifest);
+}
+
+// Empties the closed DB at dbname in place of deleting every key, the new
+// MANIFEST lists no tables and the old tables and logs are deleted
+ldb::Status clear_tables(ldb::Env *env, const std::string &dbname) {
+  return install_tables(env, dbname, dbname, {});
+}
@@ -1,8 +1,12 @@
 #pragma once
 #include <optional>
+#include <string>
+#include <string_view>
 #include <tuple>
 #include <utility>
 
+#include "bytes_repr.hpp"
+
 #define UTILS_SET_MOVE(type, value) \
   type(type &&) = value;            \
   type &operator=(type &&) = value;
@@ -34,11 +38,11 @@ struct unique_deleter_arena {
       : arena({{std::forward<Args>(args)...}}) {}
 };
 
-// taken from
+// same output as bytes.__repr__, see
 // https://github.com/python/cpython/blob/f474391b26aa9208b44ca879f8635409d322f738/Objects/bytesobject.c#L1359-L1379
+// the escaping is done by the widest bytes_repr kernel the CPU supports
 void python_bytes_repr(std::string &output, const std::string_view &input,
                        const bool double_quote = true, const bool wrap = true) {
-  constexpr auto hexdigits = "0123456789abcdef";
   const auto quote = double_quote ? '"' : '\'';
 
   const auto begin = output.length();
@@ -52,24 +56,9 @@ void python_bytes_repr(std::string &output, const std::string_view &input,
     *p++ = 'b';
     *p++ = quote;
   }
-  for (size_t i = 0; i < input.length(); i++) {
-    const auto c = input[i];
-    if (c == quote || c == '\\')
-      *p++ = '\\', *p++ = c;
-    else if (c == '\t')
-      *p++ = '\\', *p++ = 't';
-    else if (c == '\n')
-      *p++ = '\\', *p++ = 'n';
-    else if (c == '\r')
-      *p++ = '\\', *p++ = 'r';
-    else if (c < ' ' || c >= 0x7f) {
-      *p++ = '\\';
-      *p++ = 'x';
-      *p++ = hexdigits[(c & 0xf0) >> 4];
-      *p++ = hexdigits[c & 0xf];
-    } else
-      *p++ = c;
-  }
+  p = bytes_repr::get_kernel()(
+      p, reinterpret_cast<const unsigned char *>(input.data()), input.length(),
+      bytes_repr::get_escape_table(quote), quote);
   if (wrap) {
     *p++ = quote;
   }
@@ -0,0 +1,205 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "crc32c.hpp"
+#include "db/dbformat.h"
+#include "leveldb/comparator.h"
+#include "leveldb/env.h"
+#include "leveldb/iterator.h"
+#include "leveldb/options.h"
+#include "manifest.hpp"
+#include "metrics.hpp"
+#include "table/block.h"
+#include "table/format.h"
+#include "tables.hpp"
+#include "util/coding.h"
+
+namespace ldb = leveldb;
+
+// A part of a table that failed verification, the keys it held are
+// somewhere between first_key and last_key
+struct corrupt_block {
+  uint64_t table;
+  // Data, index, metaindex or filter block, or the whole table when it
+  // can't be read far enough to find its blocks
+  std::string kind;
+  uint64_t offset;
+  uint64_t size;
+  std::string error;
+  std::string first_key;
+  std::string last_key;
+};
+
+// What verify_table found in a table
+struct table_verification {
+  uint64_t blocks = 0;
+  std::vector<corrupt_block> corrupt{};
+};
+
+namespace verify_detail {
+// Reads a block with its trailer and checks the CRC32C stored in it, which
+// covers the block and its compression byte. scratch is only used when the
+// file can't return a slice of its own memory.
+ldb::Status read_checked(ldb::RandomAccessFile &file,
+                         const ldb::BlockHandle &handle, std::string &scratch,
+                         ldb::Slice &block) {
+  const size_t size = handle.size() + ldb::kBlockTrailerSize;
+  if (scratch.size() < size) {
+    scratch.resize(size);
+  }
+  auto status = file.Read(handle.offset(), size, &block, scratch.data());
+  if (!status.ok()) {
+    return status;
+  }
+  if (block.size() != size) {
+    return ldb::Status::Corruption("truncated block read");
+  }
+  const auto stored =
+      ldb::crc32c::Unmask(ldb::DecodeFixed32(block.data() + handle.size() + 1));
+  if (crc32c::value(block.data(), handle.size() + 1) != stored) {
+    return ldb::Status::Corruption("block checksum mismatch");
+  }
+  return ldb::Status::OK();
+}
+
+// Decodes a block whose checksum was already checked, entries must parse
+// and be sorted
+ldb::Status decode_block(ldb::RandomAccessFile &file,
+                         const ldb::Options &options,
+                         const ldb::BlockHandle &handle) {
+  auto ropts = ldb::ReadOptions();
+  ropts.fill_cache = false;
+  ldb::BlockContents contents;
+  auto status = ldb::ReadBlock(&file, options, ropts, handle, &contents);
+  if (!status.ok()) {
+    return status;
+  }
+  ldb::Block block(contents);
+  auto iter =
+      std::unique_ptr<ldb::Iterator>(block.NewIterator(options.comparator));
+  std::string previous;
+  for (iter->SeekToFirst(); iter->Valid(); iter->Next()) {
+    if (!previous.empty() &&
+        options.comparator->Compare(previous, iter->key()) >= 0) {
+      return ldb::Status::Corruption("keys out of order");
+    }
+    previous.assign(iter->key().data(), iter->key().size());
+  }
+  return iter->status();
+}
+
+std::string user_key(const ldb::Slice &internal_key) {
+  return internal_key.size() >= 8
+             ? ldb::ExtractUserKey(internal_key).ToString()
+             : internal_key.ToString();
+}
+}  // namespace verify_detail
+
+// Checks the CRC32C of every block of a table, index and metaindex included.
+// With decode the data blocks are also decompressed and their entries
+// parsed. Blocks read are counted in progress, problems go to the result
+// instead of stopping the verification.
+table_verification verify_table(const table_options &opts,
+                                const std::string &dbname,
+                                const table_file &file, const bool decode) {
+  using namespace verify_detail;
+  table_verification result{};
+  const auto smallest = user_key(file.smallest);
+  const auto largest = user_key(file.largest);
+  const auto whole_table = [&](const ldb::Status &status) {
+    result.corrupt.push_back({file.number, "table", 0, file.size,
+                              status.ToString(), smallest, largest});
+    return result;
+  };
+
+  std::unique_ptr<ldb::RandomAccessFile> data;
+  auto status = open_table_data(opts->env, dbname, file.number, data);
+  if (!status.ok()) {
+    return whole_table(status);
+  }
+  if (file.size < ldb::Footer::kEncodedLength) {
+    return whole_table(
+        ldb::Status::Corruption("file is too short to be an sstable"));
+  }
+  char footer_space[ldb::Footer::kEncodedLength];
+  ldb::Slice footer_input;
+  status = data->Read(file.size - ldb::Footer::kEncodedLength,
+                      ldb::Footer::kEncodedLength, &footer_input,
+                      footer_space);
+  ldb::Footer footer;
+  if (status.ok()) {
+    status = footer.DecodeFrom(&footer_input);
+  }
+  if (!status.ok()) {
+    return whole_table(status);
+  }
+
+  std::string scratch;
+  ldb::Slice block;
+  const auto check = [&](const char *kind, const ldb::BlockHandle &handle,
+                         const std::string &first_key,
+                         const std::string &last_key, const bool full) {
+    result.blocks++;
+    auto status = read_checked(*data, handle, scratch, block);
+    if (status.ok() && full) {
+      status = decode_block(*data, *opts, handle);
+    }
+    const auto size = handle.size() + ldb::kBlockTrailerSize;
+    progress.bytes_read.fetch_add(size, std::memory_order_relaxed);
+    progress.covered.fetch_add(size, std::memory_order_relaxed);
+    if (!status.ok()) {
+      result.corrupt.push_back({file.number, kind, handle.offset(),
+                                handle.size(), status.ToString(), first_key,
+                                last_key});
+    }
+    return status.ok();
+  };
+
+  // Both are decoded below, their contents are needed to find the rest
+  if (!check("index", footer.index_handle(), smallest, largest, false) ||
+      !check("metaindex", footer.metaindex_handle(), smallest, largest,
+             false)) {
+    return result;
+  }
+  auto ropts = ldb::ReadOptions();
+  ropts.fill_cache = false;
+  for (const auto *handle :
+       {&footer.metaindex_handle(), &footer.index_handle()}) {
+    ldb::BlockContents contents;
+    status = ldb::ReadBlock(data.get(), *opts, ropts, *handle, &contents);
+    if (!status.ok()) {
+      return whole_table(status);
+    }
+    ldb::Block index(contents);
+    // Metaindex keys are names like filter.<policy> and sort bytewise, the
+    // index uses the table comparator
+    const bool data_blocks = handle == &footer.index_handle();
+    auto iter = std::unique_ptr<ldb::Iterator>(index.NewIterator(
+        data_blocks ? opts->comparator : ldb::BytewiseComparator()));
+    // Keys of data block i are after index key i - 1 and up to index key i
+    std::string first_key = smallest;
+    for (iter->SeekToFirst(); iter->Valid(); iter->Next()) {
+      ldb::BlockHandle block_handle;
+      auto handle_input = iter->value();
+      status = block_handle.DecodeFrom(&handle_input);
+      if (!status.ok()) {
+        return whole_table(status);
+      }
+      if (!data_blocks) {
+        check("filter", block_handle, smallest, largest, false);
+        continue;
+      }
+      auto last_key = user_key(iter->key());
+      check("data", block_handle, first_key, last_key, decode);
+      first_key = std::move(last_key);
+    }
+    if (!iter->status().ok()) {
+      return whole_table(iter->status());
+    }
+  }
+  return result;
+}
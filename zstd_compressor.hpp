@@ -0,0 +1,126 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+
+#include "leveldb/compressor.h"
+#include "utils.hpp"
+#include "zstd.h"
+
+namespace ldb = leveldb;
+
+namespace zstd_detail {
+struct cctx_deleter {
+  void operator()(ZSTD_CCtx *ctx) const { ZSTD_freeCCtx(ctx); }
+};
+struct dctx_deleter {
+  void operator()(ZSTD_DCtx *ctx) const { ZSTD_freeDCtx(ctx); }
+};
+struct cdict_deleter {
+  void operator()(ZSTD_CDict *dict) const { ZSTD_freeCDict(dict); }
+};
+struct ddict_deleter {
+  void operator()(ZSTD_DDict *dict) const { ZSTD_freeDDict(dict); }
+};
+
+// leveldb calls compressors from several threads at once, each one gets its
+// own contexts
+ZSTD_CCtx *thread_cctx() {
+  thread_local std::unique_ptr<ZSTD_CCtx, cctx_deleter> ctx(ZSTD_createCCtx());
+  return ctx.get();
+}
+ZSTD_DCtx *thread_dctx() {
+  thread_local std::unique_ptr<ZSTD_DCtx, dctx_deleter> ctx(ZSTD_createDCtx());
+  return ctx.get();
+}
+}  // namespace zstd_detail
+
+// Dictionary trained with train-dict, blocks compressed with one can only be
+// read when the same dictionary is loaded
+class zstd_dictionary {
+ public:
+  UTILS_NOT_COPYABLE(zstd_dictionary)
+  UTILS_NOT_MOVEABLE(zstd_dictionary)
+  explicit zstd_dictionary(std::string &&content)
+      : content(std::move(content)),
+        ddict(ZSTD_createDDict(this->content.data(), this->content.size())) {}
+
+  bool valid() const { return ddict != nullptr; }
+  // 0 for raw content dictionaries, which frames can't refer to
+  unsigned id() const { return ZSTD_getDictID_fromDDict(ddict.get()); }
+
+  const std::string content;
+  const std::unique_ptr<ZSTD_DDict, zstd_detail::ddict_deleter> ddict;
+};
+
+// Not one of the compressors Bedrock knows about, DBs written with it can only
+// be read with this tool until they are copied with another compressor
+class zstd_compressor : public ldb::Compressor {
+ public:
+  static const int SERIALIZE_ID = 16;
+  static const int default_level = ZSTD_CLEVEL_DEFAULT;
+
+  explicit zstd_compressor(
+      const int level = default_level,
+      std::shared_ptr<const zstd_dictionary> dictionary = {})
+      : ldb::Compressor(SERIALIZE_ID),
+        level(level),
+        dictionary(std::move(dictionary)),
+        cdict(this->dictionary
+                  ? ZSTD_createCDict(this->dictionary->content.data(),
+                                     this->dictionary->content.size(), level)
+                  : nullptr) {}
+
+  const int level;
+  const std::shared_ptr<const zstd_dictionary> dictionary;
+
+  void compressImpl(const char *input, size_t length,
+                    std::string &output) const override {
+    output.resize(ZSTD_compressBound(length));
+    auto *ctx = zstd_detail::thread_cctx();
+    const auto size =
+        cdict ? ZSTD_compress_usingCDict(ctx, output.data(), output.size(),
+                                         input, length, cdict.get())
+              : ZSTD_compressCCtx(ctx, output.data(), output.size(), input,
+                                  length, level);
+    if (ZSTD_isError(size)) {
+      // compressImpl has no way to report errors and the bound is always big
+      // enough, this only happens when zstd fails to allocate
+      fprintf(stderr, "zstd compression failed: %s\n",
+              ZSTD_getErrorName(size));
+      std::abort();
+    }
+    output.resize(size);
+  }
+
+  bool decompress(const char *input, size_t length,
+                  std::string &output) const override {
+    const auto content_size = ZSTD_getFrameContentSize(input, length);
+    if (content_size == ZSTD_CONTENTSIZE_ERROR ||
+        content_size == ZSTD_CONTENTSIZE_UNKNOWN) {
+      return false;
+    }
+    const auto dict_id = ZSTD_getDictID_fromFrame(input, length);
+    if (dict_id != 0 && (!dictionary || dictionary->id() != dict_id)) {
+      return false;
+    }
+    output.resize(content_size);
+    auto *ctx = zstd_detail::thread_dctx();
+    const auto size =
+        dict_id != 0
+            ? ZSTD_decompress_usingDDict(ctx, output.data(), output.size(),
+                                         input, length,
+                                         dictionary->ddict.get())
+            : ZSTD_decompressDCtx(ctx, output.data(), output.size(), input,
+                                  length);
+    if (ZSTD_isError(size) || size != content_size) {
+      return false;
+    }
+    return true;
+  }
+
+ private:
+  const std::unique_ptr<ZSTD_CDict, zstd_detail::cdict_deleter> cdict;
+};